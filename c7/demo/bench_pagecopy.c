@@ -0,0 +1,59 @@
+/* Benchmark of the page copy variants of stm/pagecopy.c on this cpu.
+   setup_pagecopy() picks the fastest one in the same way, with the
+   small cache-hot run; the large run shows when the non-temporal
+   stores help.  STM_PAGECOPY=<name> forces a variant in the library. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define stm_fatalerror(...)   (fprintf(stderr, __VA_ARGS__), abort())
+
+#include "../stm/pagecopy.h"
+#include "../stm/pagecopy.c"
+
+
+static void run(const char *title, long npages)
+{
+    struct pagecopy_variant_s *v, *best_v = NULL;
+    double best = -1.0;
+    char *buf;
+
+    if (posix_memalign((void **)&buf, 4096, 2 * npages * 4096L) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(buf, 0x5a, 2 * npages * 4096L);
+
+    printf("%s (%ld pages):\n", title, npages);
+    for (v = pagecopy_variants; v->name != NULL; v++) {
+        if (!pagecopy_variant_supported(v)) {
+            printf("    %-8s  not supported\n", v->name);
+            continue;
+        }
+        double t = pagecopy_measure(v->fn, buf + npages * 4096L, buf,
+                                    npages);
+        printf("    %-8s  %8.1f ns per page\n", v->name, t);
+        if (best < 0.0 || t < best) {
+            best = t;
+            best_v = v;
+        }
+    }
+    printf("    fastest: %s\n\n", best_v->name);
+    free(buf);
+}
+
+int main(void)
+{
+    run("cache-hot", PAGECOPY_BENCH_PAGES);
+    run("cache-cold", 16384);
+
+    setup_pagecopy();
+    struct pagecopy_variant_s *v;
+    for (v = pagecopy_variants; v->name != NULL; v++)
+        if (v->fn == pagecopy_fn)
+            printf("setup_pagecopy() picks: %s\n", v->name);
+    return 0;
+}
@@ -0,0 +1,158 @@
+/* Microbenchmark of the read barrier.  Every thread runs transactions
+   that call stm_read() on all the "objects" of one shared old region,
+   with one object every 'stride' bytes, several times per transaction.
+   Build it with and without -DSTM_CONDITIONAL_READ_BARRIER and compare
+   (see "make bench-read-barrier"). */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "stmgc.h"
+
+#define REGION_SIZE    (1024 * 1024)
+#define PASSES         8       /* over the region, in each transaction */
+#define TRANSACTIONS   40
+
+
+typedef TLPREFIX struct region_s region_t;
+struct region_s {
+    struct object_s hdr;
+    long size;
+};
+
+__thread stm_thread_local_t stm_thread_local;
+static object_t *region;
+static pthread_barrier_t start_barrier;
+
+
+ssize_t stmcb_size_rounded_up(struct object_s *ob)
+{
+    return ((struct region_s *)ob)->size;
+}
+
+void stmcb_trace(struct object_s *obj, void visit(object_t **))
+{
+}
+long stmcb_obj_supports_cards(struct object_s *obj)
+{
+    return 0;
+}
+void stmcb_commit_soon() {}
+
+void stmcb_trace_cards(struct object_s *obj, void cb(object_t **),
+                       uintptr_t start, uintptr_t stop) {
+    abort();
+}
+void stmcb_get_card_base_itemsize(struct object_s *obj,
+                                  uintptr_t offset_itemsize[2]) {
+    abort();
+}
+
+
+struct bench_s {
+    long stride;
+    double ns;           /* result: nanoseconds per stm_read() */
+};
+
+static void *bench_thread(void *arg)
+{
+    struct bench_s *b = arg;
+    rewind_jmp_buf rjbuf;
+    struct timespec t0, t1;
+    long sum = 0, n = 0;
+    int t, pass;
+    uintptr_t ofs;
+
+    stm_register_thread_local(&stm_thread_local);
+    stm_rewind_jmp_enterframe(&stm_thread_local, &rjbuf);
+    pthread_barrier_wait(&start_barrier);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (t = 0; t < TRANSACTIONS; t++) {
+        stm_start_transaction(&stm_thread_local);
+        for (pass = 0; pass < PASSES; pass++) {
+            for (ofs = 0; ofs < REGION_SIZE; ofs += b->stride) {
+                object_t *obj = (object_t *)(((uintptr_t)region) + ofs);
+                stm_read(obj);
+                sum += ((stm_char *)obj)[8];
+            }
+        }
+        stm_commit_transaction();
+        n += PASSES * (REGION_SIZE / b->stride);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    b->ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / n;
+    if (sum == 42)
+        printf("\n");      /* keep 'sum' alive */
+
+    stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
+    stm_unregister_thread_local(&stm_thread_local);
+    return NULL;
+}
+
+static double run(long stride, int nthreads)
+{
+    /* returns the average time of one stm_read(), in nanoseconds */
+    struct bench_s b[nthreads];
+    pthread_t th[nthreads];
+    double total = 0.0;
+    int i;
+
+    pthread_barrier_init(&start_barrier, NULL, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        b[i].stride = stride;
+        if (pthread_create(&th[i], NULL, bench_thread, &b[i]) != 0)
+            abort();
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(th[i], NULL);
+        total += b[i].ns;
+    }
+    pthread_barrier_destroy(&start_barrier);
+    return total / nthreads;
+}
+
+
+int main(void)
+{
+    static const long strides[] = { 16, 64, 256, 4096 };
+    int nthreads, i;
+    rewind_jmp_buf rjbuf;
+
+    stm_setup();
+    stm_register_thread_local(&stm_thread_local);
+    stm_rewind_jmp_enterframe(&stm_thread_local, &rjbuf);
+
+    stm_start_inevitable_transaction(&stm_thread_local);
+    region = stm_allocate(REGION_SIZE);
+    ((region_t *)region)->size = REGION_SIZE;
+    stm_commit_transaction();
+    STM_PUSH_ROOT(stm_thread_local, region);
+
+#ifdef STM_CONDITIONAL_READ_BARRIER
+    printf("conditional read barrier, ns per stm_read():\n");
+#else
+    printf("unconditional read barrier, ns per stm_read():\n");
+#endif
+    printf("%8s", "stride");
+    for (nthreads = 1; nthreads <= stm_get_nb_segments(); nthreads *= 2)
+        printf("%10d thr", nthreads);
+    printf("\n");
+
+    for (i = 0; i < sizeof(strides) / sizeof(*strides); i++) {
+        printf("%8ld", strides[i]);
+        for (nthreads = 1; nthreads <= stm_get_nb_segments(); nthreads *= 2)
+            printf("%14.2f", run(strides[i], nthreads));
+        printf("\n");
+    }
+
+    STM_POP_ROOT(stm_thread_local, region);
+    stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
+    stm_unregister_thread_local(&stm_thread_local);
+    stm_teardown();
+    return 0;
+}
@@ -0,0 +1,175 @@
+/* Stress test for the card-level write locks (see CARDS_LOCKED in
+   stm/core.h): all threads increment random items of one small shared
+   array, so that they keep taking and releasing the same few card
+   locks concurrently.  Some transactions instead take the whole object
+   with stm_write(), which must upgrade from the card locks, or go
+   through _stm_write_slowpath_card_extra() like the JIT does; some do
+   a minor collection in the middle.  At the end, the counts are
+   compared with a sequential computation. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "stmgc.h"
+
+#define NTHREADS       4
+#define NCARDS         16
+#define NITEMS         (NCARDS * _STM_CARD_SIZE)
+#define TRANSACTIONS   3000
+#define INCR_PER_TRANSACTION  6
+#define WHOLE_EVERY    10     /* one transaction in 10 uses stm_write() */
+#define JIT_EVERY      7      /* ...one in 7 the JIT's slow path */
+#define MINOR_EVERY    13     /* ...and one in 13 a minor collection */
+
+
+typedef TLPREFIX struct array_s array_t;
+struct array_s {
+    struct object_s hdr;
+    long length;
+    long items[];
+};
+
+__thread stm_thread_local_t stm_thread_local;
+static object_t *array;
+static long total_aborts = 0;
+
+
+ssize_t stmcb_size_rounded_up(struct object_s *ob)
+{
+    return sizeof(struct array_s) +
+        ((struct array_s *)ob)->length * sizeof(long);
+}
+
+void stmcb_trace(struct object_s *obj, void visit(object_t **))
+{
+}
+long stmcb_obj_supports_cards(struct object_s *obj)
+{
+    return 1;
+}
+void stmcb_commit_soon() {}
+
+void stmcb_trace_cards(struct object_s *obj, void cb(object_t **),
+                       uintptr_t start, uintptr_t stop) {
+}
+void stmcb_get_card_base_itemsize(struct object_s *obj,
+                                  uintptr_t offset_itemsize[2]) {
+    offset_itemsize[0] = sizeof(struct array_s);
+    offset_itemsize[1] = sizeof(long);
+}
+
+
+static void *card_locks_thread(void *arg)
+{
+    long id = (long)arg;
+    rewind_jmp_buf rjbuf;
+    unsigned int seed;
+    long t, i, aborts = 0;
+
+    stm_register_thread_local(&stm_thread_local);
+    stm_rewind_jmp_enterframe(&stm_thread_local, &rjbuf);
+
+    for (t = 0; t < TRANSACTIONS; t++) {
+        /* restarts from here after an abort, with the same items */
+        if (stm_start_transaction(&stm_thread_local) > 0)
+            aborts++;
+        seed = id * TRANSACTIONS + t;
+
+        if (t % WHOLE_EVERY == id) {
+            stm_write(array);
+        }
+        else if (t % JIT_EVERY == id &&
+                 (array->stm_flags & _STM_GCFLAG_WRITE_BARRIER) &&
+                 !(array->stm_flags & _STM_GCFLAG_CARDS_SET)) {
+            /* the JIT calls this if the array has no CARDS_SET; it
+               takes the whole object, and the cards below are marked
+               without card locks */
+            _stm_write_slowpath_card_extra(array);
+        }
+
+        for (i = 0; i < INCR_PER_TRANSACTION; i++) {
+            long index = rand_r(&seed) % NITEMS;
+            stm_read_range(array, index, index + 1);
+            stm_write_card(array, index);
+            ((array_t *)array)->items[index]++;
+
+            if (i == INCR_PER_TRANSACTION / 2 && t % MINOR_EVERY == id)
+                stm_collect(0);
+        }
+        stm_commit_transaction();
+    }
+
+    __sync_fetch_and_add(&total_aborts, aborts);
+    stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
+    stm_unregister_thread_local(&stm_thread_local);
+    return NULL;
+}
+
+static void check_array(void)
+{
+    static long expected[NITEMS];
+    unsigned int seed;
+    long id, t, i;
+
+    for (id = 0; id < NTHREADS; id++) {
+        for (t = 0; t < TRANSACTIONS; t++) {
+            seed = id * TRANSACTIONS + t;
+            for (i = 0; i < INCR_PER_TRANSACTION; i++)
+                expected[rand_r(&seed) % NITEMS]++;
+        }
+    }
+
+    stm_start_inevitable_transaction(&stm_thread_local);
+    stm_read(array);
+    for (i = 0; i < NITEMS; i++) {
+        if (((array_t *)array)->items[i] != expected[i]) {
+            fprintf(stderr, "item %ld: %ld instead of %ld\n", i,
+                    ((array_t *)array)->items[i], expected[i]);
+            abort();
+        }
+    }
+    stm_commit_transaction();
+}
+
+
+int main(void)
+{
+    pthread_t th[NTHREADS];
+    rewind_jmp_buf rjbuf;
+    long i;
+
+    stm_setup();
+    assert(stm_get_nb_segments() >= NTHREADS);
+    stm_register_thread_local(&stm_thread_local);
+    stm_rewind_jmp_enterframe(&stm_thread_local, &rjbuf);
+
+    stm_start_inevitable_transaction(&stm_thread_local);
+    array = stm_allocate(sizeof(struct array_s) + NITEMS * sizeof(long));
+    ((array_t *)array)->length = NITEMS;
+    for (i = 0; i < NITEMS; i++)
+        ((array_t *)array)->items[i] = 0;
+    STM_PUSH_ROOT(stm_thread_local, array);
+    stm_commit_transaction();
+    /* reload the moved object, and keep it alive until the end */
+    STM_POP_ROOT(stm_thread_local, array);
+    STM_PUSH_ROOT(stm_thread_local, array);
+
+    for (i = 0; i < NTHREADS; i++) {
+        if (pthread_create(&th[i], NULL, card_locks_thread, (void *)i) != 0)
+            abort();
+    }
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join(th[i], NULL);
+
+    check_array();
+    printf("aborts: %ld\n", total_aborts);
+    printf("Test OK!\n");
+
+    STM_POP_ROOT(stm_thread_local, array);
+    stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
+    stm_unregister_thread_local(&stm_thread_local);
+    stm_teardown();
+    return 0;
+}
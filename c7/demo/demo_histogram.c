@@ -0,0 +1,172 @@
+/* A parallel histogram: every thread adds counts to the buckets of one
+   shared array, nearly always in its own shard of the buckets.  The
+   array uses card marking, and the cards are write-locked individually
+   (see CARDS_LOCKED in stm/core.h), so the transactions of different
+   threads commit in parallel unless they really change the same card.
+   At the end, the counts are compared with a sequential computation. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "stmgc.h"
+
+#define NTHREADS       4
+#define NBUCKETS       (64 * 1024)    /* 2048 cards */
+#define TRANSACTIONS   2000
+#define INCR_PER_TRANSACTION  20
+#define FOREIGN_EVERY  100    /* one increment in 100 is in another shard */
+
+
+typedef TLPREFIX struct histogram_s histogram_t;
+struct histogram_s {
+    struct object_s hdr;
+    long nbuckets;
+    long counts[];
+};
+
+__thread stm_thread_local_t stm_thread_local;
+static object_t *histogram;
+static long total_aborts = 0;
+static long total_aborted_work = 0;
+
+
+ssize_t stmcb_size_rounded_up(struct object_s *ob)
+{
+    return sizeof(struct histogram_s) +
+        ((struct histogram_s *)ob)->nbuckets * sizeof(long);
+}
+
+void stmcb_trace(struct object_s *obj, void visit(object_t **))
+{
+}
+long stmcb_obj_supports_cards(struct object_s *obj)
+{
+    return 1;
+}
+void stmcb_commit_soon() {}
+
+void stmcb_trace_cards(struct object_s *obj, void cb(object_t **),
+                       uintptr_t start, uintptr_t stop) {
+}
+void stmcb_get_card_base_itemsize(struct object_s *obj,
+                                  uintptr_t offset_itemsize[2]) {
+    offset_itemsize[0] = sizeof(struct histogram_s);
+    offset_itemsize[1] = sizeof(long);
+}
+
+
+static long next_bucket(long id, unsigned int *seed)
+{
+    long shard = NBUCKETS / NTHREADS;
+    long bucket = rand_r(seed) % shard;
+    if (rand_r(seed) % FOREIGN_EVERY == 0)
+        return bucket + (rand_r(seed) % NTHREADS) * shard;
+    return bucket + id * shard;
+}
+
+static void *histogram_thread(void *arg)
+{
+    long id = (long)arg;
+    rewind_jmp_buf rjbuf;
+    unsigned int seed;
+    long t, i, aborts = 0;
+
+    stm_register_thread_local(&stm_thread_local);
+    stm_rewind_jmp_enterframe(&stm_thread_local, &rjbuf);
+
+    for (t = 0; t < TRANSACTIONS; t++) {
+        /* restarts from here after an abort, with the same buckets */
+        if (stm_start_transaction(&stm_thread_local) > 0)
+            aborts++;
+        seed = id * TRANSACTIONS + t;
+        for (i = 0; i < INCR_PER_TRANSACTION; i++) {
+            long bucket = next_bucket(id, &seed);
+            stm_read_range(histogram, bucket, bucket + 1);
+            stm_write_card(histogram, bucket);
+            ((histogram_t *)histogram)->counts[bucket]++;
+        }
+        stm_commit_transaction();
+    }
+
+    __sync_fetch_and_add(&total_aborts, aborts);
+    __sync_fetch_and_add(&total_aborted_work,
+                         stm_thread_local.total_aborted_work);
+    stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
+    stm_unregister_thread_local(&stm_thread_local);
+    return NULL;
+}
+
+static void check_histogram(void)
+{
+    static long expected[NBUCKETS];
+    unsigned int seed;
+    long id, t, i;
+
+    for (id = 0; id < NTHREADS; id++) {
+        for (t = 0; t < TRANSACTIONS; t++) {
+            seed = id * TRANSACTIONS + t;
+            for (i = 0; i < INCR_PER_TRANSACTION; i++)
+                expected[next_bucket(id, &seed)]++;
+        }
+    }
+
+    stm_start_inevitable_transaction(&stm_thread_local);
+    stm_read(histogram);
+    for (i = 0; i < NBUCKETS; i++) {
+        if (((histogram_t *)histogram)->counts[i] != expected[i]) {
+            fprintf(stderr, "bucket %ld: %ld instead of %ld\n", i,
+                    ((histogram_t *)histogram)->counts[i], expected[i]);
+            abort();
+        }
+    }
+    stm_commit_transaction();
+}
+
+
+int main(void)
+{
+    pthread_t th[NTHREADS];
+    struct timespec t0, t1;
+    rewind_jmp_buf rjbuf;
+    long i;
+
+    stm_setup();
+    assert(stm_get_nb_segments() >= NTHREADS);
+    stm_register_thread_local(&stm_thread_local);
+    stm_rewind_jmp_enterframe(&stm_thread_local, &rjbuf);
+
+    stm_start_inevitable_transaction(&stm_thread_local);
+    histogram = stm_allocate(sizeof(struct histogram_s) +
+                             NBUCKETS * sizeof(long));
+    ((histogram_t *)histogram)->nbuckets = NBUCKETS;
+    for (i = 0; i < NBUCKETS; i++)
+        ((histogram_t *)histogram)->counts[i] = 0;
+    STM_PUSH_ROOT(stm_thread_local, histogram);
+    stm_commit_transaction();
+    /* reload the moved object, and keep it alive until the end */
+    STM_POP_ROOT(stm_thread_local, histogram);
+    STM_PUSH_ROOT(stm_thread_local, histogram);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < NTHREADS; i++) {
+        if (pthread_create(&th[i], NULL, histogram_thread, (void *)i) != 0)
+            abort();
+    }
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join(th[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    check_histogram();
+    printf("time: %.3f s, aborts: %ld, aborted work: %ld\n",
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9,
+           total_aborts, total_aborted_work);
+
+    STM_POP_ROOT(stm_thread_local, histogram);
+    stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
+    stm_unregister_thread_local(&stm_thread_local);
+    stm_teardown();
+    return 0;
+}
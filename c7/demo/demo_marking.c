@@ -0,0 +1,294 @@
+/* Stress test for the parallel marking of major collections: every
+   thread keeps lists of nodes reachable from its own hashtable and from
+   its own card-marked array, and changes them in transactions while
+   major collections run.  The threads stopped at the safe point help
+   with the marking (see stm_set_major_gc_marking_threads()).  After
+   each transaction, the thread checks that all its lists are intact. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+
+#include "stmgc.h"
+
+#define NUMTHREADS     4
+#define ROUNDS         150
+#define UPDATES        40     /* per transaction */
+#define NKEYS          500    /* per hashtable */
+#define NITEMS         2000   /* per array */
+#define LIST_LENGTH    8
+#define COLLECT_EVERY  5      /* rounds between forced major collections */
+
+
+typedef TLPREFIX struct node_s node_t;
+typedef TLPREFIX struct dict_s dict_t;
+typedef TLPREFIX struct array_s array_t;
+
+struct node_s {
+    struct object_s hdr;
+    int typeid;
+    long value;
+    node_t *next;
+};
+
+struct dict_s {
+    struct object_s hdr;
+    int typeid;
+    stm_hashtable_t *hashtable;
+};
+
+struct array_s {
+    struct object_s hdr;
+    int typeid;
+    long length;
+    object_t *items[];
+};
+
+#define TID_NODE       0x01234567
+#define TID_DICT       0x56789ABC
+#define TID_DICTENTRY  0x6789ABCD
+#define TID_ARRAY      0x789ABCDE
+
+
+static sem_t done;
+__thread stm_thread_local_t stm_thread_local;
+static dict_t *dicts[NUMTHREADS];
+
+
+ssize_t stmcb_size_rounded_up(struct object_s *ob)
+{
+    switch (((struct node_s *)ob)->typeid) {
+    case TID_NODE:
+        return sizeof(struct node_s);
+    case TID_DICT:
+        return sizeof(struct dict_s);
+    case TID_DICTENTRY:
+        return sizeof(struct stm_hashtable_entry_s);
+    case TID_ARRAY:
+        return sizeof(struct array_s) +
+            ((struct array_s *)ob)->length * sizeof(object_t *);
+    }
+    abort();
+}
+
+void stmcb_trace(struct object_s *obj, void visit(object_t **))
+{
+    long i;
+    switch (((struct node_s *)obj)->typeid) {
+    case TID_NODE:
+        visit((object_t **)&((struct node_s *)obj)->next);
+        return;
+    case TID_DICT:
+        stm_hashtable_tracefn(((struct dict_s *)obj)->hashtable, visit);
+        return;
+    case TID_DICTENTRY:
+        visit(&((struct stm_hashtable_entry_s *)obj)->object);
+        return;
+    case TID_ARRAY:
+        for (i = 0; i < ((struct array_s *)obj)->length; i++)
+            visit(&((struct array_s *)obj)->items[i]);
+        return;
+    }
+    abort();
+}
+
+void stmcb_commit_soon() {}
+
+long stmcb_obj_supports_cards(struct object_s *obj)
+{
+    return ((struct node_s *)obj)->typeid == TID_ARRAY;
+}
+void stmcb_trace_cards(struct object_s *obj, void visit(object_t **),
+                       uintptr_t start, uintptr_t stop)
+{
+    struct array_s *a = (struct array_s *)obj;
+    uintptr_t i;
+    assert(a->typeid == TID_ARRAY);
+    /* the last card may go past the end */
+    for (i = start; i < stop && i < a->length; i++)
+        visit(&a->items[i]);
+}
+void stmcb_get_card_base_itemsize(struct object_s *obj,
+                                  uintptr_t offset_itemsize[2])
+{
+    offset_itemsize[0] = sizeof(struct array_s);
+    offset_itemsize[1] = sizeof(object_t *);
+}
+
+
+static object_t *make_list(long value)
+{
+    /* the nodes have the values 'value', 'value + 1', ... */
+    node_t *head = NULL;
+    long i;
+    for (i = LIST_LENGTH - 1; i >= 0; i--) {
+        STM_PUSH_ROOT(stm_thread_local, head);
+        node_t *n = (node_t *)stm_allocate(sizeof(struct node_s));
+        STM_POP_ROOT(stm_thread_local, head);
+        n->typeid = TID_NODE;
+        n->value = value + i;
+        n->next = head;
+        head = n;
+    }
+    return (object_t *)head;
+}
+
+static void check_list(object_t *lst, long value)
+{
+    /* 0 means no list */
+    node_t *n = (node_t *)lst;
+    long i;
+    if (value == 0) {
+        if (n != NULL) {
+            fprintf(stderr, "list found instead of none\n");
+            abort();
+        }
+        return;
+    }
+    for (i = 0; i < LIST_LENGTH; i++) {
+        stm_read((object_t *)n);
+        if (n->typeid != TID_NODE || n->value != value + i) {
+            fprintf(stderr, "list %ld broken at node %ld\n", value, i);
+            abort();
+        }
+        n = n->next;
+    }
+    if (n != NULL) {
+        fprintf(stderr, "list %ld too long\n", value);
+        abort();
+    }
+}
+
+static void *marking_thread(void *arg)
+{
+    long id = (long)arg;
+    rewind_jmp_buf rjbuf;
+    static __thread long key_values[NKEYS], item_values[NITEMS];
+    long changed[UPDATES], new_values[UPDATES];
+    object_t *array;
+    dict_t *dict = dicts[id];
+    long round, i;
+
+    stm_register_thread_local(&stm_thread_local);
+    stm_rewind_jmp_enterframe(&stm_thread_local, &rjbuf);
+
+    stm_start_inevitable_transaction(&stm_thread_local);
+    array = stm_allocate(sizeof(struct array_s) +
+                         NITEMS * sizeof(object_t *));
+    ((array_t *)array)->typeid = TID_ARRAY;
+    ((array_t *)array)->length = NITEMS;
+    for (i = 0; i < NITEMS; i++)
+        ((array_t *)array)->items[i] = NULL;
+    STM_PUSH_ROOT(stm_thread_local, array);
+    stm_commit_transaction();
+
+    for (round = 1; round <= ROUNDS; round++) {
+        /* restarts from here after an abort, with the same changes */
+        stm_start_transaction(&stm_thread_local);
+        STM_POP_ROOT(stm_thread_local, array);
+        STM_PUSH_ROOT(stm_thread_local, array);
+
+        unsigned int seed = id * ROUNDS + round;
+        for (i = 0; i < UPDATES; i++) {
+            /* a new list, or none, for a key or an item */
+            long k = rand_r(&seed) % (NKEYS + NITEMS);
+            long value = 0;
+            if (rand_r(&seed) % 8 != 0)
+                value = ((id * ROUNDS + round) * UPDATES + i) * LIST_LENGTH + 1;
+            object_t *lst = value ? make_list(value) : NULL;
+            STM_POP_ROOT(stm_thread_local, array);
+            STM_PUSH_ROOT(stm_thread_local, array);
+
+            if (k < NKEYS) {
+                stm_hashtable_write((object_t *)dict, dict->hashtable, k,
+                                    lst, &stm_thread_local);
+            }
+            else {
+                stm_write_card(array, k - NKEYS);
+                ((array_t *)array)->items[k - NKEYS] = lst;
+            }
+            changed[i] = k;
+            new_values[i] = value;
+        }
+
+        if (id == 0 && round % COLLECT_EVERY == 0)
+            stm_collect(1);
+        stm_commit_transaction();
+
+        /* committed: these are the values to expect now */
+        for (i = 0; i < UPDATES; i++) {
+            long k = changed[i];
+            if (k < NKEYS)
+                key_values[k] = new_values[i];
+            else
+                item_values[k - NKEYS] = new_values[i];
+        }
+
+        stm_start_inevitable_transaction(&stm_thread_local);
+        STM_POP_ROOT(stm_thread_local, array);
+        STM_PUSH_ROOT(stm_thread_local, array);
+        stm_read((object_t *)dict);
+        for (i = 0; i < NKEYS; i++)
+            check_list(stm_hashtable_read((object_t *)dict, dict->hashtable,
+                                          i), key_values[i]);
+        stm_read(array);
+        for (i = 0; i < NITEMS; i++)
+            check_list(((array_t *)array)->items[i], item_values[i]);
+        stm_commit_transaction();
+    }
+
+    STM_POP_ROOT(stm_thread_local, array);
+    stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
+    stm_unregister_thread_local(&stm_thread_local);
+
+    int status = sem_post(&done); assert(status == 0);
+    return NULL;
+}
+
+
+int main(void)
+{
+    pthread_t th;
+    rewind_jmp_buf rjbuf;
+    long i;
+    int status;
+
+    stm_hashtable_entry_userdata = TID_DICTENTRY;
+    status = sem_init(&done, 0, 0); assert(status == 0);
+
+    stm_setup();
+    assert(stm_get_nb_segments() >= NUMTHREADS);
+    /* even with fewer CPUs, so that several threads mark */
+    stm_set_major_gc_marking_threads(NUMTHREADS);
+    stm_register_thread_local(&stm_thread_local);
+    stm_rewind_jmp_enterframe(&stm_thread_local, &rjbuf);
+
+    stm_start_inevitable_transaction(&stm_thread_local);
+    for (i = 0; i < NUMTHREADS; i++) {
+        /* a different template for each, see stm_setup_prebuilt() */
+        static struct dict_s templ[NUMTHREADS];
+        templ[i].typeid = TID_DICT;
+        templ[i].hashtable = stm_hashtable_create();
+        dicts[i] = (dict_t *)stm_setup_prebuilt(
+                       (object_t *)(uintptr_t)&templ[i]);
+    }
+    stm_commit_transaction();
+
+    for (i = 0; i < NUMTHREADS; i++) {
+        if (pthread_create(&th, NULL, marking_thread, (void *)i) != 0)
+            abort();
+        pthread_detach(th);
+    }
+    for (i = 0; i < NUMTHREADS; i++) {
+        status = sem_wait(&done); assert(status == 0);
+    }
+    printf("Test OK!\n");
+
+    stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
+    stm_unregister_thread_local(&stm_thread_local);
+    stm_teardown();
+    return 0;
+}
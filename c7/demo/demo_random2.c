@@ -6,6 +6,8 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #include "stmgc.h"
 
@@ -24,6 +26,7 @@ typedef TLPREFIX struct node_s node_t;
 typedef node_t* nodeptr_t;
 typedef object_t* objptr_t;
 int num_forked_children = 0;
+long total_aborted_work = 0;
 
 struct node_s {
     struct object_s hdr;
@@ -431,6 +434,8 @@ void *demo_random(void *arg)
 
     stm_commit_transaction();
 
+    __sync_fetch_and_add(&total_aborted_work,
+                         stm_thread_local.total_aborted_work);
     stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
     stm_unregister_thread_local(&stm_thread_local);
 
@@ -481,6 +486,8 @@ int main(void)
 {
     int i, status;
     rewind_jmp_buf rjbuf;
+    struct timespec t0, t1;
+    struct rusage usage;
 
     /* pick a random seed from the time in seconds.
        A bit pointless for now... because the interleaving of the
@@ -497,6 +504,7 @@ int main(void)
     stm_rewind_jmp_enterframe(&stm_thread_local, &rjbuf);
 
     setup_globals();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
 
     int thread_starts = NUMTHREADS * THREAD_STARTS;
     for (i = 0; i < NUMTHREADS; i++) {
@@ -530,6 +538,12 @@ int main(void)
         }
     }
 
+    /* for comparing builds, e.g. with -DSTM_READMARKER_SHIFT=6 */
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    getrusage(RUSAGE_SELF, &usage);
+    printf("time: %.3f s, aborted work: %ld, max rss: %ld kB\n",
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9,
+           total_aborted_work, usage.ru_maxrss);
     printf("Test OK!\n");
 
     stm_rewind_jmp_leaveframe(&stm_thread_local, &rjbuf);
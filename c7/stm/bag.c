@@ -72,7 +72,7 @@ struct stm_bag_s {
     bag_node_t *tail;   /* the newest committed element in the bag */
 
     struct {
-    } by_segment[NB_SEGMENTS];
+    } by_segment[NB_SEGMENTS_MAX];
 };
 
 stm_bag_t *stm_bag_create(void)
@@ -96,7 +96,7 @@ void stm_bag_free(stm_bag_t *bag)
 {
     int i;
     bag_node_free_rec(bag->tail);
-    for (i = 0; i < NB_SEGMENTS; i++) {
+    for (i = 0; i < nb_segments; i++) {
         bag_node_free_rec(bag->by_segment[i].added);
         bag_node_free_rec(bag->by_segment[i].removed);
     }
@@ -112,6 +112,10 @@ void stm_bag_add(stm_bag_t *bag, object_t *newobj)
     assert(p);       /* XXX */
 
     p->value = newobj;
+    if (UNLIKELY(major_marking_in_progress) && !_is_young(newobj)) {
+        /* 'newobj' might not be traced so far; see gcpage.c */
+        LIST_APPEND(STM_PSEGMENT->marking_dirty_objects, newobj);
+    }
     while (1) {
         bag_node_t *old = *p_added;
         p->next = old;
@@ -131,7 +135,7 @@ object_t *stm_bag_try_pop(stm_bag_t *bag)
            occasional nonsense, but it should not matter here */
         int i;
         stm_bag_seg_t *src = NULL;
-        for (i = 0; i < STM_NB_SEGMENTS; i++) {
+        for (i = 0; i < nb_segments; i++) {
             stm_bag_seg_t *other = &bag->by_segment[i];
             uintptr_t *left = other->deque_left;
             uintptr_t *middle = other->deque_left;
@@ -181,7 +185,7 @@ void stm_bag_tracefn(stm_bag_t *bag, void trace(object_t **))
     }
     else {
         int i;
-        for (i = 0; i < NB_SEGMENTS; i++) {
+        for (i = 0; i < nb_segments; i++) {
             stm_bag_seg_t *bs = &bag->by_segment[i];
             deque_trace(bs->deque_left, bs->deque_right, trace);
         }
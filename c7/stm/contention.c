@@ -45,35 +45,74 @@
 */
 
 
-struct contmgr_s {
-    enum stm_event_e kind;
-    struct stm_priv_segment_info_s *other_pseg;
-    bool abort_other;
-    bool try_sleep;  // XXX add a way to timeout, but should handle repeated
-                     // calls to contention_management() to avoid re-sleeping
-                     // for the whole duration
-};
+/* The policies below are called with the mutex acquired, and get a
+   stm_contention_t initialized to "abort myself".  They can be chosen
+   with stm_set_contention_policy(), or 'tl->contention_policy' for a
+   single thread.  Any other function with the same signature can be
+   used, too.
+*/
+
+#ifdef STM_TESTS
+# define DEFAULT_CONTENTION_POLICY   stm_cm_abort_the_younger
+#else
+# define DEFAULT_CONTENTION_POLICY   stm_cm_pause_if_younger
+#endif
+
+static stm_contention_policy_fn *contention_policy = DEFAULT_CONTENTION_POLICY;
+
+void stm_set_contention_policy(stm_contention_policy_fn *policy)
+{
+    if (policy == NULL)
+        policy = DEFAULT_CONTENTION_POLICY;
+    contention_policy = policy;
+}
+
+static uint64_t transaction_work(struct stm_priv_segment_info_s *pseg)
+{
+    /* Estimate how much work is lost if the transaction in 'pseg'
+       aborts.  If it is running in another thread, the numbers may be
+       slightly out of date, which is fine. */
+    uint64_t nursery_used = (pseg->pub.nursery_current -
+                             (stm_char *)_stm_nursery_start);
+    if (nursery_used > NB_NURSERY_PAGES * 4096)
+        nursery_used = NB_NURSERY_PAGES * 4096;   /* see throw_away_nursery */
+
+    return (pseg->work_nursery_bytes + nursery_used +
+            list_count(pseg->modified_old_objects) *
+                CM_WORK_PER_MODIFIED_OBJECT +
+            pseg->work_pages_privatized * 4096);
+}
+
+static long contention_wait_budget = -1;
+
+void stm_set_contention_wait_budget(long microseconds)
+{
+    contention_wait_budget = microseconds >= 0 ? microseconds : -1;
+}
+
+static void teardown_contention(void)
+{
+    contention_policy = DEFAULT_CONTENTION_POLICY;
+    contention_wait_budget = -1;
+}
 
 
 /************************************************************/
 
 
-__attribute__((unused))
-static void cm_always_abort_myself(struct contmgr_s *cm)
+void stm_cm_always_abort_myself(stm_contention_t *cm)
 {
     cm->abort_other = false;
 }
 
-__attribute__((unused))
-static void cm_always_abort_other(struct contmgr_s *cm)
+void stm_cm_always_abort_other(stm_contention_t *cm)
 {
     cm->abort_other = true;
 }
 
-__attribute__((unused))
-static void cm_abort_the_younger(struct contmgr_s *cm)
+void stm_cm_abort_the_younger(stm_contention_t *cm)
 {
-    if (STM_PSEGMENT->unique_start_time >= cm->other_pseg->unique_start_time) {
+    if (cm->start_time >= cm->other_start_time) {
         /* We started after the other thread.  Abort */
         cm->abort_other = false;
     }
@@ -82,8 +121,7 @@ static void cm_abort_the_younger(struct contmgr_s *cm)
     }
 }
 
-__attribute__((unused))
-static void cm_always_wait_for_other_thread(struct contmgr_s *cm)
+void stm_cm_always_wait_for_other_thread(stm_contention_t *cm)
 {
     /* we tried this contention management, but it seems to have
        very bad cases: if thread 1 always reads an object in every
@@ -93,14 +131,13 @@ static void cm_always_wait_for_other_thread(struct contmgr_s *cm)
        thread 2 resumes again, thread 1 has already started the
        next transaction and read the object again.
     */
-    cm_abort_the_younger(cm);
+    stm_cm_abort_the_younger(cm);
     cm->try_sleep = true;
 }
 
-__attribute__((unused))
-static void cm_pause_if_younger(struct contmgr_s *cm)
+void stm_cm_pause_if_younger(stm_contention_t *cm)
 {
-    if (STM_PSEGMENT->unique_start_time >= cm->other_pseg->unique_start_time) {
+    if (cm->start_time >= cm->other_start_time) {
         /* We started after the other thread.  Pause */
         cm->try_sleep = true;
         cm->abort_other = false;
@@ -110,6 +147,45 @@ static void cm_pause_if_younger(struct contmgr_s *cm)
     }
 }
 
+void stm_cm_polite(stm_contention_t *cm)
+{
+    /* Pause until the other transaction commits, but once the budget
+       of stm_set_contention_wait_budget() is used up, abort it.  In
+       write-write contentions, which cannot pause, abort the younger. */
+    if (cm->kind == STM_CONTENTION_WRITE_WRITE) {
+        stm_cm_abort_the_younger(cm);
+    }
+    else {
+        cm->abort_other = true;
+        cm->try_sleep = (cm->wait_left_usec != 0);
+    }
+}
+
+void stm_cm_karma(stm_contention_t *cm)
+{
+    /* Abort the transaction that did the least work so far, so that
+       the least work is thrown away.  If equal, abort the younger. */
+    if (cm->work != cm->other_work)
+        cm->abort_other = (cm->work > cm->other_work);
+    else
+        stm_cm_abort_the_younger(cm);
+}
+
+void stm_cm_timestamp_backoff(stm_contention_t *cm)
+{
+    /* The older transaction wins.  If the same transaction keeps
+       losing, it waits longer and longer before it restarts: the
+       threads running the transactions that make it abort have more
+       time to commit them. */
+    stm_cm_abort_the_younger(cm);
+    if (!cm->abort_other) {
+        long n = cm->num_aborts;
+        if (n > CM_BACKOFF_MAX_SHIFT)
+            n = CM_BACKOFF_MAX_SHIFT;
+        cm->backoff_usec = 1L << n;
+    }
+}
+
 
 /************************************************************/
 
@@ -129,38 +205,54 @@ static bool contention_management(uint8_t other_segment_num,
     timing_contention(kind, other_segment_num, obj);
 
     /* Who should abort here: this thread, or the other thread? */
-    struct contmgr_s contmgr;
+    struct stm_priv_segment_info_s *other_pseg;
+    other_pseg = get_priv_segment(other_segment_num);
+
+    stm_contention_t contmgr;
     contmgr.kind = kind;
-    contmgr.other_pseg = get_priv_segment(other_segment_num);
+    contmgr.other_tl = other_pseg->pub.running_thread;
+    contmgr.start_time = STM_PSEGMENT->unique_start_time;
+    contmgr.other_start_time = other_pseg->unique_start_time;
+    contmgr.work = transaction_work(
+                       get_priv_segment(STM_SEGMENT->segment_num));
+    contmgr.other_work = transaction_work(other_pseg);
+    contmgr.num_aborts = STM_SEGMENT->running_thread->aborts_in_a_row;
+    contmgr.wait_left_usec = STM_PSEGMENT->contention_wait_left;
     contmgr.abort_other = false;
     contmgr.try_sleep = false;
+    contmgr.backoff_usec = 1;
 
-    /* Pick one contention management... could be made dynamically choosable */
-#ifdef STM_TESTS
-    cm_abort_the_younger(&contmgr);
-#else
-    cm_pause_if_younger(&contmgr);
-#endif
+    /* Pick the contention management of this thread, or the global one */
+    stm_contention_policy_fn *policy =
+        STM_SEGMENT->running_thread->contention_policy;
+    if (policy == NULL)
+        policy = contention_policy;
+    policy(&contmgr);
 
     /* Fix the choices that are found incorrect due to TS_INEVITABLE
        or is_abort() */
-    if (is_abort(contmgr.other_pseg->pub.nursery_end)) {
+    if (is_abort(other_pseg->pub.nursery_end)) {
         contmgr.abort_other = true;
         contmgr.try_sleep = false;
     }
     else if (STM_PSEGMENT->transaction_state == TS_INEVITABLE) {
-        assert(contmgr.other_pseg->transaction_state != TS_INEVITABLE);
+        assert(other_pseg->transaction_state != TS_INEVITABLE);
         contmgr.abort_other = true;
         contmgr.try_sleep = false;
     }
-    else if (contmgr.other_pseg->transaction_state == TS_INEVITABLE) {
+    else if (other_pseg->transaction_state == TS_INEVITABLE) {
         contmgr.abort_other = false;
     }
 
+    /* If we already paused for the whole budget in this transaction,
+       don't pause any more: escalate to what 'abort_other' says */
+    if (STM_PSEGMENT->contention_wait_left == 0)
+        contmgr.try_sleep = false;
+
     /* Do one of three things here...
      */
     if (contmgr.try_sleep && kind != STM_CONTENTION_WRITE_WRITE &&
-        contmgr.other_pseg->safe_point != SP_WAIT_FOR_C_TRANSACTION_DONE) {
+        other_pseg->safe_point != SP_WAIT_FOR_C_TRANSACTION_DONE) {
         others_may_have_run = true;
         /* Sleep.
 
@@ -171,10 +263,10 @@ static bool contention_management(uint8_t other_segment_num,
              a crude heuristic of never pausing for a thread that is
              itself already paused here.
         */
-        contmgr.other_pseg->signal_when_done = true;
+        other_pseg->signal_when_done = true;
 
         /* tell the other to commit ASAP */
-        signal_other_to_commit_soon(contmgr.other_pseg);
+        signal_other_to_commit_soon(other_pseg);
 
         dprintf(("pausing...\n"));
 
@@ -182,7 +274,24 @@ static bool contention_management(uint8_t other_segment_num,
 
         cond_signal(C_AT_SAFE_POINT);
         STM_PSEGMENT->safe_point = SP_WAIT_FOR_C_TRANSACTION_DONE;
-        cond_wait(C_TRANSACTION_DONE);
+        long wait_left = STM_PSEGMENT->contention_wait_left;
+        if (wait_left < 0) {
+            cond_wait(C_TRANSACTION_DONE);
+        }
+        else {
+            /* bounded wait.  If we are called again because the
+               contention is still there, we only wait for what is
+               left of the budget */
+            struct timespec start, stop;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            cond_wait_timeout(C_TRANSACTION_DONE, wait_left);
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+            wait_left -= (stop.tv_sec - start.tv_sec) * 1000000L +
+                         (stop.tv_nsec - start.tv_nsec) / 1000;
+            if (wait_left < 0)
+                wait_left = 0;
+            STM_PSEGMENT->contention_wait_left = wait_left;
+        }
         STM_PSEGMENT->safe_point = SP_RUNNING;
         dprintf(("pausing done\n"));
 
@@ -194,24 +303,31 @@ static bool contention_management(uint8_t other_segment_num,
 
     else if (!contmgr.abort_other) {
         /* tell the other to commit ASAP, since it causes aborts */
-        signal_other_to_commit_soon(contmgr.other_pseg);
+        signal_other_to_commit_soon(other_pseg);
 
         dprintf(("abort in contention: kind %d\n", kind));
-        abort_with_mutex();
+        if (kind == STM_CONTENTION_WRITE_WRITE &&
+                STM_PSEGMENT->nested != NULL) {
+            /* the conflict is on an object that we try to write to
+               now, so only the nested transaction needs to roll back */
+            abort_nested_with_mutex_and_sleep(contmgr.backoff_usec);
+        }
+        abort_with_mutex_and_sleep(contmgr.backoff_usec);
     }
 
     else {
         /* We have to signal the other thread to abort, and wait until
            it does. */
-        contmgr.other_pseg->pub.nursery_end = NSE_SIGABORT;
+        other_pseg->pub.nursery_end = NSE_SIGABORT;
 
         timing_event(STM_SEGMENT->running_thread,
                      STM_ABORTING_OTHER_CONTENTION);
 
-        int sp = contmgr.other_pseg->safe_point;
+        int sp = other_pseg->safe_point;
         switch (sp) {
 
         case SP_RUNNING:
+        case SP_COMMITTING:
             /* The other thread is running now, so as NSE_SIGABORT was
                set in its 'nursery_end', it will soon enter a
                mutex_lock() and thus abort.
@@ -244,7 +360,7 @@ static bool contention_management(uint8_t other_segment_num,
            anything more than abort when it really wakes up later.
         */
         case SP_WAIT_FOR_C_REQUEST_REMOVED:
-            cond_broadcast(C_REQUEST_REMOVED);
+            broadcast_request_removed();
             break;
 
         case SP_WAIT_FOR_C_AT_SAFE_POINT:
@@ -287,11 +403,17 @@ static bool contention_management(uint8_t other_segment_num,
 }
 
 static void write_write_contention_management(uintptr_t lock_idx,
-                                              object_t *obj)
+                                              object_t *obj,
+                                              uintptr_t card_index)
 {
     s_mutex_lock();
 
     uint8_t prev_owner = ((volatile uint8_t *)write_locks)[lock_idx];
+    if (prev_owner == CARDS_LOCKED) {
+        /* we conflict with the owner of the card 'card_index', or with
+           any other owner of a card if we want the whole object */
+        prev_owner = get_card_lock_owner(obj, card_index);
+    }
     if (prev_owner != 0 && prev_owner != STM_PSEGMENT->write_lock_num) {
 
         uint8_t other_segment_num = prev_owner;
@@ -1,6 +1,19 @@
 
+/* stm_cm_timestamp_backoff() waits at most 2**10 microseconds */
+#define CM_BACKOFF_MAX_SHIFT   10
+
+/* the estimated work of a transaction, in bytes: the nursery bytes it
+   used, plus this much for each object it modified, plus 4096 for each
+   page it privatized */
+#define CM_WORK_PER_MODIFIED_OBJECT   128
+
+static long contention_wait_budget;
+
+static void teardown_contention(void);
+static uint64_t transaction_work(struct stm_priv_segment_info_s *pseg);
 static void write_write_contention_management(uintptr_t lock_idx,
-                                              object_t *obj);
+                                              object_t *obj,
+                                              uintptr_t card_index);
 static bool write_read_contention_management(uint8_t other_segment_num,
                                              object_t *obj);
 static void inevitable_contention_management(uint8_t other_segment_num);
@@ -11,6 +24,7 @@ static inline bool is_abort(uintptr_t nursery_end) {
 }
 
 static inline bool is_aborting_now(uint8_t other_segment_num) {
+    uint8_t sp = get_priv_segment(other_segment_num)->safe_point;
     return (is_abort(get_segment(other_segment_num)->nursery_end) &&
-            get_priv_segment(other_segment_num)->safe_point != SP_RUNNING);
+            sp != SP_RUNNING && sp != SP_COMMITTING);
 }
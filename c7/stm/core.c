@@ -3,9 +3,17 @@
 #endif
 
 
+static long transaction_length_max = DEFAULT_TRANSACTION_LENGTH;
+static long max_aborts_in_a_row = 0;
+static long max_abort_backoff = 0;
+
 static void teardown_core(void)
 {
-    memset(write_locks, 0, sizeof(write_locks));
+    munmap(write_locks, NB_WRITE_LOCKS);
+    write_locks = NULL;
+    transaction_length_max = DEFAULT_TRANSACTION_LENGTH;
+    max_aborts_in_a_row = 0;
+    max_abort_backoff = 0;
 }
 
 #ifdef NDEBUG
@@ -31,7 +39,7 @@ static void check_flag_write_barrier(object_t *obj)
 #ifndef NDEBUG
     long i;
     struct object_s *o1;
-    for (i = 0; i <= NB_SEGMENTS; i++) {
+    for (i = 0; i <= nb_segments; i++) {
         if (i == STM_SEGMENT->segment_num)
             continue;
         o1 = (struct object_s *)REAL_ADDRESS(get_segment_base(i), obj);
@@ -74,6 +82,40 @@ static void write_slowpath_overflow_obj(object_t *obj, bool mark_card)
     }
 }
 
+static void privatize_object_pages(object_t *obj)
+{
+    /* We need to privatize the pages containing the object, if they
+       are still SHARED_PAGE.  The common case is that there is only
+       one page in total. */
+    uintptr_t first_page = ((uintptr_t)obj) / 4096UL;
+
+    /* If the object is in the uniform pages of small objects
+       (outside the nursery), then it fits into one page.  This is
+       the common case. Otherwise, we need to compute it based on
+       its location and size. */
+    if ((obj->stm_flags & GCFLAG_SMALL_UNIFORM) != 0) {
+        page_privatize(first_page);
+    }
+    else {
+        char *realobj;
+        size_t obj_size;
+        uintptr_t i, end_page;
+
+        /* get the size of the object */
+        realobj = REAL_ADDRESS(STM_SEGMENT->segment_base, obj);
+        obj_size = stmcb_size_rounded_up((struct object_s *)realobj);
+
+        /* get the last page containing data from the object */
+        end_page = (((uintptr_t)obj) + obj_size - 1) / 4096UL;
+
+        for (i = first_page; i <= end_page; i++) {
+            page_privatize(i);
+        }
+    }
+}
+
+static bool lock_whole_object_from_cards(object_t *obj);
+
 __attribute__((always_inline))
 static void write_slowpath_common(object_t *obj, bool mark_card)
 {
@@ -81,10 +123,17 @@ static void write_slowpath_common(object_t *obj, bool mark_card)
     assert(!_is_young(obj));
     assert(obj->stm_flags & GCFLAG_WRITE_BARRIER);
 
+    if (UNLIKELY(STM_PSEGMENT->readonly_transaction))
+        stm_fatalerror("stm_write() in a read-only transaction");
+
     uintptr_t base_lock_idx = get_write_lock_idx((uintptr_t)obj);
 
     if (IS_OVERFLOW_OBJ(STM_PSEGMENT, obj)) {
         assert(write_locks[base_lock_idx] == 0);
+        if (UNLIKELY(major_marking_in_progress))
+            LIST_APPEND(STM_PSEGMENT->marking_dirty_objects, obj);
+        if (UNLIKELY(STM_PSEGMENT->nested != NULL))
+            nested_save_object(obj);
         write_slowpath_overflow_obj(obj, mark_card);
         return;
     }
@@ -130,37 +179,13 @@ static void write_slowpath_common(object_t *obj, bool mark_card)
         /* Change to this old object from this transaction.
            Add it to the list 'modified_old_objects'. */
         LIST_APPEND(STM_PSEGMENT->modified_old_objects, obj);
+        STM_SEGMENT->nursery_mark -= CM_WORK_PER_MODIFIED_OBJECT;
+        if (UNLIKELY(major_marking_in_progress))
+            LIST_APPEND(STM_PSEGMENT->marking_dirty_objects, obj);
 
         release_marker_lock(STM_SEGMENT->segment_base);
 
-        /* We need to privatize the pages containing the object, if they
-           are still SHARED_PAGE.  The common case is that there is only
-           one page in total. */
-        uintptr_t first_page = ((uintptr_t)obj) / 4096UL;
-
-        /* If the object is in the uniform pages of small objects
-           (outside the nursery), then it fits into one page.  This is
-           the common case. Otherwise, we need to compute it based on
-           its location and size. */
-        if ((obj->stm_flags & GCFLAG_SMALL_UNIFORM) != 0) {
-            page_privatize(first_page);
-        }
-        else {
-            char *realobj;
-            size_t obj_size;
-            uintptr_t i, end_page;
-
-            /* get the size of the object */
-            realobj = REAL_ADDRESS(STM_SEGMENT->segment_base, obj);
-            obj_size = stmcb_size_rounded_up((struct object_s *)realobj);
-
-            /* get the last page containing data from the object */
-            end_page = (((uintptr_t)obj) + obj_size - 1) / 4096UL;
-
-            for (i = first_page; i <= end_page; i++) {
-                page_privatize(i);
-            }
-        }
+        privatize_object_pages(obj);
     }
     else if (write_locks[base_lock_idx] == lock_num) {
 #ifdef STM_TESTS
@@ -169,11 +194,20 @@ static void write_slowpath_common(object_t *obj, bool mark_card)
                        ({ if (item == obj) { found = true; break; } }));
         assert(found);
 #endif
+        /* already changed by this transaction: if we are in a nested
+           transaction, we need a copy to roll back to */
+        if (UNLIKELY(STM_PSEGMENT->nested != NULL))
+            nested_save_object(obj);
+    }
+    else if (cards_are_locked(base_lock_idx) &&
+             lock_whole_object_from_cards(obj)) {
+        /* we owned all the locked cards, and now the whole object */
+        goto retry;
     }
     else {
         /* call the contention manager, and then retry (unless we were
            aborted). */
-        write_write_contention_management(base_lock_idx, obj);
+        write_write_contention_management(base_lock_idx, obj, 0);
         goto retry;
     }
 
@@ -195,9 +229,14 @@ static void write_slowpath_common(object_t *obj, bool mark_card)
             LIST_APPEND(STM_PSEGMENT->objects_pointing_to_nursery, obj);
         }
 
-        if (obj->stm_flags & GCFLAG_CARDS_SET) {
+        if ((obj->stm_flags & GCFLAG_CARDS_SET) ||
+            (!(obj->stm_flags & GCFLAG_SMALL_UNIFORM) &&
+             obj_should_use_cards(obj))) {
             /* if we clear this flag, we have to tell sync_old_objs that
-               everything needs to be synced */
+               everything needs to be synced.  We also mark all cards if
+               the object has none so far, so that they are the complete
+               picture of what we changed: detect_write_read_conflicts()
+               compares them with the cards read by stm_read_range() */
             _reset_object_cards(get_priv_segment(STM_SEGMENT->segment_num),
                                 obj, CARD_MARKED_OLD, true); /* mark all */
         }
@@ -254,8 +293,136 @@ long _stm_write_slowpath_card_extra_base(void)
         + 0x4000000000000000L;   // <- workaround for a clang bug :-(
 }
 
+static bool use_card_locks(object_t *obj)
+{
+    /* Should _stm_write_slowpath_card() lock only the card, instead of
+       the whole object?  The write barrier then only marks the card as
+       read, like stm_read_range(), which needs one read marker per
+       card.  It is not done in nested transactions,
+       which can only roll back whole objects, nor if we own the whole
+       object already. */
+#if CARD_READ_MARKERS
+    if (STM_PSEGMENT->nested != NULL || IS_OVERFLOW_OBJ(STM_PSEGMENT, obj))
+        return false;
+
+    uintptr_t lock_idx = get_write_lock_idx((uintptr_t)obj);
+    if (cards_are_locked(lock_idx))
+        return true;
+    uint8_t lock = write_locks[lock_idx];
+    return (lock != STM_PSEGMENT->write_lock_num &&
+            !(obj->stm_flags & GCFLAG_SMALL_UNIFORM) &&
+            obj_should_use_cards(obj));
+#else
+    return false;
+#endif
+}
+
+static bool try_lock_card(uintptr_t base_lock_idx, uintptr_t card_lock_idx,
+                          uint8_t lock_num)
+{
+    /* Take the write lock of a free card of an object that is
+       CARDS_LOCKED already, without the mutex.  The card is given back
+       if the object's write lock changed in the meantime: it may be
+       leaving CARDS_LOCKED, and may not have seen our card. */
+    volatile uint8_t *locks = (volatile uint8_t *)write_locks;
+    if (locks[base_lock_idx] != CARDS_LOCKED ||
+        !__sync_bool_compare_and_swap(&write_locks[card_lock_idx],
+                                      CARD_CLEAR, lock_num))
+        return false;
+
+    if (locks[base_lock_idx] == CARDS_LOCKED &&
+            locks[card_lock_idx] == lock_num)
+        return true;
+
+    __sync_bool_compare_and_swap(&write_locks[card_lock_idx],
+                                 lock_num, CARD_CLEAR);
+    return false;
+}
+
+static bool lock_card_with_mutex(uintptr_t base_lock_idx,
+                                 uintptr_t card_lock_idx, uint8_t lock_num)
+{
+    /* The same as try_lock_card(), but the object's write lock may also
+       go from 0 to CARDS_LOCKED here */
+    bool locked;
+    s_mutex_lock();
+    locked = ((write_locks[base_lock_idx] == CARDS_LOCKED ||
+               __sync_bool_compare_and_swap(&write_locks[base_lock_idx],
+                                            0, CARDS_LOCKED)) &&
+              __sync_bool_compare_and_swap(&write_locks[card_lock_idx],
+                                           CARD_CLEAR, lock_num));
+    s_mutex_unlock();
+    return locked;
+}
+
+static void write_slowpath_card_lock(object_t *obj, uintptr_t index)
+{
+    /* Card marking, taking the write lock of the card only (see
+       CARDS_LOCKED).  Other segments can then change other cards of
+       the same object in parallel; at commit, only our cards are
+       copied to the other segments.  The object keeps
+       GCFLAG_WRITE_BARRIER and never gets GCFLAG_CARDS_SET, so we come
+       back here for every card; the minor collection finds the marked
+       cards from 'card_locked_objects'. */
+    assert(_seems_to_be_running_transaction());
+    assert(obj->stm_flags & GCFLAG_WRITE_BARRIER);
+    assert(!(obj->stm_flags & GCFLAG_CARDS_SET));
+
+    uintptr_t base_lock_idx = get_write_lock_idx((uintptr_t)obj);
+    uintptr_t card_index = get_index_to_card_index(index);
+    uintptr_t card_lock_idx = base_lock_idx + card_index;
+    uint8_t lock_num = STM_PSEGMENT->write_lock_num;
+
+    if (write_locks[card_lock_idx] == (lock_num | CARD_LOCK_MARKED))
+        return;     /* ours, and marked since the last minor collection */
+
+    if (UNLIKELY(STM_PSEGMENT->readonly_transaction))
+        stm_fatalerror("stm_write_card() in a read-only transaction");
+
+    if (write_locks[card_lock_idx] != lock_num) {
+        /* like the read barrier of write_slowpath_common(), but only of
+           this card: it must occur before the contention management */
+        stm_read_range(obj, index, index + 1);
+
+        while (!try_lock_card(base_lock_idx, card_lock_idx, lock_num) &&
+               !lock_card_with_mutex(base_lock_idx, card_lock_idx, lock_num)) {
+            write_write_contention_management(base_lock_idx, obj, card_index);
+        }
+
+        if (!tree_contains(STM_PSEGMENT->card_locked_objects, (uintptr_t)obj)) {
+            /* the first card of this object that we lock */
+            dprintf_test(("write_slowpath_card_lock %p -> mod_old\n", obj));
+            tree_insert(STM_PSEGMENT->card_locked_objects, (uintptr_t)obj, 0);
+
+            acquire_marker_lock(STM_SEGMENT->segment_base);
+            timing_record_write();
+            LIST_APPEND(STM_PSEGMENT->modified_old_objects, obj);
+            STM_SEGMENT->nursery_mark -= CM_WORK_PER_MODIFIED_OBJECT;
+            if (UNLIKELY(major_marking_in_progress))
+                LIST_APPEND(STM_PSEGMENT->marking_dirty_objects, obj);
+            release_marker_lock(STM_SEGMENT->segment_base);
+
+            privatize_object_pages(obj);
+        }
+    }
+
+    /* mark the card for the next minor collection */
+    wlog_t *item;
+    TREE_FIND(*STM_PSEGMENT->card_locked_objects, (uintptr_t)obj, item,
+              stm_fatalerror("card-locked object not found"));
+    item->val = 1;
+    write_locks[card_lock_idx] = lock_num | CARD_LOCK_MARKED;
+    dprintf(("mark %p index %lu, card:%lu with lock %d\n",
+             obj, index, card_index, lock_num));
+}
+
 void _stm_write_slowpath_card(object_t *obj, uintptr_t index)
 {
+    if (use_card_locks(obj)) {
+        write_slowpath_card_lock(obj, index);
+        return;
+    }
+
     /* If CARDS_SET is not set so far, issue a normal write barrier.
        If the object is large enough, ask it to set up the object for
        card marking instead.
@@ -304,28 +471,367 @@ void _stm_write_slowpath_card(object_t *obj, uintptr_t index)
                  write_locks[base_lock_idx] == STM_PSEGMENT->write_lock_num));
 }
 
-static void reset_transaction_read_version(void)
+static uintptr_t get_last_card_index(char *segment_base, object_t *obj)
+{
+    struct object_s *realobj = (struct object_s *)
+        REAL_ADDRESS(segment_base, obj);
+    size_t size = stmcb_size_rounded_up(realobj);
+    uintptr_t offset_itemsize[2];
+    stmcb_get_card_base_itemsize(realobj, offset_itemsize);
+    size = (size - offset_itemsize[0]) / offset_itemsize[1];
+    return get_index_to_card_index(size - 1);
+}
+
+void stm_read_range(object_t *obj, uintptr_t start, uintptr_t stop)
+{
+    /* Mark as read only the cards of the items in range(start, stop).
+       Like the card of index 'k' uses the write lock that follows the
+       object's own write lock by 'k', it uses the read marker that
+       follows the object's own read marker by 'k'.  The object's own
+       read marker is left alone: it means that the whole object was
+       read.  The read summary is marked for the page of 'obj', which
+       detect_write_read_conflicts() checks first, and for the next
+       pages up to the last read marker we set, which
+       clear_read_markers() checks.  The read markers are cleared when
+       the object is freed, see reset_card_read_markers(). */
+#if CARD_READ_MARKERS
+    if (start < stop && !(obj->stm_flags & GCFLAG_SMALL_UNIFORM) &&
+            obj_should_use_cards(obj)) {
+        uint8_t read_version = STM_SEGMENT->transaction_read_version;
+        uintptr_t card_index = get_index_to_card_index(start);
+        uintptr_t last_card_index = get_index_to_card_index(stop - 1);
+        assert(last_card_index <=
+               get_last_card_index(STM_SEGMENT->segment_base, obj));
+
+        stm_read_marker_t *rm = (stm_read_marker_t *)(((uintptr_t)obj) >> 4);
+        for (; card_index <= last_card_index; card_index++)
+            rm[card_index].rm = read_version;
+# ifdef STM_READ_SUMMARY
+        uintptr_t rs = ((uintptr_t)obj) >> _STM_READSUMMARY_SHIFT;
+        uintptr_t rs_last = (((uintptr_t)obj) + 16 * last_card_index) >>
+            _STM_READSUMMARY_SHIFT;
+        for (; rs <= rs_last; rs++)
+            ((stm_read_marker_t *)(READSUMMARY_START + rs))->rm = read_version;
+# endif
+        STM_PSEGMENT->read_card_ranges = true;
+        return;
+    }
+#endif
+    /* not an object with cards, or coarse read markers: read it all */
+    stm_read(obj);
+}
+
+static uintptr_t get_freed_last_card_index(char *segment_base,
+                                           object_t *obj)
+{
+    /* 'obj' is being freed: return the last card whose read marker
+       stm_read_range() may have set, or 0.  The object's content is
+       taken from 'segment_base'. */
+#if CARD_READ_MARKERS
+    struct object_s *realobj = (struct object_s *)
+        REAL_ADDRESS(segment_base, obj);
+    if ((realobj->stm_flags & GCFLAG_SMALL_UNIFORM) ||
+            !stmcb_obj_supports_cards(realobj) ||
+            stmcb_size_rounded_up(realobj) < _STM_MIN_CARD_OBJ_SIZE)
+        return 0;
+    return get_last_card_index(segment_base, obj);
+#else
+    /* stm_read_range() did not set any read marker of the cards */
+    return 0;
+#endif
+}
+
+static void reset_card_read_markers(char *base, object_t *obj,
+                                    uintptr_t last_card_index)
+{
+    /* Called with the result of get_freed_last_card_index().  As
+       CARD_SIZE >= 32, these read markers are all those of addresses
+       inside the object itself, so no other object uses them. */
+    assert(CARD_READ_MARKERS || last_card_index == 0);
+    if (last_card_index > 0)
+        memset(base + (((uintptr_t)obj) >> 4) + 1, 0, last_card_index);
+}
+
+static bool cards_were_read_remote(char *base, object_t *obj,
+                                   uint8_t other_transaction_read_version)
+{
+    /* 'obj' was modified by us.  If it was only written with
+       stm_write_card(), check if one of the written cards was read by
+       stm_read_range() in the other segment.  If it was written with
+       stm_write(), all its cards are marked (see write_slowpath_common). */
+    if ((obj->stm_flags & GCFLAG_SMALL_UNIFORM) || !obj_should_use_cards(obj))
+        return false;
+
+    uintptr_t first_card_index = get_write_lock_idx((uintptr_t)obj);
+    uintptr_t card_index, last_card_index =
+        get_last_card_index(STM_SEGMENT->segment_base, obj);
+    struct stm_read_marker_s *rm = (struct stm_read_marker_s *)
+        (base + (((uintptr_t)obj) >> 4));
+    bool card_locks = write_locks[first_card_index] == CARDS_LOCKED;
+    uint8_t lock_num = STM_PSEGMENT->write_lock_num;
+
+    for (card_index = 1; card_index <= last_card_index; card_index++) {
+        /* with CARDS_LOCKED, the other cards are not ours */
+        uint8_t card_value = write_locks[first_card_index + card_index];
+        bool written = card_locks ? (card_value & ~CARD_LOCK_MARKED) == lock_num
+                                  : card_value != CARD_CLEAR;
+        if (written && rm[card_index].rm == other_transaction_read_version)
+            return true;
+    }
+    return false;
+}
+
+static uint8_t find_other_card_owner(char *segment_base, object_t *obj,
+                                     uint8_t lock_num)
+{
+    /* return the 'write_lock_num' of a segment other than 'lock_num'
+       that owns one of the cards of 'obj', or 0 */
+    uintptr_t first_card_index = get_write_lock_idx((uintptr_t)obj);
+    uintptr_t card_index, last_card_index =
+        get_last_card_index(segment_base, obj);
+    for (card_index = 1; card_index <= last_card_index; card_index++) {
+        uint8_t owner = (write_locks[first_card_index + card_index] &
+                         ~CARD_LOCK_MARKED);
+        if (owner != 0 && owner != lock_num)
+            return owner;
+    }
+    return 0;
+}
+
+static uint8_t get_card_lock_owner(object_t *obj, uintptr_t card_index)
+{
+    /* For an object that is CARDS_LOCKED: return the 'write_lock_num'
+       of the segment that owns the card 'card_index'; or, if
+       'card_index' is 0, of any other segment than ours that owns one
+       of the cards.  Returns 0 if there is none. */
+    assert(_has_mutex());
+    uintptr_t first_card_index = get_write_lock_idx((uintptr_t)obj);
+    assert(write_locks[first_card_index] == CARDS_LOCKED);
+
+    if (card_index != 0)
+        return write_locks[first_card_index + card_index] & ~CARD_LOCK_MARKED;
+
+    return find_other_card_owner(STM_SEGMENT->segment_base, obj,
+                                 STM_PSEGMENT->write_lock_num);
+}
+
+static bool leave_cards_locked(char *segment_base, object_t *obj,
+                               uint8_t lock_num)
+{
+    /* With the mutex, for an object that is CARDS_LOCKED: if no other
+       segment than 'lock_num' owns a card, set the object's write lock
+       to CARDS_CHANGING and return true.  The caller then gives it its
+       final value.  Otherwise, leave it CARDS_LOCKED and return false. */
+    assert(_has_mutex());
+    uintptr_t first_card_index = get_write_lock_idx((uintptr_t)obj);
+    assert(write_locks[first_card_index] == CARDS_LOCKED);
+
+    if (find_other_card_owner(segment_base, obj, lock_num) != 0)
+        return false;
+
+    /* a full barrier: the cards taken by try_lock_card() from now on
+       will see CARDS_CHANGING, and the ones taken before are seen below */
+    __sync_lock_test_and_set(&write_locks[first_card_index], CARDS_CHANGING);
+
+    if (find_other_card_owner(segment_base, obj, lock_num) != 0) {
+        write_locks[first_card_index] = CARDS_LOCKED;
+        return false;
+    }
+    return true;
+}
+
+static bool lock_whole_object_from_cards(object_t *obj)
 {
-    /* force-reset all read markers to 0 */
-
-    char *readmarkers = REAL_ADDRESS(STM_SEGMENT->segment_base,
-                                     FIRST_READMARKER_PAGE * 4096UL);
-    dprintf(("reset_transaction_read_version: %p %ld\n", readmarkers,
-             (long)(NB_READMARKER_PAGES * 4096UL)));
-    if (mmap(readmarkers, NB_READMARKER_PAGES * 4096UL,
-             PROT_READ | PROT_WRITE,
-             MAP_FIXED | MAP_PAGES_FLAGS, -1, 0) != readmarkers) {
+    /* stm_write() on an object that is CARDS_LOCKED.  If we own all
+       the locked cards, we take the object's write lock instead and
+       return true.  The cards become regular marked cards.  Returns
+       false if another segment owns some card: this is a write-write
+       conflict. */
+    uintptr_t first_card_index = get_write_lock_idx((uintptr_t)obj);
+    uint8_t lock_num = STM_PSEGMENT->write_lock_num;
+
+    s_mutex_lock();
+    if (write_locks[first_card_index] != CARDS_LOCKED) {
+        s_mutex_unlock();
+        return true;     /* unlocked in the meantime: retry */
+    }
+    if (!leave_cards_locked(STM_SEGMENT->segment_base, obj, lock_num)) {
+        s_mutex_unlock();
+        return false;
+    }
+
+    if (!tree_contains(STM_PSEGMENT->card_locked_objects, (uintptr_t)obj)) {
+        /* nobody owns any card: a card taken by try_lock_card() was
+           given back.  Unlock the object and retry. */
+        write_locks[first_card_index] = 0;
+        s_mutex_unlock();
+        return true;
+    }
+
+    /* the object was added to 'modified_old_objects' with our first
+       card, and its pages privatized */
+    uintptr_t card_index, last_card_index =
+        get_last_card_index(STM_SEGMENT->segment_base, obj);
+    for (card_index = 1; card_index <= last_card_index; card_index++) {
+        uintptr_t card_lock_idx = first_card_index + card_index;
+        if (write_locks[card_lock_idx] == (lock_num | CARD_LOCK_MARKED))
+            write_locks[card_lock_idx] = CARD_MARKED;
+        else if (write_locks[card_lock_idx] == lock_num)
+            write_locks[card_lock_idx] = CARD_MARKED_OLD;
+    }
+    write_locks[first_card_index] = lock_num;
+    s_mutex_unlock();
+    return true;
+}
+
+static void release_card_locks(struct stm_priv_segment_info_s *pseg,
+                               object_t *obj)
+{
+    /* Release the cards of 'obj' that 'pseg' locked, and the object's
+       write lock if no other segment owns any card any more.  Called
+       with the mutex. */
+    uintptr_t first_card_index = get_write_lock_idx((uintptr_t)obj);
+    uintptr_t card_index, last_card_index =
+        get_last_card_index(pseg->pub.segment_base, obj);
+
+    assert(write_locks[first_card_index] == CARDS_LOCKED);
+    for (card_index = 1; card_index <= last_card_index; card_index++) {
+        uintptr_t card_lock_idx = first_card_index + card_index;
+        uint8_t owner = write_locks[card_lock_idx] & ~CARD_LOCK_MARKED;
+        if (owner == pseg->write_lock_num)
+            write_locks[card_lock_idx] = CARD_CLEAR;
+    }
+    if (leave_cards_locked(pseg->pub.segment_base, obj, pseg->write_lock_num))
+        write_locks[first_card_index] = 0;
+}
+
+#ifdef STM_READ_SUMMARY
+static bool read_marker_page_is_clean(char *segment_base, uintptr_t pagenum)
+{
+    /* The read markers in the page 'pagenum' are those of the 16 pages
+       of objects starting at 'pagenum << 4' (more with coarse read
+       markers).  They can only be non-zero if one of these pages is
+       marked in the read summary. */
+    uint64_t *rs = (uint64_t *)(segment_base + READSUMMARY_START +
+                                ((pagenum << (READMARKER_SHIFT + 12)) >>
+                                 _STM_READSUMMARY_SHIFT));
+    uint64_t any = 0;
+    long i;
+    for (i = 0; i < (1 << READMARKER_SHIFT) / 8; i++)
+        any |= rs[i];
+    return any == 0;
+}
+#endif
+
+static void clear_read_marker_pages(char *segment_base, uintptr_t pagenum,
+                                    uintptr_t count)
+{
+    char *p = segment_base + pagenum * 4096UL;
+    if (count >= READMARKER_MMAP_MIN_PAGES) {
+        /* a big range: ask the OS for fresh zero pages instead of
+           writing them all now */
+        if (mmap(p, count * 4096UL, PROT_READ | PROT_WRITE,
+                 MAP_FIXED | MAP_PAGES_FLAGS, -1, 0) == p)
+            return;
         /* fall-back */
 #if STM_TESTS
         stm_fatalerror("reset_transaction_read_version: %m");
 #endif
-        memset(readmarkers, 0, NB_READMARKER_PAGES * 4096UL);
     }
+    memset(p, 0, count * 4096UL);
+}
+
+static void clear_read_markers(char *segment_base, uintptr_t first_page,
+                               uintptr_t end_page)
+{
+    /* clear the pages of read markers in range(first_page, end_page),
+       skipping the ones that the read summary says are still zero */
+    uintptr_t i = first_page, j;
+    while (i < end_page) {
+#ifdef STM_READ_SUMMARY
+        if (read_marker_page_is_clean(segment_base, i)) {
+            i++;
+            continue;
+        }
+        for (j = i + 1; j < end_page; j++) {
+            if (read_marker_page_is_clean(segment_base, j))
+                break;
+        }
+#else
+        j = end_page;
+#endif
+        clear_read_marker_pages(segment_base, i, j - i);
+        i = j;
+    }
+}
+
+static void reset_transaction_read_version(void)
+{
+    /* force-reset all read markers to 0.  Only the read markers of the
+       objects in the used ranges of pages can be non-zero, like in
+       forksupport.c; these ranges only grow.  The read markers of the
+       nursery are never used. */
+    char *segment_base = STM_SEGMENT->segment_base;
+    uintptr_t rm_start, rm_stop;
+    rm_start = (uninitialized_page_start - stm_object_pages) >>
+        (READMARKER_SHIFT + 12);
+    rm_stop  = (uninitialized_page_stop  - stm_object_pages) >>
+        (READMARKER_SHIFT + 12);
+    dprintf(("reset_transaction_read_version: pages %ld-%ld and %ld-%ld\n",
+             (long)FIRST_OLD_RM_PAGE, (long)rm_start,
+             (long)rm_stop, (long)FIRST_OBJECT_PAGE));
+
+    clear_read_markers(segment_base, FIRST_OLD_RM_PAGE, rm_start + 1);
+    clear_read_markers(segment_base, rm_stop, FIRST_OBJECT_PAGE);
+#ifdef STM_READ_SUMMARY
+    char *readsummary = REAL_ADDRESS(segment_base,
+                                     FIRST_READSUMMARY_PAGE * 4096UL);
+    memset(readsummary, 0, NB_READSUMMARY_PAGES * 4096UL);
+#endif
     STM_SEGMENT->transaction_read_version = 1;
 }
 
 static uint64_t _global_start_time = 1;
 
+void stm_set_transaction_length(long length_max)
+{
+    if (length_max <= 0)
+        length_max = 1;
+    transaction_length_max = length_max;
+}
+
+void stm_set_max_aborts(long max_aborts)
+{
+    max_aborts_in_a_row = max_aborts;
+}
+
+void stm_set_abort_backoff(long max_backoff_usec)
+{
+    max_abort_backoff = max_backoff_usec;
+}
+
+static void shorten_transaction_length(stm_thread_local_t *tl, long work)
+{
+    /* upon abort, set the target length to 94% of the work done so
+       far.  This should ensure that, assuming the retry does the same
+       thing, it will commit just before it reaches the conflicting
+       point.  Never *increase* the target here. */
+    if (work > tl->transaction_length)
+        work = tl->transaction_length;
+    if (work > 0)
+        tl->transaction_length = work - (work >> 4);
+}
+
+static void grow_transaction_length(stm_thread_local_t *tl)
+{
+    /* when a transaction commits, the next one may be twice as long */
+    long length = tl->transaction_length;
+    if (length < (transaction_length_max >> 1))
+        tl->transaction_length = (length << 1) | 1;
+    else
+        tl->transaction_length = transaction_length_max;
+}
+
 static void _stm_start_transaction(stm_thread_local_t *tl)
 {
     assert(!_stm_in_transaction(tl));
@@ -338,7 +844,20 @@ static void _stm_start_transaction(stm_thread_local_t *tl)
     assert(STM_PSEGMENT->transaction_state == TS_NONE);
     timing_event(tl, STM_TRANSACTION_START);
     STM_PSEGMENT->unique_start_time = _global_start_time++;
+    STM_PSEGMENT->work_nursery_bytes = 0;
+    STM_PSEGMENT->work_pages_privatized = 0;
+    STM_PSEGMENT->aborted_work = 0;
+    STM_PSEGMENT->contention_wait_left = contention_wait_budget;
+    if (tl->transaction_length > transaction_length_max)
+        tl->transaction_length = transaction_length_max;
+    STM_SEGMENT->nursery_mark = ((stm_char *)_stm_nursery_start +
+                                 tl->transaction_length);
     STM_PSEGMENT->signalled_to_commit_soon = false;
+    STM_PSEGMENT->readonly_transaction = false;
+    STM_PSEGMENT->allocated_hashtable_entries = false;
+    STM_PSEGMENT->elided_locks = 0;
+    STM_PSEGMENT->read_card_ranges = false;
+    tree_clear(STM_PSEGMENT->card_locked_objects);
     STM_PSEGMENT->safe_point = SP_RUNNING;
     STM_PSEGMENT->marker_inev.object = NULL;
     STM_PSEGMENT->transaction_state = TS_REGULAR;
@@ -393,6 +912,26 @@ long stm_start_transaction(stm_thread_local_t *tl)
     long repeat_count = stm_rewind_jmp_setjmp(tl);
 #endif
     _stm_start_transaction(tl);
+
+    /* after too many aborts in a row, give up and run inevitably */
+    if (UNLIKELY(max_aborts_in_a_row > 0 &&
+                 tl->aborts_in_a_row >= max_aborts_in_a_row))
+        _stm_become_inevitable("too many aborts");
+    return repeat_count;
+}
+
+long stm_start_readonly_transaction(stm_thread_local_t *tl)
+{
+    s_mutex_lock();
+#ifdef STM_NO_AUTOMATIC_SETJMP
+    long repeat_count = 0;    /* test/support.py */
+#else
+    long repeat_count = stm_rewind_jmp_setjmp(tl);
+#endif
+    _stm_start_transaction(tl);
+
+    /* checked by the write barrier and by the allocation slow paths */
+    STM_PSEGMENT->readonly_transaction = true;
     return repeat_count;
 }
 
@@ -419,7 +958,7 @@ static bool detect_write_read_conflicts(void)
        but the same object was also read in a different thread.
     */
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
 
         if (i == STM_SEGMENT->segment_num)
             continue;
@@ -437,7 +976,18 @@ static bool detect_write_read_conflicts(void)
             STM_PSEGMENT->modified_old_objects,
             object_t * /*item*/,
             ({
-                if (was_read_remote(remote_base, item, remote_version)) {
+                /* first check the read summary, which is much smaller
+                   than the read markers and usually stays in the cache */
+                if (!may_have_been_read_remote(remote_base, item,
+                                               remote_version)) {
+                    assert(!was_read_remote(remote_base, item,
+                                            remote_version));
+                    continue;
+                }
+                if (was_read_remote(remote_base, item, remote_version) ||
+                    (get_priv_segment(i)->read_card_ranges &&
+                     cards_were_read_remote(remote_base, item,
+                                            remote_version))) {
                     /* A write-read conflict! */
                     dprintf(("write-read conflict on %p, our seg: %d, other: %ld\n",
                              item, STM_SEGMENT->segment_num, i));
@@ -475,7 +1025,11 @@ static void copy_object_to_shared(object_t *obj, int source_segment_num)
         REAL_ADDRESS(segment_base, obj);
 
     if (realobj->stm_flags & GCFLAG_SMALL_UNIFORM) {
-        abort();//XXX WRITE THE FAST CASE
+        /* fast case: the object fits in one page */
+        if (is_private_page(source_segment_num, first_page)) {
+            ssize_t obj_size = stmcb_size_rounded_up(realobj);
+            memcpy(REAL_ADDRESS(stm_object_pages, start), realobj, obj_size);
+        }
     }
     else {
         ssize_t obj_size = stmcb_size_rounded_up(realobj);
@@ -556,7 +1110,7 @@ static void _page_wise_synchronize_object_now(object_t *obj)
             assert(memcmp(dst, src, copy_size) == 0);  /* same page */
         }
 
-        for (i = 1; i <= NB_SEGMENTS; i++) {
+        for (i = 1; i <= nb_segments; i++) {
             if (i == myself)
                 continue;
 
@@ -580,6 +1134,35 @@ static void _page_wise_synchronize_object_now(object_t *obj)
     }
 }
 
+static void _small_synchronize_object_now(object_t *obj)
+{
+    /* fast case of _page_wise_synchronize_object_now(): objects in the
+       uniform pages of small objects fit in one page */
+    uintptr_t pagenum = ((uintptr_t)obj) / 4096UL;
+    char *src = REAL_ADDRESS(STM_SEGMENT->segment_base, obj);
+    ssize_t obj_size = stmcb_size_rounded_up((struct object_s *)src);
+    long i, myself = STM_SEGMENT->segment_num;
+    assert((((uintptr_t)obj) + obj_size - 1) / 4096UL == pagenum);
+
+    /* First copy the object into the shared page, if needed */
+    char *dst = REAL_ADDRESS(stm_object_pages, obj);
+    if (is_private_page(myself, pagenum))
+        memcpy(dst, src, obj_size);
+    else
+        assert(memcmp(dst, src, obj_size) == 0);  /* same page */
+
+    for (i = 1; i <= nb_segments; i++) {
+        if (i == myself)
+            continue;
+
+        dst = REAL_ADDRESS(get_segment_base(i), obj);
+        if (is_private_page(i, pagenum))
+            memcpy(dst, src, obj_size);
+        else
+            assert(!memcmp(dst, src, obj_size));  /* same page */
+    }
+}
+
 static inline bool _has_private_page_in_range(
     long seg_num, uintptr_t start, uintptr_t size)
 {
@@ -609,9 +1192,18 @@ static void _card_wise_synchronize_object_now(object_t *obj)
     uintptr_t last_card_index = get_index_to_card_index(real_idx_count - 1); /* max valid index */
     long i, myself = STM_SEGMENT->segment_num;
 
+    /* With CARDS_LOCKED, our cards hold our 'write_lock_num' instead
+       of CARD_MARKED_OLD, and the other cards may be owned by other
+       segments, which changed them in their own segment only: we must
+       never copy the whole object. */
+    bool card_locks = write_locks[first_card_index] == CARDS_LOCKED;
+    uint8_t marked_old = card_locks ? STM_PSEGMENT->write_lock_num
+                                    : CARD_MARKED_OLD;
+
     /* simple heuristic to check if probably the whole object is
        marked anyway so we should do page-wise synchronize */
-    if (write_locks[first_card_index + 1] == CARD_MARKED_OLD
+    if (!card_locks
+        && write_locks[first_card_index + 1] == CARD_MARKED_OLD
         && write_locks[first_card_index + last_card_index] == CARD_MARKED_OLD
         && write_locks[first_card_index + (last_card_index >> 1) + 1] == CARD_MARKED_OLD) {
 
@@ -634,7 +1226,7 @@ static void _card_wise_synchronize_object_now(object_t *obj)
         uintptr_t card_lock_idx = first_card_index + card_index;
         uint8_t card_value = write_locks[card_lock_idx];
 
-        if (card_value == CARD_MARKED_OLD) {
+        if (card_value == marked_old) {
             write_locks[card_lock_idx] = CARD_CLEAR;
 
             if (start_card_index == -1) {   /* first marked card */
@@ -647,11 +1239,13 @@ static void _card_wise_synchronize_object_now(object_t *obj)
             }
         }
         else {
-            OPT_ASSERT(card_value == CARD_CLEAR);
+            /* our cards were all traced by the minor collection */
+            OPT_ASSERT(card_value != (marked_old | CARD_LOCK_MARKED));
+            OPT_ASSERT(card_locks || card_value == CARD_CLEAR);
         }
 
         if (start_card_index != -1                    /* something to copy */
-            && (card_value != CARD_MARKED_OLD         /* found non-marked card */
+            && (card_value != marked_old              /* found non-marked card */
                 || card_index == last_card_index)) {  /* this is the last card */
             /* do the copying: */
             uintptr_t start, copy_size;
@@ -659,7 +1253,7 @@ static void _card_wise_synchronize_object_now(object_t *obj)
             uintptr_t start_card_offset;
             uintptr_t next_card_index = card_index;
 
-            if (card_value == CARD_MARKED_OLD) {
+            if (card_value == marked_old) {
                 /* card_index is the last card of the object, but we need
                    to go one further to get the right offset */
                 next_card_index++;
@@ -689,7 +1283,7 @@ static void _card_wise_synchronize_object_now(object_t *obj)
             memcpy(dst, src, copy_size);
 
             /* copy to other segments */
-            for (i = 1; i <= NB_SEGMENTS; i++) {
+            for (i = 1; i <= nb_segments; i++) {
                 if (i == myself)
                     continue;
                 if (!_has_private_page_in_range(i, start, copy_size))
@@ -708,6 +1302,7 @@ static void _card_wise_synchronize_object_now(object_t *obj)
     if (all_cards_were_cleared) {
         /* well, seems like we never called stm_write_card() on it, so actually
            we need to fall back to synchronize the whole object */
+        assert(!card_locks);
         _page_wise_synchronize_object_now(obj);
         return;
     }
@@ -715,7 +1310,7 @@ static void _card_wise_synchronize_object_now(object_t *obj)
 #ifndef NDEBUG
     char *src = REAL_ADDRESS(stm_object_pages, (uintptr_t)obj);
     char *dst;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments && !card_locks; i++) {
         dst = REAL_ADDRESS(get_segment_base(i), (uintptr_t)obj);
         assert(memcmp(dst, src, obj_size) == 0);
     }
@@ -737,7 +1332,7 @@ static void synchronize_object_now(object_t *obj, bool ignore_cards)
 
     if (obj->stm_flags & GCFLAG_SMALL_UNIFORM) {
         assert(!(obj->stm_flags & GCFLAG_CARDS_SET));
-        abort();//XXX WRITE THE FAST CASE
+        _small_synchronize_object_now(obj);
     } else if (ignore_cards || !obj_should_use_cards(obj)) {
         _page_wise_synchronize_object_now(obj);
     } else {
@@ -768,14 +1363,23 @@ static void push_modified_to_other_segments(void)
             /* clear the write-lock (note that this runs with all other
                threads paused, so no need to be careful about ordering) */
             uintptr_t lock_idx = (((uintptr_t)item) >> 4) - WRITELOCK_START;
-            assert(lock_idx < sizeof(write_locks));
-            assert(write_locks[lock_idx] == STM_PSEGMENT->write_lock_num);
-            write_locks[lock_idx] = 0;
+            assert(lock_idx < NB_WRITE_LOCKS);
 
             /* the WRITE_BARRIER flag should have been set again by
                minor_collection() */
             assert((item->stm_flags & GCFLAG_WRITE_BARRIER) != 0);
 
+            if (write_locks[lock_idx] == CARDS_LOCKED) {
+                /* we only own some cards: copy them, and then release
+                   them and possibly the object */
+                synchronize_object_now(item, false);
+                release_card_locks(get_priv_segment(STM_SEGMENT->segment_num),
+                                   item);
+                continue;
+            }
+            assert(write_locks[lock_idx] == STM_PSEGMENT->write_lock_num);
+            write_locks[lock_idx] = 0;
+
             /* copy the object to the shared page, and to the other
                private pages as needed */
             synchronize_object_now(item, false); /* don't ignore_cards */
@@ -816,18 +1420,59 @@ void stm_commit_transaction(void)
     assert(STM_PSEGMENT->safe_point == SP_RUNNING);
     assert(STM_PSEGMENT->running_pthread == pthread_self());
 
+    if (UNLIKELY(STM_PSEGMENT->elided_locks > 0))
+        stm_fatalerror("stm_commit_transaction() inside stm_elide_lock()");
+
+    /* the fast path of stm_allocate() doesn't check for read-only
+       transactions; detect it here at the latest */
+    if (UNLIKELY(STM_PSEGMENT->readonly_transaction &&
+                 STM_SEGMENT->nursery_current !=
+                     (stm_char *)_stm_nursery_start))
+        stm_fatalerror("stm_allocate() in a read-only transaction");
+
+    /* no user code runs from here, so we don't need to be paused
+       when other threads commit */
+    enter_commit_phase();
+
     minor_collection(/*commit=*/ true);
 
     /* synchronize overflow objects living in privatized pages */
     push_overflow_objects_from_privatized_pages();
 
     s_mutex_lock();
+    assert(STM_PSEGMENT->safe_point == SP_COMMITTING);
+    STM_PSEGMENT->safe_point = SP_RUNNING;
 
+    bool stopped_all_threads, readonly;
  restart:
-    /* force all other threads to be paused.  They will unpause
-       automatically when we are done here, i.e. at mutex_unlock().
-       Important: we should not call cond_wait() in the meantime. */
-    synchronize_all_threads(STOP_OTHERS_UNTIL_MUTEX_UNLOCK);
+    /* a transaction that did not write any old object has nothing to
+       push to the other segments, and cannot cause write-read conflicts.
+       The write-read conflicts that it suffered were already signalled
+       by the writers, which hold the mutex while doing so.  In this case
+       we only need to check for a pending abort, and we don't need to
+       pause the other threads.  A major collection is left to the next
+       regular commit, unless we allocated in this transaction.  A
+       read-only transaction can only allocate hashtable entries; they
+       are already written in all segments, but they use memory too. */
+    readonly = list_is_empty(STM_PSEGMENT->modified_old_objects) &&
+               ((STM_PSEGMENT->readonly_transaction &&
+                 !STM_PSEGMENT->allocated_hashtable_entries) ||
+                !is_major_collection_requested());
+    if (readonly) {
+        stopped_all_threads = false;
+        enter_safe_point_if_requested();
+    }
+    else {
+        /* force the other threads that run user code to be paused.  They
+           will unpause automatically when we are done here, i.e. at
+           mutex_unlock().  The threads that are themselves busy committing
+           are only stopped if we are going to do a major collection.
+           Important: we should not call cond_wait() in the meantime. */
+        stopped_all_threads = is_major_collection_requested();
+        synchronize_all_threads(stopped_all_threads
+                                ? STOP_OTHERS_UNTIL_MUTEX_UNLOCK
+                                : STOP_RUNNING_OTHERS_UNTIL_MUTEX_UNLOCK);
+    }
 
     if (any_local_finalizers()) {
         s_mutex_unlock();
@@ -835,7 +1480,7 @@ void stm_commit_transaction(void)
     }
 
     /* detect conflicts */
-    if (detect_write_read_conflicts())
+    if (!readonly && detect_write_read_conflicts())
         goto restart;
 
     /* cannot abort any more from here */
@@ -844,15 +1489,18 @@ void stm_commit_transaction(void)
     assert(STM_SEGMENT->nursery_end == NURSERY_END);
     stm_rewind_jmp_forget(STM_SEGMENT->running_thread);
 
-    /* if a major collection is required, do it here */
-    if (is_major_collection_requested()) {
+    /* if a major collection is required, do it here (if it was
+       requested only after synchronize_all_threads(), it is done
+       at the next commit instead) */
+    if (stopped_all_threads && is_major_collection_requested()) {
         timing_event(STM_SEGMENT->running_thread, STM_GC_MAJOR_START);
         major_collection_now_at_safe_point();
         timing_event(STM_SEGMENT->running_thread, STM_GC_MAJOR_DONE);
     }
 
     /* synchronize modified old objects to other threads */
-    push_modified_to_other_segments();
+    if (!readonly)
+        push_modified_to_other_segments();
     _verify_cards_cleared_in_all_lists(get_priv_segment(STM_SEGMENT->segment_num));
 
     commit_finalizers();
@@ -878,6 +1526,9 @@ void stm_commit_transaction(void)
 
     /* done */
     stm_thread_local_t *tl = STM_SEGMENT->running_thread;
+    forget_nested_transactions(get_priv_segment(STM_SEGMENT->segment_num));
+    grow_transaction_length(tl);
+    tl->aborts_in_a_row = 0;
     _finish_transaction(STM_TRANSACTION_COMMIT);
     /* cannot access STM_SEGMENT or STM_PSEGMENT from here ! */
 
@@ -893,10 +1544,12 @@ void stm_abort_transaction(void)
 }
 
 static void
-reset_modified_from_other_segments(int segment_num)
+reset_modified_from_other_segments(int segment_num, uintptr_t from_index)
 {
     /* pull the right versions from segment 0 in order
-       to reset our pages as part of an abort.
+       to reset our pages as part of an abort.  Only the objects
+       from 'from_index' onwards in 'modified_old_objects' are reset;
+       'from_index' is not 0 for the rollback of a nested transaction.
 
        Note that this function is also sometimes called from
        contention.c to clean up the state of a different thread,
@@ -906,45 +1559,55 @@ reset_modified_from_other_segments(int segment_num)
     struct stm_priv_segment_info_s *pseg = get_priv_segment(segment_num);
     char *local_base = get_segment_base(segment_num);
     char *remote_base = get_segment_base(0);
-
-    LIST_FOREACH_R(
-        pseg->modified_old_objects,
-        object_t * /*item*/,
-        ({
-            /* memcpy in the opposite direction than
-               push_modified_to_other_segments() */
-            char *src = REAL_ADDRESS(remote_base, item);
-            char *dst = REAL_ADDRESS(local_base, item);
-            ssize_t size = stmcb_size_rounded_up((struct object_s *)src);
-            memcpy(dst, src, size);
-
-            if (obj_should_use_cards(item))
-                _reset_object_cards(pseg, item, CARD_CLEAR, false);
-
-            /* objects in 'modified_old_objects' usually have the
-               WRITE_BARRIER flag, unless they have been modified
-               recently.  Ignore the old flag; after copying from the
-               other segment, we should have the flag. */
-            assert(((struct object_s *)dst)->stm_flags & GCFLAG_WRITE_BARRIER);
-
-            /* write all changes to the object before we release the
-               write lock below.  This is needed because we need to
-               ensure that if the write lock is not set, another thread
-               can get it and then change 'src' in parallel.  The
-               write_fence() ensures in particular that 'src' has been
-               fully read before we release the lock: reading it
-               is necessary to write 'dst'. */
-            write_fence();
-
-            /* clear the write-lock */
-            uintptr_t lock_idx = (((uintptr_t)item) >> 4) - WRITELOCK_START;
-            assert(lock_idx < sizeof(write_locks));
+    uintptr_t i = list_count(pseg->modified_old_objects);
+
+    while (i > from_index) {
+        object_t *item = (object_t *)list_item(pseg->modified_old_objects,
+                                               --i);
+        uintptr_t lock_idx = (((uintptr_t)item) >> 4) - WRITELOCK_START;
+        assert(lock_idx < NB_WRITE_LOCKS);
+        bool card_locks = write_locks[lock_idx] == CARDS_LOCKED;
+
+        /* memcpy in the opposite direction than
+           push_modified_to_other_segments().  With CARDS_LOCKED, the
+           cards of the other segments are only changed in their own
+           segment, so we can still copy the whole object. */
+        char *src = REAL_ADDRESS(remote_base, item);
+        char *dst = REAL_ADDRESS(local_base, item);
+        ssize_t size = stmcb_size_rounded_up((struct object_s *)src);
+        memcpy(dst, src, size);
+
+        if (!card_locks && obj_should_use_cards(item))
+            _reset_object_cards(pseg, item, CARD_CLEAR, false);
+
+        /* objects in 'modified_old_objects' usually have the
+           WRITE_BARRIER flag, unless they have been modified
+           recently.  Ignore the old flag; after copying from the
+           other segment, we should have the flag. */
+        assert(((struct object_s *)dst)->stm_flags & GCFLAG_WRITE_BARRIER);
+
+        /* write all changes to the object before we release the
+           write lock below.  This is needed because we need to
+           ensure that if the write lock is not set, another thread
+           can get it and then change 'src' in parallel.  The
+           write_fence() ensures in particular that 'src' has been
+           fully read before we release the lock: reading it
+           is necessary to write 'dst'. */
+        write_fence();
+
+        /* clear the write-lock */
+        if (card_locks) {
+            release_card_locks(pseg, item);
+        }
+        else {
             assert(write_locks[lock_idx] == pseg->write_lock_num);
             write_locks[lock_idx] = 0;
-        }));
+        }
+    }
 
-    list_clear(pseg->modified_old_objects);
-    list_clear(pseg->modified_old_objects_markers);
+    pseg->modified_old_objects->count = from_index;
+    if (list_count(pseg->modified_old_objects_markers) > 2 * from_index)
+        pseg->modified_old_objects_markers->count = 2 * from_index;
 }
 
 static void abort_data_structures_from_segment_num(int segment_num)
@@ -975,6 +1638,15 @@ static void abort_data_structures_from_segment_num(int segment_num)
 
     abort_finalizers(pseg);
 
+    if (major_marking_in_progress)
+        marking_forget_overflow_objects(pseg);
+
+    /* the work that is lost, measured before the nursery is cleared.
+       Reset the counters, in case this function is called again */
+    pseg->aborted_work += transaction_work(pseg);
+    pseg->work_nursery_bytes = 0;
+    pseg->work_pages_privatized = 0;
+
     /* throw away the content of the nursery */
     long bytes_in_nursery = throw_away_nursery(pseg);
 
@@ -997,7 +1669,7 @@ static void abort_data_structures_from_segment_num(int segment_num)
     }
 
     /* reset all the modified objects (incl. re-adding GCFLAG_WRITE_BARRIER) */
-    reset_modified_from_other_segments(segment_num);
+    reset_modified_from_other_segments(segment_num, 0);
     _verify_cards_cleared_in_all_lists(pseg);
 
     /* reset tl->shadowstack and thread_local_obj to their original
@@ -1024,6 +1696,9 @@ static void abort_data_structures_from_segment_num(int segment_num)
     tl->thread_local_obj = pseg->threadlocal_at_start_of_transaction;
     tl->last_abort__bytes_in_nursery = bytes_in_nursery;
 
+    /* the whole transaction is aborted, including the nested ones */
+    forget_nested_transactions(pseg);
+
     /* reset these lists to NULL too on abort */
     LIST_FREE(pseg->objects_pointing_to_nursery);
     list_clear(pseg->old_objects_with_cards);
@@ -1056,6 +1731,13 @@ static stm_thread_local_t *abort_with_mutex_no_longjmp(void)
 
     stm_thread_local_t *tl = STM_SEGMENT->running_thread;
 
+    /* account for the lost work */
+    long work = STM_PSEGMENT->aborted_work;
+    tl->last_abort__work = work;
+    tl->total_aborted_work += work;
+    shorten_transaction_length(tl, work);
+    tl->aborts_in_a_row++;
+
     /* clear memory registered on the thread-local */
     if (tl->mem_clear_on_abort)
         memset(tl->mem_clear_on_abort, 0, tl->mem_bytes_to_clear_on_abort);
@@ -1079,21 +1761,35 @@ static stm_thread_local_t *abort_with_mutex_no_longjmp(void)
 }
 
 static void abort_with_mutex(void)
+{
+    abort_with_mutex_and_sleep(1);
+}
+
+static void abort_with_mutex_and_sleep(long usec)
 {
     stm_thread_local_t *tl = abort_with_mutex_no_longjmp();
     s_mutex_unlock();
 
     /* It seems to be a good idea, at least in some examples, to sleep
-       one microsecond here before retrying.  Otherwise, what was
+       at least one microsecond here before retrying.  Otherwise, what was
        observed is that the transaction very often restarts too quickly
        for contention.c to react, and before it can do anything, we have
        again recreated in this thread a similar situation to the one
        that caused contention.  Anyway, usleep'ing in case of abort
        doesn't seem like a very bad idea.  If there are more threads
        than segments, it should also make sure another thread gets the
-       segment next.
+       segment next.  The contention management may ask for longer,
+       and so may stm_set_abort_backoff().
     */
-    usleep(1);
+    if (max_abort_backoff > 0) {
+        long n = tl->aborts_in_a_row;
+        long backoff = n < 30 ? (1L << n) : max_abort_backoff;
+        if (backoff > max_abort_backoff)
+            backoff = max_abort_backoff;
+        if (backoff > usec)
+            usec = backoff;
+    }
+    usleep(usec);
 
 #ifdef STM_NO_AUTOMATIC_SETJMP
     _test_run_abort(tl);
@@ -1114,6 +1810,10 @@ void _stm_become_inevitable(const char *msg)
         timing_fetch_inev();
         wait_for_end_of_inevitable_transaction();
         STM_PSEGMENT->transaction_state = TS_INEVITABLE;
+        /* should break as soon as possible, but not inside
+           stm_elide_lock() */
+        STM_SEGMENT->nursery_mark = (stm_char *)
+            (STM_PSEGMENT->elided_locks > 0 ? ELISION_NURSERY_MARK_OFFSET : 0);
         stm_rewind_jmp_forget(STM_SEGMENT->running_thread);
         invoke_and_clear_user_callbacks(0);   /* for commit */
     }
@@ -6,6 +6,7 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 
 /************************************************************/
 
@@ -14,26 +15,47 @@
 #endif
 
 
-#define NB_PAGES            (2500*256)    // 2500MB
-#define NB_SEGMENTS         STM_NB_SEGMENTS
-#define NB_SEGMENTS_MAX     240    /* don't increase NB_SEGMENTS past this */
+#define NB_SEGMENTS_MAX     STM_NB_SEGMENTS_MAX
 #define MAP_PAGES_FLAGS     (MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE)
 #define NB_NURSERY_PAGES    (STM_GC_NURSERY/4)
 
-#define TOTAL_MEMORY          (NB_PAGES * 4096UL * (1 + NB_SEGMENTS))
-#define READMARKER_END        ((NB_PAGES * 4096UL) >> 4)
-#define FIRST_OBJECT_PAGE     ((READMARKER_END + 4095) / 4096UL)
+#define TOTAL_MEMORY          (nb_pages * 4096UL * (1 + nb_segments))
+#define READMARKER_SHIFT      STM_READMARKER_SHIFT
+#define READMARKER_END        ((nb_pages * 4096UL) >> READMARKER_SHIFT)
+#ifdef STM_READ_SUMMARY
+/* with coarse read markers, the objects start higher up, to leave room
+   for the read summary below the read markers */
+# define READSUMMARY_ROOM     (((READSUMMARY_END + 4095) / 4096UL) <<  \
+                               (READMARKER_SHIFT + 12))
+# define FIRST_OBJECT_PAGE    (READMARKER_END >= READSUMMARY_ROOM ?     \
+                               (READMARKER_END + 4095) / 4096UL :      \
+                               READSUMMARY_ROOM / 4096UL)
+#else
+# define FIRST_OBJECT_PAGE    ((READMARKER_END + 4095) / 4096UL)
+#endif
 #define FIRST_NURSERY_PAGE    FIRST_OBJECT_PAGE
 #define END_NURSERY_PAGE      (FIRST_NURSERY_PAGE + NB_NURSERY_PAGES)
 
-#define READMARKER_START      ((FIRST_OBJECT_PAGE * 4096UL) >> 4)
+#define READMARKER_START      ((FIRST_OBJECT_PAGE * 4096UL) >> READMARKER_SHIFT)
 #define FIRST_READMARKER_PAGE (READMARKER_START / 4096UL)
-#define OLD_RM_START          ((END_NURSERY_PAGE * 4096UL) >> 4)
+#define OLD_RM_START          ((END_NURSERY_PAGE * 4096UL) >> READMARKER_SHIFT)
 #define FIRST_OLD_RM_PAGE     (OLD_RM_START / 4096UL)
 #define NB_READMARKER_PAGES   (FIRST_OBJECT_PAGE - FIRST_READMARKER_PAGE)
 
+/* reset_transaction_read_version() remaps the ranges of read markers
+   of at least this many pages, and clears the smaller ones in place */
+#define READMARKER_MMAP_MIN_PAGES  256
+
 #define WRITELOCK_START       ((END_NURSERY_PAGE * 4096UL) >> 4)
-#define WRITELOCK_END         READMARKER_END
+#define WRITELOCK_END         ((nb_pages * 4096UL) >> 4)
+
+/* with STM_READ_SUMMARY, one byte per page in range(2, ...) */
+#define READSUMMARY_START     ((uintptr_t)_STM_READSUMMARY_START)
+#define READSUMMARY_END       (READSUMMARY_START + \
+                               ((nb_pages * 4096UL) >> _STM_READSUMMARY_SHIFT))
+#define FIRST_READSUMMARY_PAGE (READSUMMARY_START / 4096UL)
+#define NB_READSUMMARY_PAGES  ((READSUMMARY_END + 4095) / 4096UL - \
+                               FIRST_READSUMMARY_PAGE)
 
 #define CARD_SIZE   _STM_CARD_SIZE
 
@@ -118,6 +140,16 @@ struct stm_priv_segment_info_s {
        that). */
     struct tree_s *young_outside_nursery;
 
+    /* Free chunk of largemalloc.c owned by this segment, from which
+       allocate_outside_nursery_large() carves objects without taking
+       the global lock; see _stm_large_malloc_from_reserve(). */
+    char *large_reserve;
+
+    /* While an incremental major collection is marking, the old objects
+       that this segment changed or created since the last marking
+       slice.  They are traced again by the next slice; see gcpage.c. */
+    struct list_s *marking_dirty_objects;
+
     /* Support for id and identityhash: this is a dict mapping nursery
        objects with GCFLAG_HAS_SHADOW to their future location at the
        next minor collection. */
@@ -140,6 +172,19 @@ struct stm_priv_segment_info_s {
        been running, in contention management */
     uint64_t unique_start_time;
 
+    /* The work done so far by the transaction, for transaction_work():
+       the nursery bytes emptied by its previous minor collections, and
+       the number of pages that it privatized */
+    uint64_t work_nursery_bytes;
+    uint64_t work_pages_privatized;
+
+    /* The work lost by the abort in progress */
+    uint64_t aborted_work;
+
+    /* How many more microseconds the transaction can pause in
+       contention management, or -1 if there is no limit */
+    long contention_wait_left;
+
     /* This is the number stored in the overflowed objects (a multiple of
        GCFLAG_OVERFLOW_NUMBER_bit0).  It is incremented when the
        transaction is done, but only if we actually overflowed any
@@ -191,6 +236,25 @@ struct stm_priv_segment_info_s {
     /* Already signalled to commit soon: */
     bool signalled_to_commit_soon;
 
+    /* Started with stm_start_readonly_transaction() */
+    bool readonly_transaction;
+
+    /* Allocated hashtable entries, which even stm_hashtable_read() can
+       do in a read-only transaction */
+    bool allocated_hashtable_entries;
+
+    /* Number of stm_elide_lock() without stm_elide_unlock() so far */
+    long elided_locks;
+
+    /* stm_read_range() marked the cards of some object as read */
+    bool read_card_ranges;
+
+    /* The objects in 'modified_old_objects' that were added there
+       because we locked some of their cards (see CARDS_LOCKED).  The
+       value is 1 if some of these cards were marked since the last
+       minor collection, which then traces them. */
+    struct tree_s *card_locked_objects;
+
     /* For debugging */
 #ifndef NDEBUG
     pthread_t running_pthread;
@@ -208,11 +272,20 @@ struct stm_priv_segment_info_s {
 
     /* list of bags that are old but modified */
     struct list_s *modified_bags;
+
+    /* the innermost stm_begin_nested() not committed or rolled back
+       yet, or NULL.  Meanwhile, the write barrier saves into
+       'nested_undo' the content of the objects that this transaction
+       had already changed or created, as pairs (object, malloced
+       copy); see nested.c */
+    stm_nested_t *nested;
+    struct list_s *nested_undo;
 };
 
 enum /* safe_point */ {
     SP_NO_TRANSACTION=0,
     SP_RUNNING,
+    SP_COMMITTING,
     SP_WAIT_FOR_C_REQUEST_REMOVED,
     SP_WAIT_FOR_C_AT_SAFE_POINT,
     SP_WAIT_FOR_C_TRANSACTION_DONE,
@@ -227,10 +300,15 @@ enum /* transaction_state */ {
 };
 
 static char *stm_object_pages;
+static long nb_segments;     /* chosen by stm_setup(), <= NB_SEGMENTS_MAX */
+static uintptr_t nb_pages;   /* chosen by stm_setup(), from STM_HEAP_SIZE_MB */
 static int stm_object_pages_fd;
 static stm_thread_local_t *stm_all_thread_locals = NULL;
 
-static uint8_t write_locks[WRITELOCK_END - WRITELOCK_START];
+/* 'write_locks' is a NORESERVE mmap of NB_WRITE_LOCKS bytes, so that
+   only the part covering the used addresses is ever backed by memory */
+#define NB_WRITE_LOCKS        (WRITELOCK_END - WRITELOCK_START)
+static uint8_t *write_locks;
 
 enum /* card values for write_locks */ {
     CARD_CLEAR = 0,                 /* card not used at all */
@@ -239,6 +317,33 @@ enum /* card values for write_locks */ {
                                        in a GC */
 };
 
+/* The write lock of an object whose cards are locked individually by
+   _stm_write_slowpath_card().  Each card then holds the 'write_lock_num'
+   of the segment that owns it, or CARD_CLEAR.  A card is taken with a
+   compare-and-swap from CARD_CLEAR, and kept only if the object is
+   still CARDS_LOCKED afterwards.  CARD_LOCK_MARKED is added to it until
+   the next minor collection traces the card.  Such objects never get
+   GCFLAG_CARDS_SET, so that a JIT never writes CARD_MARKED directly
+   into their cards.
+
+   The write lock changes from or to CARDS_LOCKED only with the mutex.
+   To leave CARDS_LOCKED, it is first set to CARDS_CHANGING, and the
+   cards are checked again: a card taken in the meantime sees
+   CARDS_CHANGING and is given back. */
+#define CARDS_LOCKED       0xff
+#define CARDS_CHANGING     0xfe
+#define CARD_LOCK_MARKED   0x80
+#if NB_SEGMENTS_MAX >= CARD_LOCK_MARKED
+#  error "NB_SEGMENTS_MAX too large for CARD_LOCK_MARKED"
+#endif
+
+static inline bool cards_are_locked(uintptr_t lock_idx)
+{
+    /* without the mutex, CARDS_CHANGING is also possible */
+    uint8_t lock = ((volatile uint8_t *)write_locks)[lock_idx];
+    return lock == CARDS_LOCKED || lock == CARDS_CHANGING;
+}
+
 
 #define REAL_ADDRESS(segment_base, src)   ((segment_base) + (uintptr_t)(src))
 
@@ -256,12 +361,12 @@ static inline uintptr_t get_card_index_to_index(uintptr_t card_index) {
 
 static inline uintptr_t get_write_lock_idx(uintptr_t obj) {
     uintptr_t res = (obj >> 4) - WRITELOCK_START;
-    assert(res < sizeof(write_locks));
+    assert(res < NB_WRITE_LOCKS);
     return res;
 }
 
 static inline char *get_segment_base(long segment_num) {
-    return stm_object_pages + segment_num * (NB_PAGES * 4096UL);
+    return stm_object_pages + segment_num * (nb_pages * 4096UL);
 }
 
 static inline
@@ -280,19 +385,66 @@ static bool _is_tl_registered(stm_thread_local_t *tl);
 static bool _seems_to_be_running_transaction(void);
 
 static void teardown_core(void);
+/* the default maximum for stm_set_transaction_length(): one nursery */
+#define DEFAULT_TRANSACTION_LENGTH   (NB_NURSERY_PAGES * 4096L)
+
 static void abort_with_mutex(void) __attribute__((noreturn));
+static void abort_with_mutex_and_sleep(long usec) __attribute__((noreturn));
 static stm_thread_local_t *abort_with_mutex_no_longjmp(void);
 static void abort_data_structures_from_segment_num(int segment_num);
+static bool obj_should_use_cards(object_t *obj);
+static void release_card_locks(struct stm_priv_segment_info_s *pseg,
+                               object_t *obj);
 
 static inline bool was_read_remote(char *base, object_t *obj,
                                    uint8_t other_transaction_read_version)
 {
     uint8_t rm = ((struct stm_read_marker_s *)
-                  (base + (((uintptr_t)obj) >> 4)))->rm;
+                  (base + (((uintptr_t)obj) >> READMARKER_SHIFT)))->rm;
     assert(rm <= other_transaction_read_version);
     return rm == other_transaction_read_version;
 }
 
+static inline void reset_read_marker(char *base, object_t *obj)
+{
+    /* Called when 'obj' is freed.  With coarse read markers, the read
+       marker may be shared with live objects that were read, so we
+       must leave it, at the cost of a possible false conflict. */
+#if READMARKER_SHIFT == 4
+    ((struct stm_read_marker_s *)(base + (((uintptr_t)obj) >> 4)))->rm = 0;
+#endif
+}
+
+/* stm_read_range() and the card locks need one read marker per card,
+   following the object's own read marker.  This is only possible with
+   one read marker per 16 bytes: they are then the read markers of the
+   object's own memory, as CARD_SIZE >= 32.  With coarse read markers,
+   they would be shared with the next objects, so stm_read_range()
+   reads the whole object instead and no card read marker is ever set. */
+#define CARD_READ_MARKERS     (READMARKER_SHIFT == 4)
+
+static uintptr_t get_freed_last_card_index(char *segment_base,
+                                           object_t *obj);
+static void reset_card_read_markers(char *base, object_t *obj,
+                                    uintptr_t last_card_index);
+
+static inline bool may_have_been_read_remote(char *base, object_t *obj,
+                                   uint8_t other_transaction_read_version)
+{
+    /* Cheap filter in front of was_read_remote(): returns false if
+       nothing in the page of 'obj' was read.  Always true without
+       STM_READ_SUMMARY. */
+#ifdef STM_READ_SUMMARY
+    uint8_t rs = ((struct stm_read_marker_s *)
+                  (base + READSUMMARY_START +
+                   (((uintptr_t)obj) >> _STM_READSUMMARY_SHIFT)))->rm;
+    assert(rs <= other_transaction_read_version);
+    return rs == other_transaction_read_version;
+#else
+    return true;
+#endif
+}
+
 static inline void _duck(void) {
     /* put a call to _duck() between two instructions that set 0 into
        a %gs-prefixed address and that may otherwise be replaced with
@@ -0,0 +1,59 @@
+#ifndef _STM_CORE_H_
+# error "must be compiled via stmgc.c"
+#endif
+
+
+static void teardown_elision(void)
+{
+    lock_elision_retries = DEFAULT_LOCK_ELISION_RETRIES;
+}
+
+void stm_set_lock_elision_retries(long retries)
+{
+    lock_elision_retries = retries;
+}
+
+static void set_elided_locks(long count)
+{
+    long old_count = STM_PSEGMENT->elided_locks;
+    uintptr_t mark = (uintptr_t)STM_SEGMENT->nursery_mark;
+
+    assert(count >= 0);
+    if (old_count == 0 && count > 0)
+        mark += ELISION_NURSERY_MARK_OFFSET;
+    else if (old_count > 0 && count == 0)
+        mark -= ELISION_NURSERY_MARK_OFFSET;
+    STM_SEGMENT->nursery_mark = (stm_char *)mark;
+    STM_PSEGMENT->elided_locks = count;
+}
+
+void stm_elide_lock(stm_thread_local_t *tl, object_t *lock)
+{
+    assert(STM_SEGMENT->running_thread == tl);
+
+    if (tl->aborts_in_a_row >= lock_elision_retries ||
+            STM_PSEGMENT->transaction_state == TS_INEVITABLE) {
+        /* acquire the lock for real.  Only one transaction can be
+           inevitable at a time, and writing to the lock object makes
+           all transactions that elided it abort when we commit. */
+        dprintf(("stm_elide_lock: acquired for real\n"));
+        stm_become_inevitable(tl, "lock elision");
+        stm_write(lock);
+    }
+    else {
+        /* we only need to conflict with a transaction that acquires
+           the lock for real */
+        stm_read(lock);
+    }
+    set_elided_locks(STM_PSEGMENT->elided_locks + 1);
+}
+
+void stm_elide_unlock(stm_thread_local_t *tl, object_t *lock)
+{
+    assert(STM_SEGMENT->running_thread == tl);
+    assert(STM_PSEGMENT->elided_locks > 0);
+
+    /* if acquired for real, the lock object is released when the
+       inevitable transaction commits */
+    set_elided_locks(STM_PSEGMENT->elided_locks - 1);
+}
@@ -0,0 +1,13 @@
+
+/* after this many aborts in a row, stm_elide_lock() acquires the lock
+   for real */
+#define DEFAULT_LOCK_ELISION_RETRIES   3
+
+/* added to 'nursery_mark' while an elided lock is held, so that
+   stm_should_break_transaction() returns false */
+#define ELISION_NURSERY_MARK_OFFSET    ((uintptr_t)1 << 62)
+
+static long lock_elision_retries = DEFAULT_LOCK_ELISION_RETRIES;
+
+static void teardown_elision(void);
+static void set_elided_locks(long count);
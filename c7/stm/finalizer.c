@@ -115,6 +115,26 @@ static void abort_finalizers(struct stm_priv_segment_info_s *pseg)
         set_gs_register(old_gs_register);
 }
 
+static void rollback_young_finalizers(void)
+{
+    /* like abort_finalizers(), but only for the young objects, which
+       are about to be thrown away by the rollback of a nested
+       transaction */
+    if (STM_PSEGMENT->finalizers != NULL) {
+        struct list_s *lst = STM_PSEGMENT->finalizers->objects_with_finalizers;
+        lst->count = STM_PSEGMENT->finalizers->count_non_young;
+    }
+
+    struct list_s *lst = STM_PSEGMENT->young_objects_with_light_finalizers;
+    long i, count = list_count(lst);
+    for (i = 0; i < count; i++) {
+        object_t *obj = (object_t *)list_item(lst, i);
+        assert(_is_young(obj));
+        stmcb_light_finalizer(obj);
+    }
+    list_clear(lst);
+}
+
 
 void stm_enable_light_finalizer(object_t *obj)
 {
@@ -176,7 +196,7 @@ static void deal_with_old_objects_with_finalizers(void)
     int old_gs_register = STM_SEGMENT->segment_num;
     int current_gs_register = old_gs_register;
     long j;
-    for (j = 1; j <= NB_SEGMENTS; j++) {
+    for (j = 1; j <= nb_segments; j++) {
         struct stm_priv_segment_info_s *pseg = get_priv_segment(j);
 
         struct list_s *lst = pseg->old_objects_with_light_finalizers;
@@ -226,14 +246,14 @@ static inline int _finalization_state(object_t *obj)
        One difference is that the official state 0 is returned here
        as a number that is <= 0. */
     uintptr_t lock_idx = mark_loc(obj);
-    return write_locks[lock_idx] - (WL_FINALIZ_ORDER_1 - 1);
+    return visit_markers[lock_idx] - (WL_FINALIZ_ORDER_1 - 1);
 }
 
 static void _bump_finalization_state_from_0_to_1(object_t *obj)
 {
     uintptr_t lock_idx = mark_loc(obj);
-    assert(write_locks[lock_idx] < WL_FINALIZ_ORDER_1);
-    write_locks[lock_idx] = WL_FINALIZ_ORDER_1;
+    assert(visit_markers[lock_idx] < WL_FINALIZ_ORDER_1);
+    visit_markers[lock_idx] = WL_FINALIZ_ORDER_1;
 }
 
 static struct list_s *_finalizer_tmpstack;
@@ -265,7 +285,7 @@ static void _recursively_bump_finalization_state(char *base, object_t *obj,
     while (1) {
         if (_finalization_state(obj) == to_state - 1) {
             /* bump to the next state */
-            write_locks[mark_loc(obj)]++;
+            visit_markers[mark_loc(obj)]++;
 
             /* trace */
             tmpstack = finalizer_trace(base, obj, tmpstack);
@@ -366,12 +386,12 @@ static void deal_with_objects_with_finalizers(void)
        point, the object would be in a 'modified_old_objects' list
        somewhere, and so it wouldn't be dead).
     */
-    struct list_s *marked_seg[NB_SEGMENTS + 1];
+    struct list_s *marked_seg[NB_SEGMENTS_MAX + 1];
     LIST_CREATE(_finalizer_emptystack);
     LIST_CREATE(_finalizer_pending);
 
     long j;
-    for (j = 1; j <= NB_SEGMENTS; j++) {
+    for (j = 1; j <= nb_segments; j++) {
         struct stm_priv_segment_info_s *pseg = get_priv_segment(j);
         marked_seg[j] = mark_finalize_step1(pseg->pub.segment_base,
                                             pseg->finalizers);
@@ -380,7 +400,7 @@ static void deal_with_objects_with_finalizers(void)
 
     LIST_FREE(_finalizer_pending);
 
-    for (j = 1; j <= NB_SEGMENTS; j++) {
+    for (j = 1; j <= nb_segments; j++) {
         struct stm_priv_segment_info_s *pseg = get_priv_segment(j);
         mark_finalize_step2(pseg->pub.segment_base, pseg->finalizers,
                             marked_seg[j]);
@@ -401,7 +421,7 @@ static void mark_visit_from_finalizer1(char *base, struct finalizers_s *f)
 static void mark_visit_from_finalizer_pending(void)
 {
     long j;
-    for (j = 1; j <= NB_SEGMENTS; j++) {
+    for (j = 1; j <= nb_segments; j++) {
         struct stm_priv_segment_info_s *pseg = get_priv_segment(j);
         mark_visit_from_finalizer1(pseg->pub.segment_base, pseg->finalizers);
     }
@@ -16,6 +16,7 @@ static void teardown_finalizer(void);
 
 static void _commit_finalizers(void);
 static void abort_finalizers(struct stm_priv_segment_info_s *);
+static void rollback_young_finalizers(void);
 
 #define commit_finalizers()   do {              \
     if (STM_PSEGMENT->finalizers != NULL)       \
@@ -3,8 +3,13 @@
 #endif
 
 
-/* XXX this is currently not doing copy-on-write, but simply forces a
-   copy of all pages as soon as fork() is called. */
+/* The object pages are a MAP_SHARED mapping, which fork() does not
+   turn copy-on-write: the child would see the changes done by the parent
+   afterwards.  So fork() makes a new mmap for the child with a copy of
+   the pages.  Only the pages that can contain data are copied; the
+   others are not even touched.  The child then reshares the pages,
+   with one remap_file_pages() per range of non-private pages.
+*/
 
 
 static char *fork_big_copy = NULL;
@@ -22,6 +27,40 @@ static bool page_is_null(char *p)
     return true;
 }
 
+static void fork_copy_nonnull_pages(char *big_copy, char *segment_base,
+                                    uintptr_t pagenum, uintptr_t endpagenum)
+{
+    char *src = segment_base + pagenum * 4096UL;
+    char *dst = big_copy + (src - stm_object_pages);
+    for (; pagenum < endpagenum; pagenum++) {
+        if (!page_is_null(src))
+            pagecopy_nt(dst, src);
+        src += 4096;
+        dst += 4096;
+    }
+}
+
+
+static char *fork_copy_target;
+static uintptr_t fork_copy_next_page;
+
+static void fork_copy_data_range(char *start, char *stop)
+{
+    /* copy the pages of segment 0 overlapping the range.  The ranges
+       are given in increasing order, and two of them may share a page */
+    uintptr_t pagenum = (start - stm_object_pages) / 4096UL;
+    uintptr_t endpagenum = (stop - stm_object_pages + 4095) / 4096UL;
+    if (pagenum < fork_copy_next_page)
+        pagenum = fork_copy_next_page;
+
+    for (; pagenum < endpagenum; pagenum++) {
+        pagecopy_nt(fork_copy_target + pagenum * 4096UL,
+                    stm_object_pages + pagenum * 4096UL);
+    }
+    if (fork_copy_next_page < pagenum)
+        fork_copy_next_page = pagenum;
+}
+
 
 static void forksupport_prepare(void)
 {
@@ -36,7 +75,6 @@ static void forksupport_prepare(void)
     s_mutex_lock();
 
     dprintf(("forksupport_prepare\n"));
-    fprintf(stderr, "[forking: for now, this operation can take some time]\n");
 
     stm_thread_local_t *this_tl = NULL;
     stm_thread_local_t *tl = stm_all_thread_locals;
@@ -70,35 +108,63 @@ static void forksupport_prepare(void)
     */
     int big_copy_fd;
     char *big_copy = setup_mmap("stmgc's fork support", &big_copy_fd);
+    /* (the copies below use pagecopy_nt(): nobody reads them before
+       the child process starts) */
 
     /* Copy each of the segment infos into the new mmap, nurseries,
        and associated read markers
      */
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
-        char *src, *dst;
+    for (i = 1; i <= nb_segments; i++) {
         struct stm_priv_segment_info_s *psrc = get_priv_segment(i);
-        dst = big_copy + (((char *)psrc) - stm_object_pages);
+        char *dst = big_copy + (((char *)psrc) - stm_object_pages);
         *(struct stm_priv_segment_info_s *)dst = *psrc;
 
-        src = get_segment_base(i) + FIRST_READMARKER_PAGE * 4096UL;
+        /* Only the read markers of the objects in the used ranges of
+           pages can be non-zero (the page of the read markers of 'addr'
+           is 'addr >> 16' by default); copy them, and then the nursery */
+        uintptr_t rm_start, rm_stop;
+        rm_start = (uninitialized_page_start - stm_object_pages) >>
+            (READMARKER_SHIFT + 12);
+        rm_stop  = (uninitialized_page_stop  - stm_object_pages) >>
+            (READMARKER_SHIFT + 12);
+        fork_copy_nonnull_pages(big_copy, get_segment_base(i),
+                                FIRST_READMARKER_PAGE, rm_start + 1);
+        fork_copy_nonnull_pages(big_copy, get_segment_base(i),
+                                rm_stop, END_NURSERY_PAGE);
+
+#ifdef STM_READ_SUMMARY
+        char *src = get_segment_base(i) + FIRST_READSUMMARY_PAGE * 4096UL;
         dst = big_copy + (src - stm_object_pages);
-        long j;
-        for (j = 0; j < END_NURSERY_PAGE - FIRST_READMARKER_PAGE; j++) {
-            if (!page_is_null(src))
-                pagecopy(dst, src);
-            src += 4096;
-            dst += 4096;
-        }
+        memcpy(dst, src, NB_READSUMMARY_PAGES * 4096UL);
+#endif
     }
 
-    /* Copy all the data from the two ranges of objects (large, small)
-       into the new mmap
+    /* Copy the data from the two ranges of objects (large, small)
+       into the new mmap.  In the largemalloc arena, the content of the
+       free chunks is skipped.  In the small objects' pages, the free
+       pages only contain the link in 'free_uniform_pages'.
     */
+    fork_copy_target = big_copy;
+    fork_copy_next_page = 0;
+    _stm_largemalloc_data_ranges(fork_copy_data_range);
+
     uintptr_t pagenum, endpagenum;
+    pagenum = (uninitialized_page_stop - stm_object_pages) / 4096UL;
+    for (; pagenum < nb_pages; pagenum++) {
+        char *src = stm_object_pages + pagenum * 4096UL;
+        char *dst = big_copy + pagenum * 4096UL;
+        if (small_page_sizes[pagenum - PAGE_FLAG_START] != 0)
+            pagecopy_nt(dst, src);
+        else
+            *(char **)dst = *(char **)src;
+    }
+
+    /* Copy the pages that are private to some segments
+    */
     pagenum = END_NURSERY_PAGE;   /* starts after the nursery */
     endpagenum = (uninitialized_page_start - stm_object_pages) / 4096UL;
-    if (endpagenum < NB_PAGES)
+    if (endpagenum < nb_pages)
         endpagenum++;   /* the next page too, because it might contain
                            data from largemalloc */
 
@@ -106,26 +172,24 @@ static void forksupport_prepare(void)
         if (UNLIKELY(pagenum == endpagenum)) {
             /* we reach this point usually twice, because there are
                more pages after 'uninitialized_page_stop' */
-            if (endpagenum == NB_PAGES)
+            if (endpagenum == nb_pages)
                 break;   /* done */
             pagenum = (uninitialized_page_stop - stm_object_pages) / 4096UL;
             pagenum--;   /* the prev page too, because it does contain
                             data from largemalloc */
-            endpagenum = NB_PAGES;
+            endpagenum = nb_pages;
         }
 
-        char *src = stm_object_pages + pagenum * 4096UL;
-        char *dst = big_copy + pagenum * 4096UL;
-        pagecopy(dst, src);
-
         struct page_shared_s ps = pages_privatized[pagenum - PAGE_FLAG_START];
         if (ps.by_segment != 0) {
+            char *src = stm_object_pages + pagenum * 4096UL;
+            char *dst = big_copy + pagenum * 4096UL;
             long j;
-            for (j = 0; j < NB_SEGMENTS; j++) {
-                src += NB_PAGES * 4096UL;
-                dst += NB_PAGES * 4096UL;
-                if (ps.by_segment & (1 << j)) {
-                    pagecopy(dst, src);
+            for (j = 0; j < nb_segments; j++) {
+                src += nb_pages * 4096UL;
+                dst += nb_pages * 4096UL;
+                if (ps.by_segment & (1UL << j)) {
+                    pagecopy_nt(dst, src);
                 }
             }
         }
@@ -138,6 +202,9 @@ static void forksupport_prepare(void)
     fork_this_tl = this_tl;
     fork_was_in_transaction = was_in_transaction;
 
+    /* the other threads may be in wait_for_request_removed() */
+    sp_mutex_lock();
+
     assert(_has_mutex());
     dprintf(("forksupport_prepare: from %p %p\n", fork_this_tl,
              fork_this_tl->creating_pthread[0]));
@@ -162,6 +229,7 @@ static void forksupport_parent(void)
     close_fd_mmap(fork_big_copy_fd);
     bool was_in_transaction = fork_was_in_transaction;
 
+    sp_mutex_unlock();
     s_mutex_unlock();
 
     if (!was_in_transaction) {
@@ -199,6 +267,8 @@ static void forksupport_child(void)
 
     /* this new process contains no other thread, so we can
        just release these locks early */
+    mark_shared.waiting_threads = 0;
+    sp_mutex_unlock();
     s_mutex_unlock();
 
     /* Move the copy of the mmap over the old one, overwriting it
@@ -230,38 +300,45 @@ static void forksupport_child(void)
      */
     setup_protection_settings();
 
-    /* Make all pages shared again.
+    /* Make all pages shared again, except the private ones.  This is
+       done with one call to remap_file_pages() for each range of
+       consecutive pages that are not private in a segment.
      */
-    uintptr_t pagenum, endpagenum;
-    pagenum = END_NURSERY_PAGE;   /* starts after the nursery */
-    endpagenum = (uninitialized_page_start - stm_object_pages) / 4096UL;
-
-    while (1) {
-        if (UNLIKELY(pagenum == endpagenum)) {
-            /* we reach this point usually twice, because there are
-               more pages after 'uninitialized_page_stop' */
-            if (endpagenum == NB_PAGES)
-                break;   /* done */
-            pagenum = (uninitialized_page_stop - stm_object_pages) / 4096UL;
-            endpagenum = NB_PAGES;
-            if (endpagenum == NB_PAGES)
-                break;   /* done */
-        }
-
-        struct page_shared_s ps = pages_privatized[pagenum - PAGE_FLAG_START];
-        long j;
-        for (j = 0; j < NB_SEGMENTS; j++) {
-            if (!(ps.by_segment & (1 << j))) {
-                _page_do_reshare(j + 1, pagenum);
+    long j;
+    for (j = 0; j < nb_segments; j++) {
+        uintptr_t pagenum, endpagenum, start;
+        pagenum = END_NURSERY_PAGE;   /* starts after the nursery */
+        endpagenum = (uninitialized_page_start - stm_object_pages) / 4096UL;
+        start = pagenum;
+
+        while (1) {
+            if (pagenum == endpagenum ||
+                    (pages_privatized[pagenum - PAGE_FLAG_START].by_segment
+                     & (1UL << j))) {
+                if (start < pagenum)
+                    _pages_do_reshare(j + 1, start, pagenum - start);
+
+                if (UNLIKELY(pagenum == endpagenum)) {
+                    /* we reach this point usually twice, because there
+                       are more pages after 'uninitialized_page_stop' */
+                    if (endpagenum == nb_pages)
+                        break;   /* done */
+                    pagenum = (uninitialized_page_stop - stm_object_pages)
+                              / 4096UL;
+                    endpagenum = nb_pages;
+                    start = pagenum;
+                    continue;
+                }
+                start = pagenum + 1;
             }
+            pagenum++;
         }
-        pagenum++;
     }
 
     /* Force the interruption of other running segments
      */
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         struct stm_priv_segment_info_s *pr = get_priv_segment(i);
         if (pr->pub.running_thread != NULL &&
             pr->pub.running_thread != fork_this_tl) {
@@ -272,7 +349,7 @@ static void forksupport_child(void)
     /* Restore a few things: the new pthread_self(), and the %gs
        register */
     int segnum = fork_this_tl->associated_segment_num;
-    assert(1 <= segnum && segnum <= NB_SEGMENTS);
+    assert(1 <= segnum && segnum <= nb_segments);
     *_get_cpth(fork_this_tl) = pthread_self();
     set_gs_register(get_segment_base(segnum));
     assert(STM_SEGMENT->segment_num == segnum);
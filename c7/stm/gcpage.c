@@ -10,17 +10,39 @@ static struct tree_s *tree_prebuilt_objs = NULL;     /* XXX refactor */
 static void setup_gcpage(void)
 {
     char *base = stm_object_pages + END_NURSERY_PAGE * 4096UL;
-    uintptr_t length = (NB_PAGES - END_NURSERY_PAGE) * 4096UL;
+    uintptr_t length = (nb_pages - END_NURSERY_PAGE) * 4096UL;
     _stm_largemalloc_init_arena(base, length);
 
     uninitialized_page_start = stm_object_pages + END_NURSERY_PAGE * 4096UL;
-    uninitialized_page_stop  = stm_object_pages + NB_PAGES * 4096UL;
+    uninitialized_page_stop  = stm_object_pages + nb_pages * 4096UL;
+
+    long i;
+    for (i = 2; i < GC_N_SMALL_REQUESTS; i++)
+        LIST_CREATE(small_page_lists[i]);
+    small_page_sizes = setup_private_mmap("small_page_sizes mmap()",
+                                          NB_PAGES_PRIVATIZED);
+    visit_markers = setup_private_mmap("visit_markers mmap()",
+                                       NB_WRITE_LOCKS);
 }
 
 static void teardown_gcpage(void)
 {
+    LIST_FREE(mark_shared.pending);
+    LIST_FREE(mark_shared.hashtables);
+    max_marking_threads = 0;
+    LIST_FREE(marking_pending_pairs);
+    major_marking_in_progress = false;
+    major_gc_pause_budget = 0;
+    munmap(visit_markers, NB_WRITE_LOCKS);
+    visit_markers = NULL;
     memset(small_alloc, 0, sizeof(small_alloc));
     free_uniform_pages = NULL;
+    long i;
+    for (i = 2; i < GC_N_SMALL_REQUESTS; i++)
+        LIST_FREE(small_page_lists[i]);
+    munmap(small_page_sizes, NB_PAGES_PRIVATIZED);
+    small_page_sizes = NULL;
+    small_bytes_accounted = 0;
     LIST_FREE(testing_prebuilt_objs);
     if (tree_prebuilt_objs != NULL) {
         tree_free(tree_prebuilt_objs);
@@ -36,52 +58,96 @@ static void setup_N_pages(char *pages_addr, uint64_t num)
     pages_initialize_shared((pages_addr - stm_object_pages) / 4096UL, num);
 }
 
-static void grab_more_free_pages_for_small_allocations(void)
+static int lock_growth_large = 0;
+
+static bool grab_more_free_pages_for_small_allocations(void)
 {
-    abort();//XXX
-    /* grab N (= GCPAGE_NUM_PAGES) pages out of the top addresses */
+    /* grab N (= GCPAGE_NUM_PAGES) pages out of the top addresses.
+       Fails if the largemalloc arena cannot be reduced accordingly. */
+    assert(lock_small_pages);
+    bool result = false;
     uintptr_t decrease_by = GCPAGE_NUM_PAGES * 4096;
-    if (uninitialized_page_stop - uninitialized_page_start <= decrease_by)
-        goto out_of_memory;
 
-    uninitialized_page_stop -= decrease_by;
+    spinlock_acquire(lock_growth_large);
+
+    if (uninitialized_page_stop - uninitialized_page_start <= decrease_by)
+        goto out;
 
-    if (!_stm_largemalloc_resize_arena(uninitialized_page_stop -
-                                       uninitialized_page_start))
-        goto out_of_memory;
+    char *new_stop = uninitialized_page_stop - decrease_by;
+    char *arena_start = stm_object_pages + END_NURSERY_PAGE * 4096UL;
+    if (!_stm_largemalloc_resize_arena(new_stop - arena_start))
+        goto out;
 
-    setup_N_pages(uninitialized_page_start, GCPAGE_NUM_PAGES);
+    uninitialized_page_stop = new_stop;
+    setup_N_pages(new_stop, GCPAGE_NUM_PAGES);
 
-    char *p = uninitialized_page_start;
+    char *p = new_stop;
     long i;
-    for (i = 0; i < 16; i++) {
+    for (i = 0; i < GCPAGE_NUM_PAGES; i++) {
         *(char **)p = free_uniform_pages;
         free_uniform_pages = p;
+        p += 4096;
     }
-    return;
+    result = true;
 
- out_of_memory:
-    stm_fatalerror("out of memory!");   /* XXX */
+ out:
+    spinlock_release(lock_growth_large);
+    return result;
 }
 
 static char *_allocate_small_slowpath(uint64_t size)
 {
-    /* not thread-safe!  Use only when holding the mutex */
-    assert(_has_mutex());
+    /* Refill this segment's free list for 'size', either with the free
+       objects of a page left partially free by the last major
+       collection, or with a completely free page.  Called during minor
+       collections, which can run in parallel in several segments. */
+    uint64_t index = size / 8;
+    struct small_alloc_s *sa = &small_alloc[STM_SEGMENT->segment_num - 1][index];
+    uint64_t free_bytes;
+    assert(sa->next_object == NULL);
+
+    spinlock_acquire(lock_small_pages);
+
+    struct list_s *lst = small_page_lists[index];
+    if (!list_is_empty(lst)) {
+        free_bytes = list_pop_item(lst);
+        sa->range_last = (char *)list_pop_item(lst);
+        sa->next_object = (char *)list_pop_item(lst);
+    }
+    else {
+        if (free_uniform_pages == NULL &&
+                !grab_more_free_pages_for_small_allocations()) {
+            spinlock_release(lock_small_pages);
+            return NULL;
+        }
+        char *page = free_uniform_pages;
+        free_uniform_pages = *(char **)page;
+
+        uintptr_t pagenum = (page - stm_object_pages) / 4096UL;
+        small_page_sizes[pagenum - PAGE_FLAG_START] = index;
+
+        /* the whole page is a single range of free objects, and the
+           last one contains the (empty) link to the next range */
+        free_bytes = (4096 / size) * size;
+        char *last = page + free_bytes - size;
+        ((char **)last)[0] = NULL;
+        ((char **)last)[1] = NULL;
+        sa->next_object = page;
+        sa->range_last = last;
+    }
+    /* all the free objects we hand out are counted as allocated until
+       the next major collection */
+    small_bytes_accounted += free_bytes;
 
-    if (free_uniform_pages == NULL)
-        grab_more_free_pages_for_small_allocations();
+    spinlock_release(lock_small_pages);
 
-    abort();//...
+    increment_total_allocated(free_bytes);
+    return allocate_outside_nursery_small(size);
 }
 
 
-static int lock_growth_large = 0;
-
-static char *allocate_outside_nursery_large(uint64_t size)
+static char *_initialize_pages_for_large(char *addr, uint64_t size)
 {
-    /* Allocate the object with largemalloc.c from the lower addresses. */
-    char *addr = _stm_large_malloc(size);
     if (addr == NULL)
         stm_fatalerror("not enough memory!");
 
@@ -111,10 +177,22 @@ static char *allocate_outside_nursery_large(uint64_t size)
     return addr;
 }
 
+static char *allocate_outside_nursery_large(uint64_t size)
+{
+    /* Allocate the object with largemalloc.c from the lower addresses.
+       Use the reserve of the current segment, so that we don't usually
+       need to grab the global lock of largemalloc.c. */
+    char **reserve = &get_priv_segment(STM_SEGMENT->segment_num)->large_reserve;
+    char *addr = _stm_large_malloc_from_reserve(reserve, size);
+    return _initialize_pages_for_large(addr, size);
+}
+
 object_t *_stm_allocate_old(ssize_t size_rounded_up)
 {
-    /* only for tests xxx but stm_setup_prebuilt() uses this now too */
-    char *p = allocate_outside_nursery_large(size_rounded_up);
+    /* only for tests xxx but stm_setup_prebuilt() uses this now too.
+       We may not be running in any segment here. */
+    char *p = _initialize_pages_for_large(_stm_large_malloc(size_rounded_up),
+                                          size_rounded_up);
     memset(p, 0, size_rounded_up);
 
     object_t *o = (object_t *)(p - stm_object_pages);
@@ -160,7 +238,11 @@ static void major_collection_if_requested(void)
 /************************************************************/
 
 
-static struct list_s *mark_objects_to_trace;
+/* The objects still to trace, as pairs (object, segment_base).  There
+   is one such list in each thread that takes part in the marking: see
+   mark_trace_pairs(). */
+static __thread struct list_s *mark_objects_to_trace;
+static __thread char *mark_segment_base;
 
 #define WL_FINALIZ_ORDER_1    253
 #define WL_FINALIZ_ORDER_2    254
@@ -172,33 +254,34 @@ static struct list_s *mark_objects_to_trace;
 static inline uintptr_t mark_loc(object_t *obj)
 {
     uintptr_t lock_idx = get_write_lock_idx((uintptr_t)obj);
-    assert(lock_idx < sizeof(write_locks));
+    assert(lock_idx < NB_WRITE_LOCKS);
     return lock_idx;
 }
 
 static inline bool mark_visited_test(object_t *obj)
 {
     uintptr_t lock_idx = mark_loc(obj);
-    return write_locks[lock_idx] == WL_VISITED;
+    return visit_markers[lock_idx] == WL_VISITED;
 }
 
 static inline bool mark_visited_test_and_set(object_t *obj)
 {
+    /* atomic, because several threads can be marking in parallel */
     uintptr_t lock_idx = mark_loc(obj);
-    if (write_locks[lock_idx] == WL_VISITED) {
+    if (visit_markers[lock_idx] == WL_VISITED) {
         return true;
     }
     else {
-        write_locks[lock_idx] = WL_VISITED;
-        return false;
+        return __sync_lock_test_and_set(&visit_markers[lock_idx],
+                                        WL_VISITED) == WL_VISITED;
     }
 }
 
 static inline bool mark_visited_test_and_clear(object_t *obj)
 {
     uintptr_t lock_idx = mark_loc(obj);
-    if (write_locks[lock_idx] == WL_VISITED) {
-        write_locks[lock_idx] = 0;
+    if (visit_markers[lock_idx] == WL_VISITED) {
+        visit_markers[lock_idx] = 0;
         return true;
     }
     else {
@@ -247,7 +330,7 @@ static uintptr_t object_last_page(object_t *obj)
 
 static void major_hide_private_bits_for_modified_objects(long segment_num)
 {
-    uint64_t negativebitmask = ~(1 << (segment_num - 1));
+    uint64_t negativebitmask = ~(1UL << (segment_num - 1));
 #ifndef NDEBUG
     BITOP(assert((ps->by_segment & negativebitmask) != ps->by_segment));
 #endif
@@ -256,7 +339,7 @@ static void major_hide_private_bits_for_modified_objects(long segment_num)
 
 static void major_restore_private_bits_for_modified_objects(long segment_num)
 {
-    uint64_t positivebitmask = 1 << (segment_num - 1);
+    uint64_t positivebitmask = 1UL << (segment_num - 1);
     BITOP(ps->by_segment |= positivebitmask);
 }
 
@@ -269,7 +352,7 @@ static void major_reshare_pages(void)
 
     long i;
 
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         /* The 'modified_old_objects' list gives the list of objects
            whose pages need to remain private.  We temporarily remove
            these bits from 'pages_privatized', so that these pages will
@@ -300,10 +383,10 @@ static void major_reshare_pages(void)
         if (UNLIKELY(pagenum == endpagenum)) {
             /* we reach this point usually twice, because there are
                more pages after 'uninitialized_page_stop' */
-            if (endpagenum == NB_PAGES)
+            if (endpagenum == nb_pages)
                 break;   /* done */
             pagenum = (uninitialized_page_stop - stm_object_pages) / 4096UL;
-            endpagenum = NB_PAGES;
+            endpagenum = nb_pages;
             continue;
         }
 
@@ -314,7 +397,7 @@ static void major_reshare_pages(void)
     /* Done.  Now 'pages_privatized' should be entirely zeroes.  Restore
        the previously-hidden bits
     */
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         major_restore_private_bits_for_modified_objects(i);
     }
 }
@@ -323,6 +406,13 @@ static void major_reshare_pages(void)
 /************************************************************/
 
 
+static inline void mark_push(object_t *obj, char *segment_base)
+{
+    mark_objects_to_trace = list_append2(mark_objects_to_trace,
+                                         (uintptr_t)obj,
+                                         (uintptr_t)segment_base);
+}
+
 static inline void mark_record_trace(object_t **pobj)
 {
     /* takes a normal pointer to a thread-local pointer to an object */
@@ -333,41 +423,215 @@ static inline void mark_record_trace(object_t **pobj)
        anyway.  The idea is that such an object is old (not from the
        current transaction), otherwise it would not be possible to see
        it in two segments; and moreover it is not modified, otherwise
-       mark_trace() would have been called on two different segments
-       already.  That means that this object is identical in all
-       segments and only needs visiting once.  (It may actually be in a
-       shared page, or maybe not.)
+       mark_trace_pairs() would have been called on two different
+       segments already.  That means that this object is identical in
+       all segments and only needs visiting once.  (It may actually be
+       in a shared page, or maybe not.)
     */
     if (obj == NULL || mark_visited_test_and_set(obj))
         return;    /* already visited this object */
 
-    LIST_APPEND(mark_objects_to_trace, obj);
+    mark_push(obj, mark_segment_base);
 }
 
 #define TRACE_FOR_MAJOR_COLLECTION  (&mark_record_trace)
 
-static void mark_trace(object_t *obj, char *segment_base)
+static inline void mark_visit_object(object_t *obj, char *segment_base)
 {
-    assert(list_is_empty(mark_objects_to_trace));
+    /* only records the object; the tracing itself is done later by
+       mark_trace_everything() */
+    if (obj == NULL || mark_visited_test_and_set(obj))
+        return;
+    mark_push(obj, segment_base);
+}
 
-    while (1) {
-        /* trace into the object (the version from 'segment_base') */
-        struct object_s *realobj =
-            (struct object_s *)REAL_ADDRESS(segment_base, obj);
-        stmcb_trace(realobj, TRACE_FOR_MAJOR_COLLECTION);
 
-        if (list_is_empty(mark_objects_to_trace))
-            break;
+/* Parallel marking: the thread doing the major collection is helped by
+   the threads that are stopped at a safe point in the other segments,
+   up to 'max_marking_threads' in total (by default, the number of
+   CPUs).  They wait in wait_for_request_removed() without the mutex,
+   which the thread doing the collection keeps; they are only woken up
+   when it releases the mutex (release_waiting_threads()).  Each thread
+   traces from its own 'mark_objects_to_trace'; when some threads are
+   idle, the others move some of their pairs to 'mark_shared.pending'.  The
+   marking is done when all threads are idle and there is nothing
+   pending.  The helpers run with their own segment in %gs, but only
+   read the objects through the 'segment_base' of the pairs. */
+
+#define MARK_SHARE_PAIRS    64
+
+static void mark_move_pairs(struct list_s **from, struct list_s **to,
+                            uintptr_t max_items)
+{
+    /* move the last 'max_items' items, keeping the pairs in order */
+    uintptr_t count = list_count(*from);
+    uintptr_t i, start = count > max_items ? count - max_items : 0;
+    for (i = start; i < count; i++)
+        LIST_APPEND(*to, list_item(*from, i));
+    (*from)->count = start;
+}
+
+static inline void mark_trace_one_pair(void)
+{
+    /* trace into the object (the version from 'segment_base') */
+    mark_segment_base = (char *)list_pop_item(mark_objects_to_trace);
+    object_t *obj = (object_t *)list_pop_item(mark_objects_to_trace);
+    struct object_s *realobj =
+        (struct object_s *)REAL_ADDRESS(mark_segment_base, obj);
+    stmcb_trace(realobj, TRACE_FOR_MAJOR_COLLECTION);
+}
 
-        obj = (object_t *)list_pop_item(mark_objects_to_trace);
+static void mark_trace_pairs(void)
+{
+    /* called in all the threads that do marking */
+    bool idle = false;
+
+    while (1) {
+        while (!list_is_empty(mark_objects_to_trace)) {
+            mark_trace_one_pair();
+
+            if (mark_shared.idle_workers > 0 &&
+                    list_count(mark_objects_to_trace) >= 4 * MARK_SHARE_PAIRS) {
+                spinlock_acquire(mark_shared.lock);
+                mark_move_pairs(&mark_objects_to_trace, &mark_shared.pending,
+                                2 * MARK_SHARE_PAIRS);
+                mark_shared.num_pending = list_count(mark_shared.pending);
+                spinlock_release(mark_shared.lock);
+            }
+        }
+
+        /* nothing left here: take some pending pairs, or wait */
+        spinlock_acquire(mark_shared.lock);
+        while (mark_shared.num_pending == 0) {
+            if (!idle) {
+                idle = true;
+                mark_shared.idle_workers++;
+                if (mark_shared.idle_workers == mark_shared.num_workers)
+                    mark_shared.done = true;
+            }
+            if (mark_shared.done) {
+                spinlock_release(mark_shared.lock);
+                return;
+            }
+            spinlock_release(mark_shared.lock);
+            long spins = 0;
+            while (mark_shared.num_pending == 0 && !mark_shared.done) {
+                if (++spins < 1000)
+                    spin_loop();
+                else
+                    sched_yield();
+            }
+            spinlock_acquire(mark_shared.lock);
+        }
+        if (idle) {
+            idle = false;
+            mark_shared.idle_workers--;
+        }
+        mark_move_pairs(&mark_shared.pending, &mark_objects_to_trace,
+                        2 * MARK_SHARE_PAIRS);
+        mark_shared.num_pending = list_count(mark_shared.pending);
+        spinlock_release(mark_shared.lock);
     }
 }
 
-static inline void mark_visit_object(object_t *obj, char *segment_base)
+static bool mark_help_at_safe_point(void)
 {
-    if (obj == NULL || mark_visited_test_and_set(obj))
+    /* called with 'sync_ctl.safe_point_mutex' by a thread waiting at a
+       safe point.  Returns false if there is no marking to help with. */
+    if (mark_shared.helper_slots == 0)
+        return false;
+    mark_shared.helper_slots--;
+    mark_shared.active_helpers++;
+    sp_mutex_unlock();
+
+    dprintf(("marking: helping from segment %d\n",
+             STM_SEGMENT->segment_num));
+    assert(mark_objects_to_trace == NULL);
+    LIST_CREATE(mark_objects_to_trace);
+    mark_trace_pairs();
+    assert(list_is_empty(mark_objects_to_trace));
+    LIST_FREE(mark_objects_to_trace);
+
+    sp_mutex_lock();
+    if (--mark_shared.active_helpers == 0)
+        sp_cond_broadcast();
+    return true;
+}
+
+static void mark_compact_hashtable(stm_hashtable_t *hashtable)
+{
+    /* compacting frees and rehashes tables, which must not be done
+       while other threads may be tracing: do it after the marking */
+    if (!mark_shared.parallel) {
+        _stm_compact_hashtable(hashtable);
         return;
-    mark_trace(obj, segment_base);
+    }
+    spinlock_acquire(mark_shared.lock);
+    LIST_APPEND(mark_shared.hashtables, hashtable);
+    spinlock_release(mark_shared.lock);
+}
+
+static void mark_trace_everything(void)
+{
+    /* trace from all the pairs recorded so far in the current thread */
+    assert(_has_mutex());
+    long max_threads = max_marking_threads;
+    if (max_threads == 0) {
+        static long num_cpus = 0;
+        if (num_cpus == 0) {
+            num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            if (num_cpus < 1)
+                num_cpus = 1;
+        }
+        max_threads = num_cpus;
+    }
+
+    /* The threads in wait_for_request_removed() can help.  They cannot
+       leave it as long as we have the mutex, so they will all come:
+       the marking is not done before they are all idle. */
+    sp_mutex_lock();
+    long num_helpers = mark_shared.waiting_threads;
+    if (num_helpers > max_threads - 1)
+        num_helpers = max_threads - 1;
+
+    mark_shared.idle_workers = 0;
+    mark_shared.num_workers = 1 + num_helpers;
+    mark_shared.done = false;
+    if (mark_shared.pending == NULL)
+        LIST_CREATE(mark_shared.pending);
+
+    if (num_helpers > 0) {
+        dprintf((" | marking with %ld helpers\n", num_helpers));
+        if (mark_shared.hashtables == NULL)
+            LIST_CREATE(mark_shared.hashtables);
+        mark_shared.parallel = true;
+        mark_shared.helper_slots = num_helpers;
+        sp_cond_broadcast();
+    }
+    sp_mutex_unlock();
+
+    mark_trace_pairs();
+
+    if (num_helpers > 0) {
+        sp_mutex_lock();
+        assert(mark_shared.helper_slots == 0);
+        while (mark_shared.active_helpers > 0)
+            sp_cond_wait();
+        sp_mutex_unlock();
+
+        mark_shared.parallel = false;
+        LIST_FOREACH_R(mark_shared.hashtables, stm_hashtable_t *,
+                       _stm_compact_hashtable(item));
+        list_clear(mark_shared.hashtables);
+    }
+
+    assert(list_is_empty(mark_objects_to_trace));
+    assert(list_is_empty(mark_shared.pending));
+}
+
+void stm_set_major_gc_marking_threads(long num_threads)
+{
+    max_marking_threads = num_threads > 0 ? num_threads : 0;
 }
 
 static void *mark_visit_objects_from_ss(void *_, const void *slice, size_t size)
@@ -409,7 +673,7 @@ static void mark_visit_from_roots(void)
     } while (tl != stm_all_thread_locals);
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         if (get_priv_segment(i)->transaction_state != TS_NONE) {
             mark_visit_object(
                 get_priv_segment(i)->threadlocal_at_start_of_transaction,
@@ -429,7 +693,7 @@ static void mark_visit_from_modified_objects(void)
        eager write locking.)
     */
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         char *base = get_segment_base(i);
 
         LIST_FOREACH_R(
@@ -437,16 +701,33 @@ static void mark_visit_from_modified_objects(void)
             object_t * /*item*/,
             ({
                 mark_visited_test_and_set(item);
-                mark_trace(item, stm_object_pages);  /* shared version */
-                mark_trace(item, base);              /* private version */
+                mark_push(item, stm_object_pages);  /* shared version */
+                mark_push(item, base);              /* private version */
             }));
     }
 }
 
+static void mark_visit_from_nested_undo(void)
+{
+    /* the copies saved for nested transactions may be copied back
+       into their objects later */
+    long i;
+    for (i = 1; i <= nb_segments; i++) {
+        struct list_s *lst = get_priv_segment(i)->nested_undo;
+        uintptr_t j, count = list_count(lst);
+
+        mark_segment_base = get_segment_base(i);
+        for (j = 0; j < count; j += 2) {
+            struct object_s *copy = (struct object_s *)list_item(lst, j + 1);
+            stmcb_trace(copy, TRACE_FOR_MAJOR_COLLECTION);
+        }
+    }
+}
+
 static void mark_visit_from_markers(void)
 {
     long j;
-    for (j = 1; j <= NB_SEGMENTS; j++) {
+    for (j = 1; j <= nb_segments; j++) {
         char *base = get_segment_base(j);
         struct list_s *lst = get_priv_segment(j)->modified_old_objects_markers;
         uintptr_t i;
@@ -460,6 +741,161 @@ static void mark_visit_from_markers(void)
     }
 }
 
+/* Incremental marking.  If a pause budget is set, a major collection
+   starts by marking in slices, each done at a safe point with all
+   threads stopped, and in-between the transactions continue to run.
+   They may store into an already-traced object a reference to an
+   object not traced so far: this is handled by incremental update.
+   While 'major_marking_in_progress', the write barrier records in
+   'marking_dirty_objects' the objects that it lets be changed, and
+   the next slice traces them again.  (A snapshot-at-the-beginning
+   barrier would not be enough: weakrefs are read without barrier.)
+   The last slice traces again the roots and the dirty objects, and
+   completes the major collection like a non-incremental one.
+*/
+static uint64_t marking_start_allocated;
+
+static inline bool marking_dirty_object_may_change(
+    struct stm_priv_segment_info_s *pseg, object_t *obj)
+{
+    /* Can 'obj' be changed again without passing through the write
+       barrier?  This is the case if it lost GCFLAG_WRITE_BARRIER, or
+       if it uses card marking.  It is also the case if 'pseg' has got
+       the write lock on 'obj', or maybe on some of its cards: then an
+       abort would restore its previous content, which was maybe never
+       traced. */
+    struct object_s *realobj = (struct object_s *)
+        REAL_ADDRESS(pseg->pub.segment_base, obj);
+    if (!(realobj->stm_flags & GCFLAG_WRITE_BARRIER) ||
+            (realobj->stm_flags & GCFLAG_CARDS_SET))
+        return true;
+    uint8_t lock = write_locks[get_write_lock_idx((uintptr_t)obj)];
+    return lock == pseg->write_lock_num || lock == CARDS_LOCKED;
+}
+
+static void mark_visit_from_marking_dirty_objects(bool keep)
+{
+    long i;
+    for (i = 1; i <= nb_segments; i++) {
+        struct stm_priv_segment_info_s *pseg = get_priv_segment(i);
+        struct list_s *lst = pseg->marking_dirty_objects;
+        uintptr_t j, count = list_count(lst), kept = 0;
+
+        for (j = 0; j < count; j++) {
+            object_t *obj = (object_t *)list_item(lst, j);
+
+            /* trace it again, even if it was already visited */
+            mark_visited_test_and_set(obj);
+            mark_push(obj, pseg->pub.segment_base);
+
+            if (keep && marking_dirty_object_may_change(pseg, obj))
+                list_set_item(lst, kept++, (uintptr_t)obj);
+        }
+        lst->count = kept;
+    }
+}
+
+static void marking_forget_overflow_objects(
+    struct stm_priv_segment_info_s *pseg)
+{
+    /* Called when the transaction in 'pseg' aborts.  Its overflow
+       objects are dead, and may contain pointers to its nursery or to
+       freed young objects; they must not be traced any more. */
+    char *base = pseg->pub.segment_base;
+    struct list_s *lst = pseg->marking_dirty_objects;
+    uintptr_t j, count = list_count(lst), kept = 0;
+
+    for (j = 0; j < count; j++) {
+        object_t *obj = (object_t *)list_item(lst, j);
+        if (!IS_OVERFLOW_OBJ(pseg, (struct object_s *)REAL_ADDRESS(base, obj)))
+            list_set_item(lst, kept++, (uintptr_t)obj);
+    }
+    lst->count = kept;
+
+    lst = marking_pending_pairs;
+    if (lst == NULL)
+        return;
+    count = list_count(lst);
+    kept = 0;
+    for (j = 0; j < count; j += 2) {
+        object_t *obj = (object_t *)list_item(lst, j);
+        char *segment_base = (char *)list_item(lst, j + 1);
+        if (segment_base == base &&
+                IS_OVERFLOW_OBJ(pseg, (struct object_s *)REAL_ADDRESS(base, obj)))
+            continue;
+        list_set_item(lst, kept++, (uintptr_t)obj);
+        list_set_item(lst, kept++, (uintptr_t)segment_base);
+    }
+    lst->count = kept;
+}
+
+static long marking_elapsed_usec(struct timespec *start)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - start->tv_sec) * 1000000L +
+           (t.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static bool major_marking_slice(struct timespec *start)
+{
+    /* Do one slice of incremental marking.  Returns true if it should
+       continue in a later slice, or false if the major collection
+       should be completed now. */
+    long i;
+
+    if (!major_marking_in_progress) {
+        major_marking_in_progress = true;
+        marking_start_allocated = pages_ctl.total_allocated;
+
+        LIST_CREATE(mark_objects_to_trace);
+        mark_visit_from_modified_objects();
+        mark_visit_from_nested_undo();
+        mark_visit_from_markers();
+        mark_visit_from_roots();
+        mark_visit_from_finalizer_pending();
+
+        /* the objects write-locked so far must be traced again after
+           they are committed or aborted */
+        for (i = 1; i <= nb_segments; i++) {
+            struct stm_priv_segment_info_s *pseg = get_priv_segment(i);
+            assert(list_is_empty(pseg->marking_dirty_objects));
+            LIST_FOREACH_R(pseg->modified_old_objects, object_t * /*item*/,
+                           LIST_APPEND(pseg->marking_dirty_objects, item));
+        }
+    }
+    else {
+        mark_objects_to_trace = marking_pending_pairs;
+        marking_pending_pairs = NULL;
+        mark_visit_from_marking_dirty_objects(/*keep=*/true);
+    }
+
+    long n = 0;
+    while (!list_is_empty(mark_objects_to_trace)) {
+        if ((++n & 255) == 0 &&
+                marking_elapsed_usec(start) >= major_gc_pause_budget) {
+            /* out of time; but if the program allocates faster than
+               we mark, give up and complete the collection now */
+            if (pages_ctl.total_allocated >
+                    marking_start_allocated * GC_MAJOR_COLLECT)
+                return false;
+
+            marking_pending_pairs = mark_objects_to_trace;
+            mark_objects_to_trace = NULL;
+            postpone_major_collection_request(GC_MAJOR_SLICE_STEP);
+            return true;
+        }
+        mark_trace_one_pair();
+    }
+    return false;
+}
+
+void stm_set_major_gc_pause_budget(long microseconds)
+{
+    major_gc_pause_budget = microseconds > 0 ? microseconds : 0;
+}
+
+
 static void clean_up_segment_lists(void)
 {
 #pragma push_macro("STM_PSEGMENT")
@@ -468,7 +904,7 @@ static void clean_up_segment_lists(void)
 #undef STM_SEGMENT
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         struct stm_priv_segment_info_s *pseg = get_priv_segment(i);
         struct list_s *lst;
 
@@ -525,6 +961,19 @@ static void clean_up_segment_lists(void)
             }));
         list_clear(lst);
 
+        /* same with the card-locked objects, which are not in
+           'old_objects_with_cards' */
+        if (!tree_is_cleared(pseg->card_locked_objects)) {
+            wlog_t *item;
+            TREE_LOOP_FORWARD(*pseg->card_locked_objects, item) {
+                if (item->val) {
+                    item->val = 0;
+                    if (cards_are_locked(get_write_lock_idx(item->addr)))
+                        _unmark_locked_cards(pseg, (object_t *)item->addr);
+                }
+            } TREE_LOOP_END;
+        }
+
         /* Remove from 'large_overflow_objects' all objects that die */
         lst = pseg->large_overflow_objects;
         if (lst != NULL) {
@@ -550,68 +999,145 @@ static inline bool largemalloc_keep_object_at(char *data)
            conflicts with objects read and freed long in the past.
            It is probably rare enough, but still, we want to avoid any
            false conflict. (test_random hits it sometimes) */
+        uintptr_t last_card_index =
+            get_freed_last_card_index(stm_object_pages, obj);
         long i;
-        for (i = 1; i <= NB_SEGMENTS; i++) {
-            ((struct stm_read_marker_s *)
-             (get_segment_base(i) + (((uintptr_t)obj) >> 4)))->rm = 0;
+        for (i = 1; i <= nb_segments; i++) {
+            reset_read_marker(get_segment_base(i), obj);
+            reset_card_read_markers(get_segment_base(i), obj,
+                                    last_card_index);
         }
         return false;
     }
     return true;
 }
 
-static void sweep_large_objects(void)
+static void sweep_large_objects(bool lazy)
 {
-    _stm_largemalloc_sweep();
+    /* give back the reserves first: they are not objects */
+    long i;
+    for (i = 1; i <= nb_segments; i++) {
+        _stm_large_release_reserve(&get_priv_segment(i)->large_reserve);
+    }
+    /* if 'lazy', only start the sweep: the following allocations will
+       continue it outside this pause */
+    if (lazy)
+        _stm_largemalloc_sweep_start();
+    else
+        _stm_largemalloc_sweep();
+}
+
+static uint64_t sweep_uniform_page(uintptr_t pagenum, uint64_t index)
+{
+    /* Rebuild the chained list of ranges of free objects in one page,
+       and return the number of bytes still in use */
+    uint64_t size = index * 8;
+    char *page = stm_object_pages + pagenum * 4096UL;
+    char *end = page + (4096 / size) * size;
+    char *p, *first = NULL, *list_first = NULL, *list_last = NULL;
+    char **link = NULL;
+    uint64_t free_bytes = 0;
+    long i;
+
+    for (p = page; p <= end; p += size) {
+        if (p < end) {
+            object_t *obj = (object_t *)(p - stm_object_pages);
+            if (!mark_visited_test_and_clear(obj)) {
+                /* a free or dead object: clear its read markers, for
+                   the same reason as in largemalloc_keep_object_at() */
+                for (i = 1; i <= nb_segments; i++) {
+                    reset_read_marker(get_segment_base(i), obj);
+                }
+                if (first == NULL)
+                    first = p;
+                free_bytes += size;
+                continue;
+            }
+        }
+        if (first != NULL) {
+            /* the range 'first' to 'p - size' is free */
+            if (link == NULL) {
+                list_first = first;
+                list_last = p - size;
+            }
+            else {
+                link[0] = first;
+                link[1] = p - size;
+            }
+            link = (char **)(p - size);
+            first = NULL;
+        }
+    }
+
+    if (free_bytes == (uint64_t)(end - page)) {
+        /* completely free */
+        small_page_sizes[pagenum - PAGE_FLAG_START] = 0;
+        *(char **)page = free_uniform_pages;
+        free_uniform_pages = page;
+        return 0;
+    }
+    if (link != NULL) {
+        link[0] = NULL;
+        link[1] = NULL;
+        LIST_APPEND(small_page_lists[index], list_first);
+        LIST_APPEND(small_page_lists[index], list_last);
+        LIST_APPEND(small_page_lists[index], free_bytes);
+    }
+    return (uint64_t)(end - page) - free_bytes;
+}
+
+static void sweep_uniform_pages(void)
+{
+    /* The segments' current free lists are thrown away: the free
+       objects they contain are found again here */
+    memset(small_alloc, 0, sizeof(small_alloc));
+    long i;
+    for (i = 2; i < GC_N_SMALL_REQUESTS; i++)
+        list_clear(small_page_lists[i]);
+
+    uint64_t used_bytes = 0;
+    uintptr_t pagenum = (uninitialized_page_stop - stm_object_pages) / 4096UL;
+    for (; pagenum < nb_pages; pagenum++) {
+        uint8_t index = small_page_sizes[pagenum - PAGE_FLAG_START];
+        if (index != 0)   /* else, it is already in 'free_uniform_pages' */
+            used_bytes += sweep_uniform_page(pagenum, index);
+    }
+
+    increment_total_allocated(used_bytes - small_bytes_accounted);
+    small_bytes_accounted = used_bytes;
 }
 
-static void assert_cleared_locks(size_t n)
+static void assert_cleared_visit_markers(size_t n)
 {
 #ifndef NDEBUG
     size_t i;
-    uint8_t *s = write_locks;
+    uint8_t *s = visit_markers;
 # ifndef STM_TESTS
     if (n > 5000) n = 5000;
 # endif
     for (i = 0; i < n; i++)
-        assert(s[i] == CARD_CLEAR || s[i] == CARD_MARKED
-               || s[i] == CARD_MARKED_OLD);
+        assert(s[i] == 0);
 #endif
 }
 
-static void clean_write_locks(void)
+static void clean_visit_markers(void)
 {
-    /* the write_locks array, containing the visit marker during
-       major collection, is cleared in sweep_large_objects() for
-       large objects, but is not cleared for small objects.
-       Clear it now. */
+    /* the visit markers are cleared by the sweeping for the objects
+       that survive, but not for all the memory after the uniform
+       pages start.  Clear it now. */
     object_t *loc2 = (object_t *)(uninitialized_page_stop - stm_object_pages);
     uintptr_t lock2_idx = mark_loc(loc2 - 1) + 1;
 
-    assert_cleared_locks(lock2_idx);
-    memset(write_locks + lock2_idx, 0, sizeof(write_locks) - lock2_idx);
-}
-
-static void major_restore_write_locks(void)
-{
-    /* restore the write locks on the modified objects */
-    long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
-        struct stm_priv_segment_info_s *pseg = get_priv_segment(i);
-
-        LIST_FOREACH_R(
-            pseg->modified_old_objects,
-            object_t * /*item*/,
-            ({
-                uintptr_t lock_idx = mark_loc(item);
-                assert(write_locks[lock_idx] == 0);
-                write_locks[lock_idx] = pseg->write_lock_num;
-            }));
-    }
+    if (!_stm_largemalloc_sweep_pending())
+        assert_cleared_visit_markers(lock2_idx);
+    memset(visit_markers + lock2_idx, 0, NB_WRITE_LOCKS - lock2_idx);
 }
 
 static void major_collection_now_at_safe_point(void)
 {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     dprintf(("\n"));
     dprintf((" .----- major collection -----------------------\n"));
     assert(_has_mutex());
@@ -619,6 +1145,20 @@ static void major_collection_now_at_safe_point(void)
     /* first, force a minor collection in each of the other segments */
     major_do_minor_collections();
 
+    /* the lazy sweeping of the previous major collection must be
+       finished before we change the visit markers again */
+    if (!major_marking_in_progress)
+        _stm_largemalloc_sweep_finish();
+
+    if (major_gc_pause_budget > 0 && !is_major_collection_forced()) {
+        if (major_marking_slice(&start)) {
+            dprintf((" | marking slice: %ld objects left to trace\n",
+                     (long)(list_count(marking_pending_pairs) / 2)));
+            dprintf((" `----------------------------------------------\n"));
+            return;
+        }
+    }
+
     dprintf((" | used before collection: %ld\n",
              (long)pages_ctl.total_allocated));
 
@@ -627,11 +1167,24 @@ static void major_collection_now_at_safe_point(void)
         major_reshare_pages();
 
     /* marking */
-    LIST_CREATE(mark_objects_to_trace);
+    if (major_marking_in_progress) {
+        /* finish the incremental marking with all threads stopped */
+        if (mark_objects_to_trace == NULL) {
+            mark_objects_to_trace = marking_pending_pairs;
+            marking_pending_pairs = NULL;
+        }
+        major_marking_in_progress = false;
+        mark_visit_from_marking_dirty_objects(/*keep=*/false);
+    }
+    else {
+        LIST_CREATE(mark_objects_to_trace);
+    }
     mark_visit_from_modified_objects();
+    mark_visit_from_nested_undo();
     mark_visit_from_markers();
     mark_visit_from_roots();
     mark_visit_from_finalizer_pending();
+    mark_trace_everything();
     LIST_FREE(mark_objects_to_trace);
 
     /* finalizer support: will mark as WL_VISITED all objects with a
@@ -647,11 +1200,10 @@ static void major_collection_now_at_safe_point(void)
     clean_up_segment_lists();
 
     /* sweeping */
-    sweep_large_objects();
-    //sweep_uniform_pages();
+    sweep_large_objects(/*lazy=*/!is_major_collection_forced());
+    sweep_uniform_pages();
 
-    clean_write_locks();
-    major_restore_write_locks();
+    clean_visit_markers();
 
     dprintf((" | used after collection:  %ld\n",
              (long)pages_ctl.total_allocated));
@@ -14,6 +14,10 @@
 #define GC_MIN                 (NB_NURSERY_PAGES * 4096 * 8)
 #define GC_MAJOR_COLLECT       1.82
 
+/* With incremental marking (see stm_set_major_gc_pause_budget()), the
+   next marking slice occurs after this many more bytes are allocated */
+#define GC_MAJOR_SLICE_STEP    (NB_NURSERY_PAGES * 4096)
+
 /* re-share pages after major collections (1 or 0) */
 #define RESHARE_PAGES 1
 
@@ -30,39 +34,92 @@ struct small_alloc_s {
                             contiguous range of unallocated objs */
 };
 
-static struct small_alloc_s small_alloc[GC_N_SMALL_REQUESTS];
+/* One set of free lists per segment, because minor collections run
+   in parallel in the segments.  Refilled by _allocate_small_slowpath(). */
+static struct small_alloc_s small_alloc[NB_SEGMENTS_MAX][GC_N_SMALL_REQUESTS]
+    __attribute__((aligned(64)));
+
+/* The global state below is protected by 'lock_small_pages'.  For each
+   size, 'small_page_lists' contains the partially-free pages left by
+   the last major collection, as triples (next_object, range_last, free
+   bytes); 'free_uniform_pages' is a chained list of completely free
+   pages; and 'small_page_sizes' gives the size index of every uniform
+   page in use (indexed like 'pages_privatized'). */
+static int lock_small_pages = 0;
+static struct list_s *small_page_lists[GC_N_SMALL_REQUESTS];
 static char *free_uniform_pages;
+static uint8_t *small_page_sizes;
+static uint64_t small_bytes_accounted;
+
+/* Work shared between the threads doing the marking in parallel */
+static struct {
+    int lock;                      /* protects the fields up to 'done' */
+    struct list_s *pending;
+    volatile uintptr_t num_pending;
+    volatile long idle_workers;
+    long num_workers;
+    volatile bool done;
+    struct list_s *hashtables;     /* to compact after parallel marking */
+    bool parallel;
+    /* protected by 'sync_ctl.safe_point_mutex': */
+    long waiting_threads;          /* in wait_for_request_removed() */
+    long helper_slots;
+    long active_helpers;
+} mark_shared;
+static long max_marking_threads;          /* or 0 */
+
+/* Incremental marking: 'major_marking_in_progress' is true between
+   the marking slices of a major collection.  In that state, the write
+   barrier records the objects it sees in 'marking_dirty_objects'. */
+static long major_gc_pause_budget;        /* in microseconds, or 0 */
+static bool major_marking_in_progress;
+static struct list_s *marking_pending_pairs;  /* between two slices */
+
+/* The visit markers of major collections, one byte per 16 bytes of
+   memory like the 'write_locks'.  They are separate from the
+   'write_locks' because incremental marking runs while transactions
+   hold write locks. */
+static uint8_t *visit_markers;
 
 static void setup_gcpage(void);
 static void teardown_gcpage(void);
 static char *allocate_outside_nursery_large(uint64_t size);
+static bool mark_help_at_safe_point(void);
+static void _stm_compact_hashtable(stm_hashtable_t *hashtable);
 
 static void major_collection_if_requested(void);
 static void major_collection_now_at_safe_point(void);
+static void marking_forget_overflow_objects(
+    struct stm_priv_segment_info_s *pseg);
 static bool largemalloc_keep_object_at(char *data);   /* for largemalloc.c */
 
 
 static char *_allocate_small_slowpath(uint64_t size);
+static void sweep_uniform_pages(void);
 
 static inline char *allocate_outside_nursery_small(uint64_t size)
 {
+    /* Returns NULL if no uniform page can be set up; the caller should
+       then use allocate_outside_nursery_large() */
     uint64_t index = size / 8;
     OPT_ASSERT(2 <= index);
     OPT_ASSERT(index < GC_N_SMALL_REQUESTS);
+    OPT_ASSERT((size & 7) == 0);
 
-    char *result = small_alloc[index].next_object;
+    struct small_alloc_s *sa = &small_alloc[STM_SEGMENT->segment_num - 1][index];
+    char *result = sa->next_object;
     if (result == NULL)
         return _allocate_small_slowpath(size);
 
     char *following;
-    if (small_alloc[index].range_last == result) {
+    if (sa->range_last == result) {
         following = ((char **)result)[0];
-        small_alloc[index].range_last = ((char **)result)[1];
+        sa->range_last = ((char **)result)[1];
     }
     else {
         following = result + size;
     }
-    small_alloc[index].next_object = following;
+    sa->next_object = following;
 
     return result;
 }
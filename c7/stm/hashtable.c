@@ -102,7 +102,7 @@ void stm_hashtable_free(stm_hashtable_t *hashtable)
 static bool _stm_was_read_by_anybody(object_t *obj)
 {
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         char *remote_base = get_segment_base(i);
         uint8_t remote_version = get_segment(i)->transaction_read_version;
         if (was_read_remote(remote_base, obj, remote_version))
@@ -288,7 +288,7 @@ stm_hashtable_entry_t *stm_hashtable_lookup(object_t *hashtableobj,
             entry = (stm_hashtable_entry_t *)(p - stm_object_pages);
 
             long j;
-            for (j = 0; j <= NB_SEGMENTS; j++) {
+            for (j = 0; j <= nb_segments; j++) {
                 struct stm_hashtable_entry_s *e;
                 e = (struct stm_hashtable_entry_s *)
                         REAL_ADDRESS(get_segment_base(j), entry);
@@ -298,6 +298,9 @@ stm_hashtable_entry_t *stm_hashtable_lookup(object_t *hashtableobj,
                 e->object = NULL;
             }
             hashtable->additions += 0x100;
+            STM_PSEGMENT->allocated_hashtable_entries = true;
+            if (UNLIKELY(major_marking_in_progress))   /* see gcpage.c */
+                LIST_APPEND(STM_PSEGMENT->marking_dirty_objects, entry);
             release_privatization_lock();
         }
         write_fence();     /* make sure 'entry' is fully initialized here */
@@ -382,7 +385,7 @@ static void _stm_compact_hashtable(stm_hashtable_t *hashtable)
 void stm_hashtable_tracefn(stm_hashtable_t *hashtable, void trace(object_t **))
 {
     if (trace == TRACE_FOR_MAJOR_COLLECTION)
-        _stm_compact_hashtable(hashtable);
+        mark_compact_hashtable(hashtable);
 
     stm_hashtable_table_t *table;
     table = VOLATILE_HASHTABLE(hashtable)->table;
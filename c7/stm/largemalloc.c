@@ -110,6 +110,7 @@ static mchunk_t *next_chunk(mchunk_t *p)
 static struct {
     int lock;
     mchunk_t *first_chunk, *last_chunk;
+    mchunk_t *sweep_next;     /* see _stm_largemalloc_sweep_start() */
     dlist_t largebins[N_BINS];
 } lm __attribute__((aligned(64)));
 
@@ -267,18 +268,20 @@ static void unlink_chunk(mchunk_t *mscan)
     }
 }
 
-char *_stm_large_malloc(size_t request_size)
-{
-    /* 'request_size' should already be a multiple of the word size here */
-    assert((request_size & (sizeof(char *)-1)) == 0);
+static void _large_free(mchunk_t *chunk);
+static void _large_sweep_until(char *stop);
 
-    /* it can be very small, but we need to ensure a minimal size
-       (currently 32 bytes) */
-    if (request_size < MIN_ALLOC_SIZE)
-        request_size = MIN_ALLOC_SIZE;
-
-    lm_lock();
+static mchunk_t *_large_malloc(size_t request_size)
+{
+    /* must be called with the lock; the caller updates the total
+       allocated size */
+    if (lm.sweep_next != NULL) {
+        /* lazy sweeping: do a part proportional to the request */
+        _large_sweep_until(((char *)lm.sweep_next) +
+                           request_size * LARGE_SWEEP_RATE);
+    }
 
+ retry:;
     size_t index = largebin_index(request_size);
     sort_bin(index);
 
@@ -312,14 +315,30 @@ char *_stm_large_malloc(size_t request_size)
         }
     }
 
-    /* not enough memory. */
-    lm_unlock();
+    /* not enough memory, unless we finish the lazy sweeping */
+    if (lm.sweep_next != NULL) {
+        _large_sweep_until(NULL);
+        goto retry;
+    }
     return NULL;
 
  found:
     assert(mscan->size >= request_size);
     assert(mscan->u.up != UU_UNSORTED);
 
+    if (lm.sweep_next != NULL) {
+        /* never return a chunk from the part that is not swept yet,
+           otherwise the sweep would see it later and free it.  Sweep
+           past it instead, and search again. */
+        mchunk_t *taken = mscan;
+        if (mscan->u.up != NULL)
+            taken = updown2chunk(mscan->u.up);
+        if (taken >= lm.sweep_next) {
+            _large_sweep_until((char *)next_chunk(taken));
+            goto retry;
+        }
+    }
+
     if (mscan->u.up != NULL) {
         /* fast path: grab the item that is just above, to avoid needing
            to rearrange the 'd' list */
@@ -352,24 +371,97 @@ char *_stm_large_malloc(size_t request_size)
     }
     mscan->size = request_size;
     mscan->prev_size = BOTH_CHUNKS_USED;
-    increment_total_allocated(request_size + LARGE_MALLOC_OVERHEAD);
+    return mscan;
+}
+
+static size_t _large_request_size(size_t request_size)
+{
+    /* 'request_size' should already be a multiple of the word size here */
+    assert((request_size & (sizeof(char *)-1)) == 0);
+
+    /* it can be very small, but we need to ensure a minimal size
+       (currently 32 bytes) */
+    if (request_size < MIN_ALLOC_SIZE)
+        request_size = MIN_ALLOC_SIZE;
+    return request_size;
+}
+
+static char *_large_allocated(mchunk_t *chunk)
+{
+    increment_total_allocated(chunk->size + LARGE_MALLOC_OVERHEAD);
 #ifndef NDEBUG
-    memset((char *)&mscan->d, 0xda, request_size);
+    memset((char *)&chunk->d, 0xda, chunk->size);
 #endif
+    return (char *)&chunk->d;
+}
 
+char *_stm_large_malloc(size_t request_size)
+{
+    request_size = _large_request_size(request_size);
+
+    lm_lock();
+    mchunk_t *chunk = _large_malloc(request_size);
     lm_unlock();
 
-    return (char *)&mscan->d;
+    if (chunk == NULL)
+        return NULL;
+    return _large_allocated(chunk);
+}
+
+char *_stm_large_malloc_from_reserve(char **reserve, size_t request_size)
+{
+    request_size = _large_request_size(request_size);
+    if (request_size > LARGE_MALLOC_RESERVE / 8)
+        return _stm_large_malloc(request_size);
+
+    mchunk_t *chunk = (*reserve != NULL) ? data2chunk(*reserve) : NULL;
+
+    if (chunk == NULL ||
+            chunk->size < request_size + sizeof(struct malloc_chunk)) {
+        /* give back what is left of the old reserve, and get a new one */
+        lm_lock();
+        if (chunk != NULL)
+            _large_free(chunk);
+        chunk = _large_malloc(LARGE_MALLOC_RESERVE);
+        lm_unlock();
+
+        if (chunk == NULL) {
+            *reserve = NULL;
+            return _stm_large_malloc(request_size);
+        }
+    }
+
+    /* split the reserve: the first part is returned, and the rest is
+       still a non-free chunk and becomes the new reserve */
+    mchunk_t *rest = chunk_at_offset(chunk, CHUNK_HEADER_SIZE + request_size);
+    rest->prev_size = BOTH_CHUNKS_USED;
+    rest->size = chunk->size - request_size - CHUNK_HEADER_SIZE;
+    assert(rest->size >= MIN_ALLOC_SIZE);
+    assert(next_chunk(rest)->prev_size == BOTH_CHUNKS_USED ||
+           next_chunk(rest)->prev_size == THIS_CHUNK_FREE);
+    chunk->size = request_size;
+    *reserve = (char *)&rest->d;
+
+    return _large_allocated(chunk);
+}
+
+void _stm_large_release_reserve(char **reserve)
+{
+    if (*reserve != NULL) {
+        lm_lock();
+        _large_free(data2chunk(*reserve));
+        lm_unlock();
+        *reserve = NULL;
+    }
 }
 
 static void _large_free(mchunk_t *chunk)
 {
+    /* must be called with the lock; the caller updates the total
+       allocated size */
     assert((chunk->size & (sizeof(char *) - 1)) == 0);
     assert(chunk->prev_size != THIS_CHUNK_FREE);
 
-    /* 'size' is at least MIN_ALLOC_SIZE */
-    increment_total_allocated(-(chunk->size + LARGE_MALLOC_OVERHEAD));
-
 #ifndef NDEBUG
     {
         char *data = (char *)&chunk->d;
@@ -433,13 +525,38 @@ static void _large_free(mchunk_t *chunk)
     insert_unsorted(chunk);
 }
 
+static void _large_free_and_count(mchunk_t *chunk)
+{
+    /* 'size' is at least MIN_ALLOC_SIZE */
+    increment_total_allocated(-(chunk->size + LARGE_MALLOC_OVERHEAD));
+    _large_free(chunk);
+}
+
 void _stm_large_free(char *data)
 {
     lm_lock();
-    _large_free(data2chunk(data));
+    assert(lm.sweep_next == NULL || data2chunk(data) < lm.sweep_next);
+    _large_free_and_count(data2chunk(data));
     lm_unlock();
 }
 
+void _stm_largemalloc_lock(void)
+{
+    lm_lock();
+}
+
+void _stm_largemalloc_unlock(void)
+{
+    lm_unlock();
+}
+
+void _stm_large_free_locked(char *data)
+{
+    assert(lm.lock);
+    assert(lm.sweep_next == NULL || data2chunk(data) < lm.sweep_next);
+    _large_free_and_count(data2chunk(data));
+}
+
 
 void _stm_large_dump(void)
 {
@@ -483,6 +600,25 @@ void _stm_large_dump(void)
     lm_unlock();
 }
 
+void _stm_largemalloc_data_ranges(void callback(char *, char *))
+{
+    mchunk_t *chunk = lm.first_chunk;
+    char *start = (char *)chunk;
+
+    while (chunk != lm.last_chunk) {
+        mchunk_t *mnext = next_chunk(chunk);
+        if (chunk->prev_size == THIS_CHUNK_FREE) {
+            /* only the header and the list links are meaningful */
+            char *stop = (char *)(&chunk->u + 1);
+            if (start < stop)
+                callback(start, stop);
+            start = (char *)mnext;
+        }
+        chunk = mnext;
+    }
+    callback(start, ((char *)lm.last_chunk) + CHUNK_HEADER_SIZE);
+}
+
 char *_stm_largemalloc_data_start(void)
 {
     return (char *)lm.first_chunk;
@@ -511,6 +647,7 @@ void _stm_largemalloc_init_arena(char *data_start, size_t data_size)
     lm.last_chunk->size = END_MARKER;
     assert(lm.last_chunk == next_chunk(lm.first_chunk));
     lm.lock = 0;
+    lm.sweep_next = NULL;
 
     insert_unsorted(lm.first_chunk);
 
@@ -524,6 +661,9 @@ int _stm_largemalloc_resize_arena(size_t new_size)
     int result = 0;
     lm_lock();
 
+    if (lm.sweep_next != NULL)
+        _large_sweep_until(NULL);
+
     if (new_size < 2 * sizeof(struct malloc_chunk))
         goto fail;
     OPT_ASSERT((new_size & 31) == 0);
@@ -591,19 +731,27 @@ static inline bool _largemalloc_sweep_keep(mchunk_t *chunk)
     return largemalloc_keep_object_at((char *)&chunk->d);
 }
 
-void _stm_largemalloc_sweep(void)
+/* Lazy sweeping: _stm_largemalloc_sweep_start() only records that
+   all chunks from the first one need to be swept.  Then every call to
+   _large_malloc() sweeps, in address order, a part proportional to the
+   requested size.  It never returns a chunk from the part not swept so
+   far: this would let the sweep find and free a chunk that was
+   allocated after the sweep started.
+*/
+
+static void _large_sweep_until(char *stop)
 {
-    lm_lock();
+    /* must be called with the lock.  Sweep the chunks from
+       'lm.sweep_next' up to 'stop', or to the end if 'stop' is NULL. */
 
     /* This may be slightly optimized by inlining _large_free() and
        making cases, e.g. we might know already if the previous block
        was free or not.  It's probably not really worth it. */
-    mchunk_t *mnext, *chunk = lm.first_chunk;
-
-    if (chunk->prev_size == THIS_CHUNK_FREE)
-        chunk = next_chunk(chunk);   /* go to the first non-free chunk */
+    mchunk_t *mnext, *chunk = lm.sweep_next;
+    uint64_t freed = 0;
 
-    while (chunk != lm.last_chunk) {
+    while (chunk != lm.last_chunk &&
+               (stop == NULL || (char *)chunk < stop)) {
         /* here, the chunk we're pointing to is not free */
         assert(chunk->prev_size != THIS_CHUNK_FREE);
 
@@ -615,10 +763,46 @@ void _stm_largemalloc_sweep(void)
         /* use the callback to know if 'chunk' contains an object that
            survives or dies */
         if (!_largemalloc_sweep_keep(chunk)) {
-            _large_free(chunk);     /* dies */
+            freed += chunk->size + LARGE_MALLOC_OVERHEAD;
+            _large_free_and_count(chunk);     /* dies */
         }
         chunk = mnext;
     }
+    lm.sweep_next = (chunk != lm.last_chunk) ? chunk : NULL;
+
+    /* this memory was already dead at the last major collection */
+    if (freed > 0)
+        lower_major_collection_bound(freed);
+}
+
+void _stm_largemalloc_sweep_start(void)
+{
+    lm_lock();
+    assert(lm.sweep_next == NULL);
+
+    mchunk_t *chunk = lm.first_chunk;
+    if (chunk->prev_size == THIS_CHUNK_FREE)
+        chunk = next_chunk(chunk);   /* go to the first non-free chunk */
+    lm.sweep_next = (chunk != lm.last_chunk) ? chunk : NULL;
 
     lm_unlock();
 }
+
+void _stm_largemalloc_sweep_finish(void)
+{
+    lm_lock();
+    if (lm.sweep_next != NULL)
+        _large_sweep_until(NULL);
+    lm_unlock();
+}
+
+bool _stm_largemalloc_sweep_pending(void)
+{
+    return lm.sweep_next != NULL;
+}
+
+void _stm_largemalloc_sweep(void)
+{
+    _stm_largemalloc_sweep_start();
+    _stm_largemalloc_sweep_finish();
+}
@@ -12,7 +12,36 @@ char *_stm_large_malloc(size_t request_size);
 void _stm_large_free(char *data);
 void _stm_largemalloc_sweep(void);
 
+/* Lazy version of _stm_largemalloc_sweep(): the chunks are swept by
+   the following allocations, a bit at a time (at least LARGE_SWEEP_RATE
+   times the size requested).  _stm_largemalloc_sweep_finish() completes
+   the sweep.  The sweep uses the callback largemalloc_keep_object_at(),
+   so it must be finished before the GC changes what this returns. */
+void _stm_largemalloc_sweep_start(void);
+void _stm_largemalloc_sweep_finish(void);
+bool _stm_largemalloc_sweep_pending(void);
+
+/* A "reserve" is a chunk taken out of the global free lists, from which
+   _stm_large_malloc_from_reserve() carves small enough objects without
+   taking the lock.  Each segment has its own.  It must be given back
+   with _stm_large_release_reserve() before the sweep starts. */
+char *_stm_large_malloc_from_reserve(char **reserve, size_t request_size);
+void _stm_large_release_reserve(char **reserve);
+
+/* for freeing many objects with a single acquisition of the lock */
+void _stm_largemalloc_lock(void);
+void _stm_largemalloc_unlock(void);
+void _stm_large_free_locked(char *data);
+
 void _stm_large_dump(void);
 
+/* Calls 'callback(start, stop)' on the address ranges that can contain
+   data: the non-free chunks and the headers of all chunks, in increasing
+   order.  The content of the rest of the arena is never read.  Used by
+   fork support, when no other thread runs. */
+void _stm_largemalloc_data_ranges(void callback(char *, char *));
+
 
 #define LARGE_MALLOC_OVERHEAD   (2 * sizeof(size_t))   /* estimate */
+#define LARGE_MALLOC_RESERVE    (128 * 1024)
+#define LARGE_SWEEP_RATE        4
@@ -9,7 +9,7 @@ char *_stm_real_address(object_t *o)
         return NULL;
 
     assert(FIRST_OBJECT_PAGE * 4096UL <= (uintptr_t)o
-           && (uintptr_t)o < NB_PAGES * 4096UL);
+           && (uintptr_t)o < nb_pages * 4096UL);
     return REAL_ADDRESS(STM_SEGMENT->segment_base, o);
 }
 
@@ -43,7 +43,25 @@ bool _stm_was_written(object_t *obj)
 
 bool _stm_was_written_card(object_t *obj)
 {
-    return obj->stm_flags & _STM_GCFLAG_CARDS_SET;
+    if (obj->stm_flags & _STM_GCFLAG_CARDS_SET)
+        return true;
+
+    /* with card locks, see write_slowpath_card_lock() */
+    if (!cards_are_locked(get_write_lock_idx((uintptr_t)obj)))
+        return false;
+    wlog_t *item;
+    TREE_FIND(*STM_PSEGMENT->card_locked_objects, (uintptr_t)obj, item,
+              return false);
+    return item->val != 0;
+}
+
+bool _stm_was_read_card(object_t *obj, uintptr_t index)
+{
+    /* see stm_read_range() */
+    uintptr_t card_index = get_index_to_card_index(index);
+    return was_read_remote(STM_SEGMENT->segment_base,
+                           (object_t *)(((uintptr_t)obj) + 16 * card_index),
+                           STM_SEGMENT->transaction_read_version);
 }
 
 #ifdef STM_TESTS
@@ -96,4 +114,14 @@ uint64_t _stm_total_allocated(void)
 {
     return increment_total_allocated(0);
 }
+
+void _stm_request_major_collection(void)
+{
+    request_major_collection();
+}
+
+bool _stm_major_marking_in_progress(void)
+{
+    return major_marking_in_progress;
+}
 #endif
@@ -0,0 +1,204 @@
+#ifndef _STM_CORE_H_
+# error "must be compiled via stmgc.c"
+#endif
+
+/* Closed-nested transactions.
+
+   stm_begin_nested() starts with a minor collection.  Afterwards, all
+   objects of the transaction are old and have GCFLAG_WRITE_BARRIER,
+   so that the write barrier sees the first change done to any of
+   them by the inner transaction.  There are three cases:
+
+   - an object that the transaction did not change so far: the write
+     barrier locks it and adds it to 'modified_old_objects', after the
+     'modified_old_objects_count' of the stm_nested_t.  A rollback
+     resets it from segment 0 and releases the lock, like an abort.
+
+   - an object that the transaction already changed (we own the write
+     lock), or an object created by the transaction (an overflow
+     object): the write barrier saves a copy of it in 'nested_undo'.
+     A rollback copies it back.
+
+   - a young object: it was created by the inner transaction, and a
+     rollback throws it away with the rest of the nursery.
+
+   The objects that the inner transaction moved out of the nursery are
+   left as garbage for the next major collection.
+*/
+
+
+void _stm_begin_nested(stm_thread_local_t *tl, stm_nested_t *nested)
+{
+    assert(STM_SEGMENT->running_thread == tl);
+    assert(_seems_to_be_running_transaction());
+
+    minor_collection(/*commit=*/ false);
+    assert(STM_PSEGMENT->objects_pointing_to_nursery != NULL);
+    assert(list_is_empty(STM_PSEGMENT->objects_pointing_to_nursery));
+    assert(list_is_empty(STM_PSEGMENT->old_objects_with_cards));
+
+    nested->prev = STM_PSEGMENT->nested;
+    nested->shadowstack = tl->shadowstack;
+    nested->rjhead = tl->rjthread.head;
+    nested->thread_local_obj = tl->thread_local_obj;
+    nested->modified_old_objects_count =
+        list_count(STM_PSEGMENT->modified_old_objects);
+    nested->nested_undo_count = list_count(STM_PSEGMENT->nested_undo);
+    nested->elided_locks = STM_PSEGMENT->elided_locks;
+    STM_PSEGMENT->nested = nested;
+}
+
+static void free_nested_undo(struct list_s *lst, uintptr_t count)
+{
+    /* free the copies after the first 'count' items */
+    uintptr_t i;
+    for (i = count; i < list_count(lst); i += 2)
+        free((char *)list_item(lst, i + 1));
+    lst->count = count;
+}
+
+void stm_commit_nested(stm_nested_t *nested)
+{
+    assert(STM_PSEGMENT->nested == nested);
+
+    /* the copies are still needed if we are inside another nested
+       transaction, to roll back to the start of that one */
+    STM_PSEGMENT->nested = nested->prev;
+    if (nested->prev == NULL)
+        free_nested_undo(STM_PSEGMENT->nested_undo, 0);
+}
+
+static void forget_nested_transactions(struct stm_priv_segment_info_s *pseg)
+{
+    /* called when the whole transaction commits or aborts */
+    pseg->nested = NULL;
+    free_nested_undo(pseg->nested_undo, 0);
+}
+
+static void nested_save_object(object_t *obj)
+{
+    char *realobj = REAL_ADDRESS(STM_SEGMENT->segment_base, obj);
+    ssize_t size = stmcb_size_rounded_up((struct object_s *)realobj);
+    char *copy = malloc(size);
+    if (copy == NULL)
+        stm_fatalerror("out of memory in nested_save_object");
+    memcpy(copy, realobj, size);
+
+    STM_PSEGMENT->nested_undo = list_append2(STM_PSEGMENT->nested_undo,
+                                             (uintptr_t)obj,
+                                             (uintptr_t)copy);
+}
+
+static void forget_young_ref(object_t **pobj)
+{
+    if (*pobj != NULL && _is_young(*pobj))
+        *pobj = NULL;
+}
+
+static void forget_young_refs(object_t *obj)
+{
+    struct object_s *realobj = (struct object_s *)
+        REAL_ADDRESS(STM_SEGMENT->segment_base, obj);
+    stmcb_trace(realobj, forget_young_ref);
+}
+
+static void rollback_nested(void)
+{
+    stm_nested_t *nested = STM_PSEGMENT->nested;
+    stm_thread_local_t *tl = STM_SEGMENT->running_thread;
+    struct stm_priv_segment_info_s *pseg =
+        get_priv_segment(STM_SEGMENT->segment_num);
+    struct list_s *lst;
+    uintptr_t i;
+
+    assert(_has_mutex());
+    assert(nested != NULL);
+    dprintf(("rollback_nested\n"));
+
+    /* No object that survives must point to the young objects, which
+       are about to be thrown away.  The objects that are restored
+       below will not, but the overflow objects created by the inner
+       transaction are garbage that may still be traced by a major
+       collection. */
+    LIST_FOREACH_R(pseg->objects_pointing_to_nursery, object_t * /*item*/,
+                   forget_young_refs(item));
+    LIST_FOREACH_R(pseg->old_objects_with_cards, object_t * /*item*/,
+        ({
+            forget_young_refs(item);
+            if (item->stm_flags & GCFLAG_CARDS_SET) {
+                /* the write-locked objects may have cards from before
+                   stm_begin_nested(), which must stay marked */
+                _reset_object_cards(pseg, item,
+                                    IS_OVERFLOW_OBJ(pseg, item) ?
+                                        CARD_CLEAR : CARD_MARKED_OLD,
+                                    false);
+            }
+        }));
+    for (i = 0; tl->shadowstack_base + i < nested->shadowstack; i++) {
+        object_t *root = tl->shadowstack_base[i].ss;
+        if ((((uintptr_t)root) & 3) == 0)
+            forget_young_ref(&tl->shadowstack_base[i].ss);
+    }
+
+    /* throw away the young objects */
+    rollback_young_finalizers();
+    throw_away_nursery(pseg);
+    list_clear(pseg->young_weakrefs);
+
+    /* copy back the objects saved by nested_save_object() */
+    lst = pseg->nested_undo;
+    for (i = list_count(lst); i > nested->nested_undo_count; ) {
+        char *copy = (char *)list_item(lst, --i);
+        object_t *obj = (object_t *)list_item(lst, --i);
+        char *realobj = REAL_ADDRESS(STM_SEGMENT->segment_base, obj);
+        memcpy(realobj, copy, stmcb_size_rounded_up((struct object_s *)copy));
+        assert(obj->stm_flags & GCFLAG_WRITE_BARRIER);
+        if (UNLIKELY(major_marking_in_progress))
+            LIST_APPEND(pseg->marking_dirty_objects, obj);
+    }
+    free_nested_undo(lst, nested->nested_undo_count);
+
+    /* reset from segment 0 the objects first changed by the inner
+       transaction, and release their write lock */
+    reset_modified_from_other_segments(STM_SEGMENT->segment_num,
+                                       nested->modified_old_objects_count);
+
+    /* all the objects have GCFLAG_WRITE_BARRIER again, like after the
+       minor collection done by stm_begin_nested() */
+    LIST_FOREACH_R(pseg->objects_pointing_to_nursery, object_t * /*item*/,
+                   item->stm_flags |= GCFLAG_WRITE_BARRIER);
+    list_clear(pseg->objects_pointing_to_nursery);
+    list_clear(pseg->old_objects_with_cards);
+    if (pseg->modified_old_objects_markers_num_old >
+            list_count(pseg->modified_old_objects_markers))
+        pseg->modified_old_objects_markers_num_old =
+            list_count(pseg->modified_old_objects_markers);
+
+    tl->shadowstack = nested->shadowstack;
+    tl->rjthread.head = nested->rjhead;
+    tl->thread_local_obj = nested->thread_local_obj;
+    set_elided_locks(nested->elided_locks);
+    STM_PSEGMENT->nested = nested->prev;
+}
+
+static void abort_nested_with_mutex_and_sleep(long usec)
+{
+    stm_nested_t *nested = STM_PSEGMENT->nested;
+    rollback_nested();
+    s_mutex_unlock();
+
+    /* like abort_with_mutex_and_sleep() */
+    if (usec > 0)
+        usleep(usec);
+    __builtin_longjmp(nested->jmpbuf, 1);
+}
+
+void stm_abort_nested(stm_nested_t *nested)
+{
+    s_mutex_lock();
+    if (must_abort())
+        abort_with_mutex();
+
+    assert(STM_PSEGMENT->nested == nested);
+    abort_nested_with_mutex_and_sleep(0);
+}
@@ -0,0 +1,5 @@
+
+static void nested_save_object(object_t *obj);
+static void forget_nested_transactions(struct stm_priv_segment_info_s *pseg);
+static void abort_nested_with_mutex_and_sleep(long usec)
+    __attribute__((noreturn));
@@ -26,7 +26,7 @@ static void setup_nursery(void)
     _stm_nursery_start = NURSERY_START;
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         get_segment(i)->nursery_current = (stm_char *)NURSERY_START;
         get_segment(i)->nursery_end = NURSERY_END;
     }
@@ -74,7 +74,7 @@ static void minor_trace_if_young(object_t **pobj)
 
     if (obj == NULL)
         return;
-    assert((uintptr_t)obj < NB_PAGES * 4096UL);
+    assert((uintptr_t)obj < nb_pages * 4096UL);
 
     if (_is_in_nursery(obj)) {
         /* If the object was already seen here, its first word was set
@@ -107,9 +107,23 @@ static void minor_trace_if_young(object_t **pobj)
         realobj = REAL_ADDRESS(STM_SEGMENT->segment_base, obj);
         size = stmcb_size_rounded_up((struct object_s *)realobj);
 
-        if (1 /*size >= GC_N_SMALL_REQUESTS*8*/) {
+        if (size < GC_N_SMALL_REQUESTS * 8) {
 
-            /* case 1: object is not small enough.
+            /* case 1: object is small enough.  Ask gcpage.c for a
+               place in one of the uniform pages. */
+            char *allocated = allocate_outside_nursery_small(size);
+            if (UNLIKELY(allocated == NULL))
+                goto allocate_large_object;
+            nobj = (object_t *)(allocated - stm_object_pages);
+
+            /* Copy the object */
+            char *realnobj = REAL_ADDRESS(STM_SEGMENT->segment_base, nobj);
+            memcpy(realnobj, realobj, size);
+            ((struct object_s *)realnobj)->stm_flags |= GCFLAG_SMALL_UNIFORM;
+        }
+        else {
+         allocate_large_object:;
+            /* case 2: object is not small enough.
                Ask gcpage.c for an allocation via largemalloc. */
             char *allocated = allocate_outside_nursery_large(size);
             nobj = (object_t *)(allocated - stm_object_pages);
@@ -118,14 +132,12 @@ static void minor_trace_if_young(object_t **pobj)
          copy_large_object:;
             char *realnobj = REAL_ADDRESS(STM_SEGMENT->segment_base, nobj);
             memcpy(realnobj, realobj, size);
-
-            nobj_sync_now = ((uintptr_t)nobj) | FLAG_SYNC_LARGE;
-        }
-        else {
-            /* case "small enough" */
-            abort();  //...
         }
 
+        /* Both small and large objects must be synchronized to the
+           other segments (see collect_oldrefs_to_nursery()) */
+        nobj_sync_now = ((uintptr_t)nobj) | FLAG_SYNC_LARGE;
+
         /* Done copying the object. */
         //dprintf(("\t\t\t\t\t%p -> %p\n", obj, nobj));
         pforwarded_array[0] = GCWORD_MOVED;
@@ -154,6 +166,11 @@ static void minor_trace_if_young(object_t **pobj)
     /* Must trace the object later */
     LIST_APPEND(STM_PSEGMENT->objects_pointing_to_nursery, nobj_sync_now);
     _cards_cleared_in_object(get_priv_segment(STM_SEGMENT->segment_num), nobj);
+
+    /* Incremental marking of a major collection in progress: the new
+       old object must be traced by the next slice */
+    if (UNLIKELY(major_marking_in_progress))
+        LIST_APPEND(STM_PSEGMENT->marking_dirty_objects, nobj);
 }
 
 static void collect_roots_in_nursery(void)
@@ -196,8 +213,8 @@ static void _cards_cleared_in_object(struct stm_priv_segment_info_s *pseg, objec
     uintptr_t card_index = 1;
     uintptr_t last_card_index = get_index_to_card_index(size - 1); /* max valid index */
 
-    OPT_ASSERT(write_locks[first_card_index] <= NB_SEGMENTS_MAX
-               || write_locks[first_card_index] == 255); /* see gcpage.c */
+    OPT_ASSERT(write_locks[first_card_index] <= NB_SEGMENTS_MAX ||
+               cards_are_locked(first_card_index));
     while (card_index <= last_card_index) {
         uintptr_t card_lock_idx = first_card_index + card_index;
         if (write_locks[card_lock_idx] != CARD_CLEAR) {
@@ -260,8 +277,7 @@ static void _reset_object_cards(struct stm_priv_segment_info_s *pseg,
     uintptr_t card_index = 1;
     uintptr_t last_card_index = get_index_to_card_index(size - 1); /* max valid index */
 
-    OPT_ASSERT(write_locks[first_card_index] <= NB_SEGMENTS
-               || write_locks[first_card_index] == 255); /* see gcpage.c */
+    OPT_ASSERT(write_locks[first_card_index] <= nb_segments);
 
     dprintf(("mark cards of %p, size %lu with %d, all: %d\n",
              obj, size, mark_value, mark_all));
@@ -283,11 +299,36 @@ static void _reset_object_cards(struct stm_priv_segment_info_s *pseg,
 #pragma pop_macro("STM_PSEGMENT")
 }
 
+static void _unmark_locked_cards(struct stm_priv_segment_info_s *pseg,
+                                 object_t *obj)
+{
+    /* the cards that 'pseg' marked on a card-locked object stay locked
+       by it, but are not marked any more */
+    struct object_s *realobj = (struct object_s *)REAL_ADDRESS(pseg->pub.segment_base, obj);
+    size_t size = stmcb_size_rounded_up(realobj);
+    uintptr_t offset_itemsize[2];
+    stmcb_get_card_base_itemsize(realobj, offset_itemsize);
+    size = (size - offset_itemsize[0]) / offset_itemsize[1];
+
+    uintptr_t first_card_index = get_write_lock_idx((uintptr_t)obj);
+    uintptr_t card_index = 1;
+    uintptr_t last_card_index = get_index_to_card_index(size - 1); /* max valid index */
+    uint8_t lock_num = pseg->write_lock_num;
+
+    assert(cards_are_locked(first_card_index));
+    assert(!(realobj->stm_flags & GCFLAG_CARDS_SET));
+    while (card_index <= last_card_index) {
+        uintptr_t card_lock_idx = first_card_index + card_index;
+        if (write_locks[card_lock_idx] == (lock_num | CARD_LOCK_MARKED))
+            write_locks[card_lock_idx] = lock_num;
+        card_index++;
+    }
+}
+
 
 static void _trace_card_object(object_t *obj)
 {
     assert(!_is_in_nursery(obj));
-    assert(obj->stm_flags & GCFLAG_CARDS_SET);
     assert(obj->stm_flags & GCFLAG_WRITE_BARRIER);
 
     dprintf(("_trace_card_object(%p)\n", obj));
@@ -304,13 +345,23 @@ static void _trace_card_object(object_t *obj)
     uintptr_t card_index = 1;
     uintptr_t last_card_index = get_index_to_card_index(size - 1); /* max valid index */
 
-    OPT_ASSERT(write_locks[first_card_index] <= NB_SEGMENTS_MAX
-               || write_locks[first_card_index] == 255); /* see gcpage.c */
+    /* with CARDS_LOCKED, our marked cards are only locked afterwards */
+    uint8_t marked = CARD_MARKED;
+    if (cards_are_locked(first_card_index)) {
+        assert(!obj_is_overflow);
+        assert(!(obj->stm_flags & GCFLAG_CARDS_SET));
+        mark_value = STM_PSEGMENT->write_lock_num;
+        marked = mark_value | CARD_LOCK_MARKED;
+    }
+    else {
+        assert(obj->stm_flags & GCFLAG_CARDS_SET);
+        OPT_ASSERT(write_locks[first_card_index] <= NB_SEGMENTS_MAX);
+    }
 
     /* XXX: merge ranges */
     while (card_index <= last_card_index) {
         uintptr_t card_lock_idx = first_card_index + card_index;
-        if (write_locks[card_lock_idx] == CARD_MARKED) {
+        if (write_locks[card_lock_idx] == marked) {
             /* clear or set to old: */
             write_locks[card_lock_idx] = mark_value;
 
@@ -375,6 +426,20 @@ static void collect_cardrefs_to_nursery(void)
 
         assert(!(obj->stm_flags & GCFLAG_CARDS_SET));
     }
+
+    /* the objects with card locks don't have GCFLAG_CARDS_SET, see
+       write_slowpath_card_lock().  Skip the ones that we have locked
+       as a whole since. */
+    if (!tree_is_cleared(STM_PSEGMENT->card_locked_objects)) {
+        wlog_t *item;
+        TREE_LOOP_FORWARD(*STM_PSEGMENT->card_locked_objects, item) {
+            if (item->val) {
+                item->val = 0;
+                if (cards_are_locked(get_write_lock_idx(item->addr)))
+                    _trace_card_object((object_t *)item->addr);
+            }
+        } TREE_LOOP_END;
+    }
 }
 
 static void collect_oldrefs_to_nursery(void)
@@ -487,17 +552,20 @@ static size_t throw_away_nursery(struct stm_priv_segment_info_s *pseg)
     if (!tree_is_cleared(pseg->young_outside_nursery)) {
         wlog_t *item;
 
+        _stm_largemalloc_lock();
         TREE_LOOP_FORWARD(*pseg->young_outside_nursery, item) {
             object_t *obj = (object_t*)item->addr;
             assert(!_is_in_nursery(obj));
 
             /* mark slot as unread (it can only have the read marker
                in this segment) */
-            ((struct stm_read_marker_s *)
-             (pseg->pub.segment_base + (((uintptr_t)obj) >> 4)))->rm = 0;
+            reset_read_marker(pseg->pub.segment_base, obj);
+            reset_card_read_markers(pseg->pub.segment_base, obj,
+                get_freed_last_card_index(pseg->pub.segment_base, obj));
 
-            _stm_large_free(stm_object_pages + item->addr);
+            _stm_large_free_locked(stm_object_pages + item->addr);
         } TREE_LOOP_END;
+        _stm_largemalloc_unlock();
 
         tree_clear(pseg->young_outside_nursery);
     }
@@ -588,7 +656,10 @@ static void _do_minor_collection(bool commit)
     stm_move_young_weakrefs();
     deal_with_young_objects_with_finalizers();
 
-    throw_away_nursery(get_priv_segment(STM_SEGMENT->segment_num));
+    size_t nursery_used =
+        throw_away_nursery(get_priv_segment(STM_SEGMENT->segment_num));
+    STM_PSEGMENT->work_nursery_bytes += nursery_used;
+    STM_SEGMENT->nursery_mark -= nursery_used;
 
     assert(MINOR_NOTHING_TO_DO(STM_PSEGMENT));
     assert(list_is_empty(STM_PSEGMENT->objects_pointing_to_nursery));
@@ -627,6 +698,9 @@ object_t *_stm_allocate_slowpath(ssize_t size_rounded_up)
     /* may collect! */
     STM_SEGMENT->nursery_current -= size_rounded_up;  /* restore correct val */
 
+    if (UNLIKELY(STM_PSEGMENT->readonly_transaction))
+        stm_fatalerror("stm_allocate() in a read-only transaction");
+
  restart:
     stm_safe_point();
 
@@ -647,6 +721,9 @@ object_t *_stm_allocate_slowpath(ssize_t size_rounded_up)
 
 object_t *_stm_allocate_external(ssize_t size_rounded_up)
 {
+    if (UNLIKELY(STM_PSEGMENT->readonly_transaction))
+        stm_fatalerror("stm_allocate() in a read-only transaction");
+
     /* first, force a collection if needed */
     if (is_major_collection_requested()) {
         /* use stm_collect() with level 0: if another thread does a major GC
@@ -672,7 +749,7 @@ void _stm_set_nursery_free_count(uint64_t free_count)
     _stm_nursery_start = NURSERY_END - free_count;
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         if ((uintptr_t)get_segment(i)->nursery_current < _stm_nursery_start)
             get_segment(i)->nursery_current = (stm_char *)_stm_nursery_start;
     }
@@ -705,13 +782,14 @@ static void major_do_minor_collections(void)
     int original_num = STM_SEGMENT->segment_num;
     long i;
 
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         struct stm_priv_segment_info_s *pseg = get_priv_segment(i);
         if (MINOR_NOTHING_TO_DO(pseg))  /*TS_NONE segments have NOTHING_TO_DO*/
             continue;
 
         assert(pseg->transaction_state != TS_NONE);
         assert(pseg->safe_point != SP_RUNNING);
+        assert(pseg->safe_point != SP_COMMITTING);
         assert(pseg->safe_point != SP_NO_TRANSACTION);
 
         set_gs_register(get_segment_base(i));
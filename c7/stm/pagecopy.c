@@ -20,7 +20,7 @@
                      : "r"(src), "r"(dest)                              \
                      : "xmm0", "xmm1", "xmm2", "xmm3", "memory")
 
-static void pagecopy(void *dest, const void *src)
+static void pagecopy_sse2(void *dest, const void *src)
 {
     unsigned long i;
     for (i = 0; i < 4096 / 128; i++) {
@@ -28,16 +28,7 @@ static void pagecopy(void *dest, const void *src)
     }
 }
 
-#if 0
-static void pagecopy_256(void *dest, const void *src)
-{
-    PAGECOPY_128(dest,       src      );
-    PAGECOPY_128(dest + 128, src + 128);
-}
-#endif
-
-#if 0   /* XXX enable if detected on the cpu */
-static void pagecopy_ymm8(void *dest, const void *src)
+static void pagecopy_avx2(void *dest, const void *src)
 {
     asm volatile("0:\n"
                  "vmovdqa (%0), %%ymm0\n"
@@ -59,10 +50,159 @@ static void pagecopy_ymm8(void *dest, const void *src)
                  "vmovdqa %%ymm7, 224(%1)\n"
                  "addq $256, %1\n"
                  "cmpq %2, %0\n"
-                 "jne 0b"
+                 "jne 0b\n"
+                 "vzeroupper"
+                 : "=r"(src), "=r"(dest)
+                 : "r"((char *)src + 4096), "0"(src), "1"(dest)
+                 : "xmm0", "xmm1", "xmm2", "xmm3",
+                   "xmm4", "xmm5", "xmm6", "xmm7", "memory");
+}
+
+static void pagecopy_avx512(void *dest, const void *src)
+{
+    asm volatile("0:\n"
+                 "vmovdqa64 (%0), %%zmm0\n"
+                 "vmovdqa64 64(%0), %%zmm1\n"
+                 "vmovdqa64 128(%0), %%zmm2\n"
+                 "vmovdqa64 192(%0), %%zmm3\n"
+                 "vmovdqa64 256(%0), %%zmm4\n"
+                 "vmovdqa64 320(%0), %%zmm5\n"
+                 "vmovdqa64 384(%0), %%zmm6\n"
+                 "vmovdqa64 448(%0), %%zmm7\n"
+                 "addq $512, %0\n"
+                 "vmovdqa64 %%zmm0, (%1)\n"
+                 "vmovdqa64 %%zmm1, 64(%1)\n"
+                 "vmovdqa64 %%zmm2, 128(%1)\n"
+                 "vmovdqa64 %%zmm3, 192(%1)\n"
+                 "vmovdqa64 %%zmm4, 256(%1)\n"
+                 "vmovdqa64 %%zmm5, 320(%1)\n"
+                 "vmovdqa64 %%zmm6, 384(%1)\n"
+                 "vmovdqa64 %%zmm7, 448(%1)\n"
+                 "addq $512, %1\n"
+                 "cmpq %2, %0\n"
+                 "jne 0b\n"
+                 "vzeroupper"
                  : "=r"(src), "=r"(dest)
                  : "r"((char *)src + 4096), "0"(src), "1"(dest)
                  : "xmm0", "xmm1", "xmm2", "xmm3",
-                   "xmm4", "xmm5", "xmm6", "xmm7");
+                   "xmm4", "xmm5", "xmm6", "xmm7", "memory");
+}
+
+static void pagecopy_nt(void *dest, const void *src)
+{
+    /* like pagecopy_sse2(), but with non-temporal stores that bypass
+       the cache: for copies whose destination is not read soon */
+    asm volatile("0:\n"
+                 "movdqa (%0), %%xmm0\n"
+                 "movdqa 16(%0), %%xmm1\n"
+                 "movdqa 32(%0), %%xmm2\n"
+                 "movdqa 48(%0), %%xmm3\n"
+                 "addq $64, %0\n"
+                 "movntdq %%xmm0, (%1)\n"
+                 "movntdq %%xmm1, 16(%1)\n"
+                 "movntdq %%xmm2, 32(%1)\n"
+                 "movntdq %%xmm3, 48(%1)\n"
+                 "addq $64, %1\n"
+                 "cmpq %2, %0\n"
+                 "jne 0b\n"
+                 "sfence"
+                 : "=r"(src), "=r"(dest)
+                 : "r"((char *)src + 4096), "0"(src), "1"(dest)
+                 : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+}
+
+
+static struct pagecopy_variant_s pagecopy_variants[] = {
+    { "sse2",   pagecopy_sse2 },
+    { "avx2",   pagecopy_avx2 },
+    { "avx512", pagecopy_avx512 },
+    { "nt",     pagecopy_nt },
+    { NULL,     NULL }
+};
+
+static void (*pagecopy_fn)(void *, const void *) = pagecopy_sse2;
+
+static inline void pagecopy(void *dest, const void *src)
+{
+    pagecopy_fn(dest, src);
+}
+
+static bool pagecopy_variant_supported(struct pagecopy_variant_s *v)
+{
+    /* __builtin_cpu_supports() also checks that the OS saves the
+       AVX registers */
+    __builtin_cpu_init();
+    if (v->fn == pagecopy_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (v->fn == pagecopy_avx512)
+        return __builtin_cpu_supports("avx512f");
+    return true;     /* SSE2 is part of x86-64 */
+}
+
+static double pagecopy_measure(void copy(void *, const void *),
+                               char *dest, char *src, long npages)
+{
+    /* returns the best time, in nanoseconds per page, of a few rounds
+       of copying 'npages' pages from 'src' to 'dest' */
+    double best = -1.0;
+    int round;
+    for (round = 0; round < 8; round++) {
+        struct timespec t0, t1;
+        long i;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < npages; i++)
+            copy(dest + i * 4096L, src + i * 4096L);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double t = ((t1.tv_sec - t0.tv_sec) * 1e9 +
+                    (t1.tv_nsec - t0.tv_nsec)) / npages;
+        if (best < 0.0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+static void setup_pagecopy(void)
+{
+    /* Pick the page copy to use: the one given in the environment
+       variable STM_PAGECOPY, or else the fastest one among the
+       variants that the cpu supports.  Done only once per process. */
+    static bool pagecopy_chosen = false;
+    if (pagecopy_chosen)
+        return;
+    pagecopy_chosen = true;
+
+    struct pagecopy_variant_s *v;
+    char *env = getenv("STM_PAGECOPY");
+    if (env != NULL && *env) {
+        for (v = pagecopy_variants; v->name != NULL; v++) {
+            if (strcmp(v->name, env) == 0)
+                break;
+        }
+        if (v->name == NULL || !pagecopy_variant_supported(v))
+            stm_fatalerror("STM_PAGECOPY=%s: unknown or not supported "
+                           "by this cpu", env);
+        pagecopy_fn = v->fn;
+        return;
+    }
+
+    /* the non-temporal variant is never picked here: it is only a
+       win if the destination is not read soon */
+    long npages = PAGECOPY_BENCH_PAGES;
+    char *buf;
+    if (posix_memalign((void **)&buf, 4096, 2 * npages * 4096L) != 0)
+        return;      /* keep pagecopy_sse2() */
+    memset(buf, 0x5a, 2 * npages * 4096L);
+
+    double best = -1.0;
+    for (v = pagecopy_variants; v->name != NULL; v++) {
+        if (v->fn == pagecopy_nt || !pagecopy_variant_supported(v))
+            continue;
+        double t = pagecopy_measure(v->fn, buf + npages * 4096L, buf,
+                                    npages);
+        if (best < 0.0 || t < best) {
+            best = t;
+            pagecopy_fn = v->fn;
+        }
+    }
+    free(buf);
 }
-#endif
@@ -1,2 +1,13 @@
 
-static void pagecopy(void *dest, const void *src);      // 4096 bytes
+struct pagecopy_variant_s {
+    const char *name;
+    void (*fn)(void *dest, const void *src);
+};
+
+/* number of pages copied by setup_pagecopy() to pick the fastest
+   variant; small enough to stay in the L2 cache */
+#define PAGECOPY_BENCH_PAGES   32
+
+static inline void pagecopy(void *dest, const void *src);  // 4096 bytes
+static void pagecopy_nt(void *dest, const void *src);  // non-temporal
+static void setup_pagecopy(void);
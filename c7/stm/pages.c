@@ -7,6 +7,8 @@
 
 struct {
     volatile bool major_collection_requested;
+    bool major_collection_forced;  /* by stm_collect(1): no incremental
+                                      marking, do it all now */
     uint64_t total_allocated;  /* keep track of how much memory we're
                                   using, ignoring nurseries */
     uint64_t total_allocated_bound;
@@ -21,7 +23,9 @@ static void setup_pages(void)
 static void teardown_pages(void)
 {
     memset(&pages_ctl, 0, sizeof(pages_ctl));
-    memset(pages_privatized, 0, sizeof(pages_privatized));
+    munmap(pages_privatized,
+           NB_PAGES_PRIVATIZED * sizeof(struct page_shared_s));
+    pages_privatized = NULL;
 }
 
 static uint64_t increment_total_allocated(ssize_t add_or_remove)
@@ -40,11 +44,25 @@ static bool is_major_collection_requested(void)
     return pages_ctl.major_collection_requested;
 }
 
+#ifdef STM_TESTS
+static void request_major_collection(void)
+{
+    /* only for _stm_request_major_collection() */
+    pages_ctl.major_collection_requested = true;
+}
+#endif
+
 static void force_major_collection_request(void)
 {
+    pages_ctl.major_collection_forced = true;
     pages_ctl.major_collection_requested = true;
 }
 
+static bool is_major_collection_forced(void)
+{
+    return pages_ctl.major_collection_forced;
+}
+
 static void reset_major_collection_requested(void)
 {
     assert(_has_mutex());
@@ -56,6 +74,32 @@ static void reset_major_collection_requested(void)
 
     pages_ctl.total_allocated_bound = next_bound;
     pages_ctl.major_collection_requested = false;
+    pages_ctl.major_collection_forced = false;
+}
+
+static void lower_major_collection_bound(uint64_t freed)
+{
+    /* called when the lazy sweeping frees memory that was already dead
+       at the last major collection: remove it from the next bound, as
+       if reset_major_collection_requested() had been called after. */
+    uint64_t decrease = (uint64_t)((double)freed * GC_MAJOR_COLLECT);
+    uint64_t bound = pages_ctl.total_allocated_bound;
+
+    if (bound < GC_MIN + decrease)
+        bound = GC_MIN;
+    else
+        bound -= decrease;
+    pages_ctl.total_allocated_bound = bound;
+}
+
+static void postpone_major_collection_request(uint64_t step)
+{
+    /* called after a slice of incremental marking: the next slice is
+       requested after 'step' more bytes have been allocated */
+    assert(_has_mutex());
+
+    pages_ctl.total_allocated_bound = pages_ctl.total_allocated + step;
+    pages_ctl.major_collection_requested = false;
 }
 
 /************************************************************/
@@ -65,10 +109,10 @@ static void d_remap_file_pages(char *addr, size_t size, ssize_t pgoff)
 {
     dprintf(("remap_file_pages: 0x%lx bytes: (seg%ld %p) --> (seg%ld %p)\n",
              (long)size,
-             (long)((addr - stm_object_pages) / 4096UL) / NB_PAGES,
-             (void *)((addr - stm_object_pages) % (4096UL * NB_PAGES)),
-             (long)pgoff / NB_PAGES,
-             (void *)((pgoff % NB_PAGES) * 4096UL)));
+             (long)((addr - stm_object_pages) / 4096UL) / nb_pages,
+             (void *)((addr - stm_object_pages) % (4096UL * nb_pages)),
+             (long)pgoff / nb_pages,
+             (void *)((pgoff % nb_pages) * 4096UL)));
     assert(size % 4096 == 0);
     assert(size <= TOTAL_MEMORY);
     assert(((uintptr_t)addr) % 4096 == 0);
@@ -79,7 +123,7 @@ static void d_remap_file_pages(char *addr, size_t size, ssize_t pgoff)
 
     /* assert remappings follow the rule that page N in one segment
        can only be remapped to page N in another segment */
-    assert(((addr - stm_object_pages) / 4096UL - pgoff) % NB_PAGES == 0);
+    assert(((addr - stm_object_pages) / 4096UL - pgoff) % nb_pages == 0);
 
 #ifdef USE_REMAP_FILE_PAGES
     int res = remap_file_pages(addr, size, 0, pgoff, 0);
@@ -102,11 +146,11 @@ static void pages_initialize_shared(uintptr_t pagenum, uintptr_t count)
        segment 0. */
     dprintf(("pages_initialize_shared: 0x%ld - 0x%ld\n", pagenum,
              pagenum + count));
-    assert(pagenum < NB_PAGES);
+    assert(pagenum < nb_pages);
     if (count == 0)
         return;
     uintptr_t i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         char *segment_base = get_segment_base(i);
         d_remap_file_pages(segment_base + pagenum * 4096UL,
                            count * 4096UL, pagenum);
@@ -125,7 +169,7 @@ static void page_privatize(uintptr_t pagenum)
     }
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         spinlock_acquire(get_priv_segment(i)->privatization_lock);
     }
 
@@ -136,24 +180,27 @@ static void page_privatize(uintptr_t pagenum)
        again to its underlying file offset (XXX later we should again
        attempt to group together many calls to d_remap_file_pages() in
        succession) */
-    uintptr_t pagenum_in_file = NB_PAGES * STM_SEGMENT->segment_num + pagenum;
+    uintptr_t pagenum_in_file = nb_pages * STM_SEGMENT->segment_num + pagenum;
     char *new_page = stm_object_pages + pagenum_in_file * 4096UL;
     d_remap_file_pages(new_page, 4096, pagenum_in_file);
     increment_total_allocated(4096);
+    STM_PSEGMENT->work_pages_privatized++;
+    STM_SEGMENT->nursery_mark -= 4096;
 
     /* copy the content from the shared (segment 0) source */
     pagecopy(new_page, stm_object_pages + pagenum * 4096UL);
 
-    for (i = NB_SEGMENTS; i >= 1; i--) {
+    for (i = nb_segments; i >= 1; i--) {
         spinlock_release(get_priv_segment(i)->privatization_lock);
     }
 }
 
-static void _page_do_reshare(long segnum, uintptr_t pagenum)
+static void _pages_do_reshare(long segnum, uintptr_t pagenum,
+                              uintptr_t count)
 {
     char *segment_base = get_segment_base(segnum);
     d_remap_file_pages(segment_base + pagenum * 4096UL,
-                       4096, pagenum);
+                       count * 4096UL, pagenum);
 }
 
 static void page_reshare(uintptr_t pagenum)
@@ -162,8 +209,8 @@ static void page_reshare(uintptr_t pagenum)
     pages_privatized[pagenum - PAGE_FLAG_START].by_segment = 0;
 
     long j, total = 0;
-    for (j = 0; j < NB_SEGMENTS; j++) {
-        if (ps.by_segment & (1 << j)) {
+    for (j = 0; j < nb_segments; j++) {
+        if (ps.by_segment & (1UL << j)) {
             /* Page 'pagenum' is private in segment 'j + 1'. Reshare */
             char *segment_base = get_segment_base(j + 1);
 
@@ -188,12 +235,12 @@ static void pages_setup_readmarkers_for_nursery(void)
        (XXX no performance difference measured so far)
     */
     long i, j;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         char *segment_base = get_segment_base(i);
 
         for (j = FIRST_READMARKER_PAGE + 1; j < FIRST_OLD_RM_PAGE; j++) {
             remap_file_pages(segment_base + 4096 * j, 4096, 0,
-                             i * NB_PAGES + FIRST_READMARKER_PAGE, 0);
+                             i * nb_pages + FIRST_READMARKER_PAGE, 0);
             /* errors here ignored */
         }
     }
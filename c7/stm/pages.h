@@ -17,36 +17,45 @@
 */
 
 #define PAGE_FLAG_START   END_NURSERY_PAGE
-#define PAGE_FLAG_END     NB_PAGES
+#define PAGE_FLAG_END     nb_pages
 
 #define USE_REMAP_FILE_PAGES
 
 struct page_shared_s {
-#if NB_SEGMENTS <= 8
+#if NB_SEGMENTS_MAX <= 8
     uint8_t by_segment;
-#elif NB_SEGMENTS <= 16
+#elif NB_SEGMENTS_MAX <= 16
     uint16_t by_segment;
-#elif NB_SEGMENTS <= 32
+#elif NB_SEGMENTS_MAX <= 32
     uint32_t by_segment;
-#elif NB_SEGMENTS <= 64
+#elif NB_SEGMENTS_MAX <= 64
     uint64_t by_segment;
 #else
-#   error "NB_SEGMENTS > 64 not supported right now"
+#   error "STM_NB_SEGMENTS_MAX > 64 not supported right now"
 #endif
 };
 
-static struct page_shared_s pages_privatized[PAGE_FLAG_END - PAGE_FLAG_START];
+/* a NORESERVE mmap, like 'write_locks' */
+#define NB_PAGES_PRIVATIZED  (PAGE_FLAG_END - PAGE_FLAG_START)
+static struct page_shared_s *pages_privatized;
 
 static void pages_initialize_shared(uintptr_t pagenum, uintptr_t count);
 static void page_privatize(uintptr_t pagenum);
 static void page_reshare(uintptr_t pagenum);
-static void _page_do_reshare(long segnum, uintptr_t pagenum);
+static void _pages_do_reshare(long segnum, uintptr_t pagenum,
+                              uintptr_t count);
 static void pages_setup_readmarkers_for_nursery(void);
 
 static uint64_t increment_total_allocated(ssize_t add_or_remove);
 static bool is_major_collection_requested(void);
+#ifdef STM_TESTS
+static void request_major_collection(void);
+#endif
 static void force_major_collection_request(void);
+static bool is_major_collection_forced(void);
 static void reset_major_collection_requested(void);
+static void postpone_major_collection_request(uint64_t step);
+static void lower_major_collection_bound(uint64_t freed);
 
 static inline bool is_private_page(long segnum, uintptr_t pagenum)
 {
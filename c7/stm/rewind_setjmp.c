@@ -197,7 +197,8 @@ void _rewind_jmp_copy_stack_slice(rewind_jmp_thread *rjthread)
         _rewind_jmp_free_stack_slices(rjthread);
         return;
     }
-    assert(rjthread->moved_off_base < (char *)rjthread->head);
+    assert(rjthread->head == &rjthread->outermost ||
+           rjthread->moved_off_base < (char *)rjthread->head);
     copy_stack(rjthread, rjthread->moved_off_base, rjthread->moved_off_ssbase);
 }
 
@@ -49,6 +49,13 @@ HEAD-----> | rewind_jmp_buf    |  |        |             |
                                   `------> |  next=0     |
                                            +-------------+
 
+If the thread declared an outermost limit with
+rewind_jmp_enter_outermost(), leaving the last real frame doesn't
+forget the slices: 'head' is then the 'outermost' buffer stored in
+the rewind_jmp_thread, and the rest of the stack up to that limit is
+copied too, like a call/cc continuation.  This lets a longjmp() go
+back to a setjmp() done in a callback that already returned to the
+code that called it, even if that code has no rewind_jmp_buf.
 
 ************************************************************/
 
@@ -69,6 +76,7 @@ typedef struct {
     struct _rewind_jmp_moved_s *moved_off;
     void *jmpbuf[5];
     long repeat_count;
+    rewind_jmp_buf outermost;
 } rewind_jmp_thread;
 
 
@@ -97,6 +105,21 @@ typedef struct {
     }                                                        \
 } while (0)
 
+/* declare 'stack_top' as the upper limit of the stack that may be
+   saved, and 'ss' as the lower limit of the shadowstack; see above.
+   The frames in-between must not contain data that other threads
+   change, because a longjmp() restores them. */
+#define rewind_jmp_enter_outermost(rjthread, stack_top, ss)   do {     \
+    assert((rjthread)->head == NULL);                               \
+    (rjthread)->outermost.frame_base = (char *)(stack_top);         \
+    rewind_jmp_enterprepframe(rjthread, &(rjthread)->outermost, ss);\
+} while (0)
+#define rewind_jmp_leave_outermost(rjthread)   do {                 \
+    assert((rjthread)->head == &(rjthread)->outermost);             \
+    assert(!rewind_jmp_armed(rjthread));                            \
+    (rjthread)->head = NULL;                                        \
+} while (0)
+
 long rewind_jmp_setjmp(rewind_jmp_thread *rjthread, void *ss);
 void rewind_jmp_longjmp(rewind_jmp_thread *rjthread) __attribute__((noreturn));
 char *rewind_jmp_restore_shadowstack(rewind_jmp_thread *rjthread);
@@ -54,6 +54,18 @@ static void close_fd_mmap(int map_fd)
 }
 #endif
 
+static void *setup_private_mmap(char *reason, size_t size)
+{
+    /* Zero-initialized tables, which are only backed by memory where
+       they are actually written to.  Their size is proportional to
+       the heap size. */
+    void *result = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (result == MAP_FAILED)
+        stm_fatalerror("%s failed: %m", reason);
+    return result;
+}
+
 static void setup_protection_settings(void)
 {
     /* The segment 0 is not used to run transactions, but contains the
@@ -63,17 +75,23 @@ static void setup_protection_settings(void)
     mprotect(stm_object_pages, END_NURSERY_PAGE * 4096UL, PROT_NONE);
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         char *segment_base = get_segment_base(i);
 
         /* In each segment, the first page is where TLPREFIX'ed
            NULL accesses land.  We mprotect it so that accesses fail. */
         mprotect(segment_base, 4096, PROT_NONE);
 
-        /* Pages in range(2, FIRST_READMARKER_PAGE) are never used */
-        if (FIRST_READMARKER_PAGE > 2)
-            mprotect(segment_base + 8192,
-                     (FIRST_READMARKER_PAGE - 2) * 4096UL,
+        /* Pages in range(2, FIRST_READMARKER_PAGE) are never used,
+           apart from the read summary if STM_READ_SUMMARY */
+#ifdef STM_READ_SUMMARY
+        long first_unused_page = FIRST_READSUMMARY_PAGE + NB_READSUMMARY_PAGES;
+#else
+        long first_unused_page = 2;
+#endif
+        if (FIRST_READMARKER_PAGE > first_unused_page)
+            mprotect(segment_base + first_unused_page * 4096UL,
+                     (FIRST_READMARKER_PAGE - first_unused_page) * 4096UL,
                      PROT_NONE);
     }
     pages_setup_readmarkers_for_nursery();
@@ -81,8 +99,28 @@ static void setup_protection_settings(void)
 
 void stm_setup(void)
 {
+    stm_setup_nb_segments(0);
+}
+
+void stm_setup_nb_segments(long nb_segs)
+{
+    if (nb_segs <= 0) {
+        char *env = getenv("STM_NB_SEGMENTS");
+        nb_segs = (env != NULL) ? atol(env) : STM_NB_SEGMENTS;
+    }
+    if (nb_segs < 1 || nb_segs > NB_SEGMENTS_MAX)
+        stm_fatalerror("invalid number of segments: %ld (must be between "
+                       "1 and %d)", nb_segs, NB_SEGMENTS_MAX);
+    nb_segments = nb_segs;
+
+    char *env = getenv("STM_HEAP_SIZE_MB");
+    long heap_size_mb = (env != NULL) ? atol(env) : STM_HEAP_SIZE_MB;
+    nb_pages = heap_size_mb * 256;
+    if (heap_size_mb <= 0 || END_NURSERY_PAGE * 2 > nb_pages)
+        stm_fatalerror("invalid heap size: %ld MB (too small)", heap_size_mb);
+
     /* Check that some values are acceptable */
-    assert(NB_SEGMENTS <= NB_SEGMENTS_MAX);
+    assert(nb_segments <= NB_SEGMENTS_MAX);
     assert(CARD_SIZE >= 32 && CARD_SIZE % 16 == 0);
     assert(4096 <= ((uintptr_t)STM_SEGMENT));
     assert((uintptr_t)STM_SEGMENT == (uintptr_t)STM_PSEGMENT);
@@ -91,18 +129,27 @@ void stm_setup(void)
     assert(FIRST_READMARKER_PAGE * 4096UL <= READMARKER_START);
     assert(READMARKER_START < READMARKER_END);
     assert(READMARKER_END <= 4096UL * FIRST_OBJECT_PAGE);
-    assert(FIRST_OBJECT_PAGE < NB_PAGES);
-    assert((NB_PAGES * 4096UL) >> 8 <= (FIRST_OBJECT_PAGE * 4096UL) >> 4);
-    assert((END_NURSERY_PAGE * 4096UL) >> 8 <=
+    assert(FIRST_OBJECT_PAGE < nb_pages);
+#ifdef STM_READ_SUMMARY
+    assert(FIRST_READSUMMARY_PAGE >= 2);
+    assert(FIRST_READSUMMARY_PAGE + NB_READSUMMARY_PAGES <=
+           FIRST_READMARKER_PAGE);
+#endif
+    assert((nb_pages * 4096UL) >> (2 * READMARKER_SHIFT) <= READMARKER_START);
+    assert((END_NURSERY_PAGE * 4096UL) >> (2 * READMARKER_SHIFT) <=
            (FIRST_READMARKER_PAGE * 4096UL));
     assert(_STM_FAST_ALLOC <= NB_NURSERY_PAGES * 4096);
 
     stm_object_pages = setup_mmap("initial stm_object_pages mmap()",
                                   &stm_object_pages_fd);
     setup_protection_settings();
+    write_locks = setup_private_mmap("write_locks mmap()", NB_WRITE_LOCKS);
+    pages_privatized = setup_private_mmap(
+        "pages_privatized mmap()",
+        NB_PAGES_PRIVATIZED * sizeof(struct page_shared_s));
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         char *segment_base = get_segment_base(i);
 
         /* Fill the TLS page (page 1) with 0xDC, for debugging */
@@ -124,12 +171,16 @@ void stm_setup(void)
         pr->modified_old_objects_markers = list_create();
         pr->young_weakrefs = list_create();
         pr->old_weakrefs = list_create();
+        pr->marking_dirty_objects = list_create();
         pr->young_outside_nursery = tree_create();
+        pr->card_locked_objects = tree_create();
         pr->nursery_objects_shadows = tree_create();
         pr->callbacks_on_commit_and_abort[0] = tree_create();
         pr->callbacks_on_commit_and_abort[1] = tree_create();
         pr->young_objects_with_light_finalizers = list_create();
         pr->old_objects_with_light_finalizers = list_create();
+        pr->nested = NULL;
+        pr->nested_undo = list_create();
         pr->modified_bags = NULL;
         pr->overflow_number = GCFLAG_OVERFLOW_NUMBER_bit0 * i;
         highest_overflow_number = pr->overflow_number;
@@ -145,6 +196,7 @@ void stm_setup(void)
        private range of addresses.
     */
 
+    setup_pagecopy();
     setup_sync();
     setup_nursery();
     setup_gcpage();
@@ -153,6 +205,11 @@ void stm_setup(void)
     setup_finalizer();
 }
 
+long stm_get_nb_segments(void)
+{
+    return nb_segments;
+}
+
 void stm_teardown(void)
 {
     /* This function is called during testing, but normal programs don't
@@ -160,7 +217,7 @@ void stm_teardown(void)
     assert(!_has_mutex());
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         struct stm_priv_segment_info_s *pr = get_priv_segment(i);
         assert(pr->objects_pointing_to_nursery == NULL);
         list_free(pr->old_objects_with_cards);
@@ -169,12 +226,15 @@ void stm_teardown(void)
         list_free(pr->modified_old_objects_markers);
         list_free(pr->young_weakrefs);
         list_free(pr->old_weakrefs);
+        list_free(pr->marking_dirty_objects);
         tree_free(pr->young_outside_nursery);
+        tree_free(pr->card_locked_objects);
         tree_free(pr->nursery_objects_shadows);
         tree_free(pr->callbacks_on_commit_and_abort[0]);
         tree_free(pr->callbacks_on_commit_and_abort[1]);
         list_free(pr->young_objects_with_light_finalizers);
         list_free(pr->old_objects_with_light_finalizers);
+        list_free(pr->nested_undo);
         list_free(pr->modified_bags);
     }
 
@@ -183,6 +243,8 @@ void stm_teardown(void)
     close_fd_mmap(stm_object_pages_fd);
 
     teardown_finalizer();
+    teardown_contention();
+    teardown_elision();
     teardown_core();
     teardown_sync();
     teardown_gcpage();
@@ -251,11 +313,16 @@ void stm_register_thread_local(stm_thread_local_t *tl)
         num = tl->prev->associated_segment_num;
     }
     tl->thread_local_obj = NULL;
+    tl->contention_policy = NULL;
+    tl->last_abort__work = 0;
+    tl->total_aborted_work = 0;
+    tl->transaction_length = DEFAULT_TRANSACTION_LENGTH;
+    tl->aborts_in_a_row = 0;
 
     /* assign numbers consecutively, but that's for tests; we could also
        assign the same number to all of them and they would get their own
        numbers automatically. */
-    num = (num % NB_SEGMENTS) + 1;
+    num = (num % nb_segments) + 1;
     tl->associated_segment_num = num;
     tl->thread_local_counter = ++thread_local_counters;
     *_get_cpth(tl) = pthread_self();
@@ -1,5 +1,6 @@
 
 static char *setup_mmap(char *reason, int *map_fd);
 static void close_fd_mmap(int map_fd);
+static void *setup_private_mmap(char *reason, size_t size);
 static void setup_protection_settings(void);
 static pthread_t *_get_cpth(stm_thread_local_t *);
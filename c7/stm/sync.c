@@ -15,6 +15,13 @@
 
    - SP_RUNNING: a thread is running a transaction using this segment.
 
+   - SP_COMMITTING: the thread is in stm_commit_transaction(), doing
+     the minor collection and synchronizing its overflow objects.  It
+     does not run user code any more, so it cannot read the objects
+     that another transaction is committing.  It is only paused for
+     synchronize_all_threads() if we need all threads to be stopped,
+     e.g. for a major collection.
+
    - SP_WAIT_FOR_xxx: the thread that owns this segment is currently
      suspended in a safe-point.  (A safe-point means that it is not
      changing anything right now, and the current shadowstack is correct.)
@@ -33,8 +40,14 @@ static union {
     struct {
         pthread_mutex_t global_mutex;
         pthread_cond_t cond[_C_TOTAL];
+        /* the threads waiting for the safe-point request to be removed
+           don't use the global mutex: see wait_for_request_removed() */
+        pthread_mutex_t safe_point_mutex;
+        pthread_cond_t safe_point_cond;
+        uint64_t requests_removed;
+        bool request_removed_pending;   /* protected by the global mutex */
         /* some additional pieces of global state follow */
-        uint8_t in_use1[NB_SEGMENTS];   /* 1 if running a pthread */
+        uint8_t in_use1[NB_SEGMENTS_MAX];   /* 1 if running a pthread */
     };
     char reserved[192];
 } sync_ctl __attribute__((aligned(64)));
@@ -45,11 +58,23 @@ static void setup_sync(void)
     if (pthread_mutex_init(&sync_ctl.global_mutex, NULL) != 0)
         stm_fatalerror("mutex initialization: %m");
 
+    /* the condition variables use CLOCK_MONOTONIC, for
+       cond_wait_timeout() */
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0 ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0)
+        stm_fatalerror("condattr initialization: %m");
+
     long i;
     for (i = 0; i < _C_TOTAL; i++) {
-        if (pthread_cond_init(&sync_ctl.cond[i], NULL) != 0)
+        if (pthread_cond_init(&sync_ctl.cond[i], &attr) != 0)
             stm_fatalerror("cond initialization: %m");
     }
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_mutex_init(&sync_ctl.safe_point_mutex, NULL) != 0 ||
+        pthread_cond_init(&sync_ctl.safe_point_cond, NULL) != 0)
+        stm_fatalerror("safe point mutex initialization: %m");
 }
 
 static void teardown_sync(void)
@@ -62,6 +87,9 @@ static void teardown_sync(void)
         if (pthread_cond_destroy(&sync_ctl.cond[i]) != 0)
             stm_fatalerror("cond destroy: %m");
     }
+    if (pthread_mutex_destroy(&sync_ctl.safe_point_mutex) != 0 ||
+        pthread_cond_destroy(&sync_ctl.safe_point_cond) != 0)
+        stm_fatalerror("safe point mutex destroy: %m");
 
     memset(&sync_ctl, 0, sizeof(sync_ctl));
 }
@@ -91,6 +119,7 @@ static inline void s_mutex_lock(void)
 static inline void s_mutex_unlock(void)
 {
     assert(_has_mutex_here);
+    release_waiting_threads();
     if (UNLIKELY(pthread_mutex_unlock(&sync_ctl.global_mutex) != 0))
         stm_fatalerror("pthread_mutex_unlock: %m");
     assert((_has_mutex_here = false, 1));
@@ -103,11 +132,40 @@ static inline void cond_wait(enum cond_type_e ctype)
 #endif
 
     assert(_has_mutex_here);
+    release_waiting_threads();
     if (UNLIKELY(pthread_cond_wait(&sync_ctl.cond[ctype],
                                    &sync_ctl.global_mutex) != 0))
         stm_fatalerror("pthread_cond_wait/%d: %m", (int)ctype);
 }
 
+static bool cond_wait_timeout(enum cond_type_e ctype, long usec)
+{
+    /* like cond_wait(), but gives up after 'usec' microseconds.
+       Returns false in this case. */
+#ifdef STM_NO_COND_WAIT
+    stm_fatalerror("*** cond_wait_timeout/%d called!", (int)ctype);
+#endif
+
+    assert(_has_mutex_here);
+    release_waiting_threads();
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += usec / 1000000;
+    deadline.tv_nsec += (usec % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    int err = pthread_cond_timedwait(&sync_ctl.cond[ctype],
+                                     &sync_ctl.global_mutex, &deadline);
+    if (LIKELY(err == 0))
+        return true;
+    if (err != ETIMEDOUT)
+        stm_fatalerror("pthread_cond_timedwait/%d: %m", (int)ctype);
+    return false;
+}
+
 static inline void cond_signal(enum cond_type_e ctype)
 {
     if (UNLIKELY(pthread_cond_signal(&sync_ctl.cond[ctype]) != 0))
@@ -120,6 +178,80 @@ static inline void cond_broadcast(enum cond_type_e ctype)
         stm_fatalerror("pthread_cond_broadcast/%d: %m", (int)ctype);
 }
 
+static inline void sp_mutex_lock(void)
+{
+    if (UNLIKELY(pthread_mutex_lock(&sync_ctl.safe_point_mutex) != 0))
+        stm_fatalerror("pthread_mutex_lock: %m");
+}
+
+static inline void sp_mutex_unlock(void)
+{
+    if (UNLIKELY(pthread_mutex_unlock(&sync_ctl.safe_point_mutex) != 0))
+        stm_fatalerror("pthread_mutex_unlock: %m");
+}
+
+static inline void sp_cond_wait(void)
+{
+    if (UNLIKELY(pthread_cond_wait(&sync_ctl.safe_point_cond,
+                                   &sync_ctl.safe_point_mutex) != 0))
+        stm_fatalerror("pthread_cond_wait/safe_point: %m");
+}
+
+static inline void sp_cond_broadcast(void)
+{
+    if (UNLIKELY(pthread_cond_broadcast(&sync_ctl.safe_point_cond) != 0))
+        stm_fatalerror("pthread_cond_broadcast/safe_point: %m");
+}
+
+static void wait_for_request_removed(void)
+{
+    /* Called with the mutex.  Like cond_wait() on a condition variable
+       'C_REQUEST_REMOVED', but the mutex is released while we wait and
+       we don't need it to wake up: this lets the thread doing a major
+       collection, which keeps the mutex, make us help with the marking
+       (see mark_help_at_safe_point()). */
+#ifdef STM_NO_COND_WAIT
+    stm_fatalerror("*** wait_for_request_removed called!");
+#endif
+
+    assert(_has_mutex_here);
+    release_waiting_threads();
+    sp_mutex_lock();
+    uint64_t requests_removed = sync_ctl.requests_removed;
+    s_mutex_unlock();
+
+    mark_shared.waiting_threads++;     /* reset by release_waiting_threads() */
+    while (sync_ctl.requests_removed == requests_removed) {
+        if (!mark_help_at_safe_point())
+            sp_cond_wait();
+    }
+    sp_mutex_unlock();
+    s_mutex_lock();
+}
+
+static void broadcast_request_removed(void)
+{
+    /* wake up all threads in wait_for_request_removed(), but only when
+       we release the mutex: they would only block on it anyway, and in
+       the meantime they stay available for mark_help_at_safe_point() */
+    assert(_has_mutex_here);
+    sync_ctl.request_removed_pending = true;
+}
+
+static void release_waiting_threads(void)
+{
+    /* called just before the mutex is released, including by cond_wait() */
+    assert(_has_mutex_here);
+    if (sync_ctl.request_removed_pending) {
+        sync_ctl.request_removed_pending = false;
+        sp_mutex_lock();
+        sync_ctl.requests_removed++;
+        mark_shared.waiting_threads = 0;   /* they will all leave */
+        sp_cond_broadcast();
+        sp_mutex_unlock();
+    }
+}
+
 /************************************************************/
 
 
@@ -127,7 +259,7 @@ static void wait_for_end_of_inevitable_transaction(void)
 {
     long i;
  restart:
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         struct stm_priv_segment_info_s *other_pseg = get_priv_segment(i);
         if (other_pseg->transaction_state == TS_INEVITABLE) {
             /* handle this case like a contention: it will either
@@ -163,8 +295,8 @@ static bool acquire_thread_segment(stm_thread_local_t *tl)
     /* Look for the next free segment.  If there is none, wait for
        the condition variable. */
     int retries;
-    for (retries = 0; retries < NB_SEGMENTS; retries++) {
-        num = (num % NB_SEGMENTS) + 1;
+    for (retries = 0; retries < nb_segments; retries++) {
+        num = (num % nb_segments) + 1;
         if (sync_ctl.in_use1[num - 1] == 0) {
             /* we're getting 'num', a different number. */
             dprintf(("acquired different segment: %d->%d\n", tl->associated_segment_num, num));
@@ -219,7 +351,7 @@ static bool _seems_to_be_running_transaction(void)
 bool _stm_in_transaction(stm_thread_local_t *tl)
 {
     int num = tl->associated_segment_num;
-    assert(1 <= num && num <= NB_SEGMENTS);
+    assert(1 <= num && num <= nb_segments);
     return get_segment(num)->running_thread == tl;
 }
 
@@ -274,7 +406,7 @@ static void signal_everybody_to_pause_running(void)
     assert(_has_mutex());
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         if (get_segment(i)->nursery_end == NURSERY_END)
             get_segment(i)->nursery_end = NSE_SIGPAUSE;
     }
@@ -282,16 +414,20 @@ static void signal_everybody_to_pause_running(void)
     pause_signalled = true;
 }
 
-static inline long count_other_threads_sp_running(void)
+static inline long count_other_threads_sp_running(bool include_committing)
 {
-    /* Return the number of other threads in SP_RUNNING.
-       Asserts that SP_RUNNING threads still have the NSE_SIGxxx. */
+    /* Return the number of other threads in SP_RUNNING, and also
+       in SP_COMMITTING if 'include_committing'.
+       Asserts that these threads still have the NSE_SIGxxx. */
     long i;
     long result = 0;
     int my_num = STM_SEGMENT->segment_num;
 
-    for (i = 1; i <= NB_SEGMENTS; i++) {
-        if (i != my_num && get_priv_segment(i)->safe_point == SP_RUNNING) {
+    for (i = 1; i <= nb_segments; i++) {
+        if (i == my_num)
+            continue;
+        uint8_t sp = get_priv_segment(i)->safe_point;
+        if (sp == SP_RUNNING || (sp == SP_COMMITTING && include_committing)) {
             assert(get_segment(i)->nursery_end <= _STM_NSE_SIGNAL_MAX);
             result++;
         }
@@ -307,12 +443,12 @@ static void remove_requests_for_safe_point(void)
     assert((_safe_points_requested = false, 1));
 
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         assert(get_segment(i)->nursery_end != NURSERY_END);
         if (get_segment(i)->nursery_end == NSE_SIGPAUSE)
             get_segment(i)->nursery_end = NURSERY_END;
     }
-    cond_broadcast(C_REQUEST_REMOVED);
+    broadcast_request_removed();
 }
 
 static void enter_safe_point_if_requested(void)
@@ -322,6 +458,10 @@ static void enter_safe_point_if_requested(void)
 
     assert(_seems_to_be_running_transaction());
     assert(_has_mutex());
+
+    /* either SP_RUNNING or SP_COMMITTING, restored after waiting */
+    uint8_t previous_safe_point = STM_PSEGMENT->safe_point;
+
     while (1) {
         if (must_abort())
             abort_with_mutex();
@@ -349,8 +489,8 @@ static void enter_safe_point_if_requested(void)
         timing_event(STM_SEGMENT->running_thread, STM_WAIT_SYNC_PAUSE);
         cond_signal(C_AT_SAFE_POINT);
         STM_PSEGMENT->safe_point = SP_WAIT_FOR_C_REQUEST_REMOVED;
-        cond_wait(C_REQUEST_REMOVED);
-        STM_PSEGMENT->safe_point = SP_RUNNING;
+        wait_for_request_removed();
+        STM_PSEGMENT->safe_point = previous_safe_point;
         timing_event(STM_SEGMENT->running_thread, STM_WAIT_DONE);
     }
 }
@@ -366,15 +506,21 @@ static void synchronize_all_threads(enum sync_type_e sync_type)
        enter_safe_point_if_requested() above.
     */
     if (UNLIKELY(globally_unique_transaction)) {
-        assert(count_other_threads_sp_running() == 0);
+        assert(count_other_threads_sp_running(true) == 0);
         return;
     }
 
     signal_everybody_to_pause_running();
 
     /* If some other threads are SP_RUNNING, we cannot proceed now.
-       Wait until all other threads are suspended. */
-    while (count_other_threads_sp_running() > 0) {
+       Wait until all other threads are suspended.  With
+       STOP_RUNNING_OTHERS_UNTIL_MUTEX_UNLOCK, the threads that are
+       SP_COMMITTING are left alone: they only touch their own objects
+       until they acquire the mutex themselves. */
+    bool include_committing =
+        (sync_type != STOP_RUNNING_OTHERS_UNTIL_MUTEX_UNLOCK);
+
+    while (count_other_threads_sp_running(include_committing) > 0) {
 
         STM_PSEGMENT->safe_point = SP_WAIT_FOR_C_AT_SAFE_POINT;
         cond_wait(C_AT_SAFE_POINT);
@@ -400,6 +546,44 @@ static void synchronize_all_threads(enum sync_type_e sync_type)
     remove_requests_for_safe_point();    /* => C_REQUEST_REMOVED */
 }
 
+static void enter_commit_phase(void)
+{
+    /* Called from stm_commit_transaction() when no more user code will
+       run in this transaction.  Other threads that commit concurrently
+       don't have to wait for us to reach a safe point any more.
+
+       Why this is safe: until we take the mutex again, we only run
+       minor_collection(true) and
+       push_overflow_objects_from_privatized_pages().  They write (1) our nursery; (2) the objects of our own
+       transaction, i.e. the ones moved out of the nursery and the
+       overflow objects, which no other transaction can reach; and (3)
+       our modified old objects, in our own segment, whose write locks
+       or card locks we hold, and whose pages the write barrier already
+       privatized.  Objects of kind (2) are also copied to the shared
+       pages and to the other segments' private pages, by
+       synchronize_object_now().  Pointers to other old objects are
+       only compared with the nursery and 'young_outside_nursery', and
+       the objects are never read.
+
+       The thread committing with the mutex meanwhile writes, in all
+       segments, only the objects whose write locks or card locks it
+       holds.  So the bytes written by both are disjoint, even if they
+       share a page.  The pages are not remapped either while either
+       thread copies into them: synchronize_object_now() runs with our
+       privatization lock, and page_privatize() takes all of them.
+       Finally, a major collection, which frees objects and reshares
+       pages, also stops the SP_COMMITTING threads (see
+       count_other_threads_sp_running()). */
+    assert(STM_PSEGMENT->safe_point == SP_RUNNING);
+
+    s_mutex_lock();
+    enter_safe_point_if_requested();
+    STM_PSEGMENT->safe_point = SP_COMMITTING;
+    if (pause_signalled)
+        cond_signal(C_AT_SAFE_POINT);
+    s_mutex_unlock();
+}
+
 static void committed_globally_unique_transaction(void)
 {
     assert(globally_unique_transaction);
@@ -7,7 +7,6 @@ static void teardown_sync(void);
 enum cond_type_e {
     C_SEGMENT_FREE,
     C_AT_SAFE_POINT,
-    C_REQUEST_REMOVED,
     C_INEVITABLE,
     C_ABORTED,
     C_TRANSACTION_DONE,
@@ -16,8 +15,16 @@ enum cond_type_e {
 static void s_mutex_lock(void);
 static void s_mutex_unlock(void);
 static void cond_wait(enum cond_type_e);
+static bool cond_wait_timeout(enum cond_type_e, long usec);
 static void cond_signal(enum cond_type_e);
 static void cond_broadcast(enum cond_type_e);
+static void sp_mutex_lock(void);
+static void sp_mutex_unlock(void);
+static void sp_cond_wait(void);
+static void sp_cond_broadcast(void);
+static void wait_for_request_removed(void);
+static void broadcast_request_removed(void);
+static void release_waiting_threads(void);
 #ifndef NDEBUG
 static bool _has_mutex(void);
 #endif
@@ -32,9 +39,11 @@ static void wait_for_end_of_inevitable_transaction(void);
 
 enum sync_type_e {
     STOP_OTHERS_UNTIL_MUTEX_UNLOCK,
+    STOP_RUNNING_OTHERS_UNTIL_MUTEX_UNLOCK,
     STOP_OTHERS_AND_BECOME_GLOBALLY_UNIQUE,
 };
 static void synchronize_all_threads(enum sync_type_e sync_type);
+static void enter_commit_phase(void);
 static void committed_globally_unique_transaction(void);
 
 static bool pause_signalled, globally_unique_transaction;
@@ -34,7 +34,7 @@ static void _set_weakref_in_all_segments(object_t *weakref, object_t *value)
     stm_char *point_to_loc = (stm_char*)WEAKREF_PTR(weakref, size);
 
     long i;
-    for (i = 0; i <= NB_SEGMENTS; i++) {
+    for (i = 0; i <= nb_segments; i++) {
         char *base = get_segment_base(i);
         object_t ** ref_loc = (object_t **)REAL_ADDRESS(base, point_to_loc);
         *ref_loc = value;
@@ -113,7 +113,7 @@ static void stm_move_young_weakrefs(void)
 static void stm_visit_old_weakrefs(void)
 {
     long i;
-    for (i = 1; i <= NB_SEGMENTS; i++) {
+    for (i = 1; i <= nb_segments; i++) {
         struct stm_priv_segment_info_s *pseg = get_priv_segment(i);
         struct list_s *lst;
 
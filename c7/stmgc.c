@@ -17,6 +17,8 @@
 #include "stm/marker.h"
 #include "stm/finalizer.h"
 #include "stm/bag.h"
+#include "stm/nested.h"
+#include "stm/elision.h"
 
 #include "stm/misc.c"
 #include "stm/list.c"
@@ -41,3 +43,5 @@
 #include "stm/finalizer.c"
 #include "stm/hashtable.c"
 #include "stm/bag.c"
+#include "stm/nested.c"
+#include "stm/elision.c"
@@ -9,6 +9,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <limits.h>
 #include <unistd.h>
@@ -31,7 +32,8 @@ typedef TLPREFIX char stm_char;
 struct stm_read_marker_s {
     /* In every segment, every object has a corresponding read marker.
        We assume that objects are at least 16 bytes long, and use
-       their address divided by 16.  The read marker is equal to
+       their address divided by 16 (or by 1 << STM_READMARKER_SHIFT,
+       see below).  The read marker is equal to
        'STM_SEGMENT->transaction_read_version' if and only if the
        object was read in the current transaction.  The nurseries
        also have corresponding read markers, but they are never used. */
@@ -45,6 +47,7 @@ struct stm_segment_info_s {
     stm_char *nursery_current;
     uintptr_t nursery_end;
     struct stm_thread_local_s *running_thread;
+    stm_char *nursery_mark;    /* see stm_should_break_transaction() */
 };
 #define STM_SEGMENT           ((stm_segment_info_t *)4352)
 
@@ -54,6 +57,8 @@ struct stm_shadowentry_s {
     object_t *ss;
 };
 
+struct stm_contention_s;
+
 typedef struct stm_thread_local_s {
     /* every thread should handle the shadow stack itself */
     struct stm_shadowentry_s *shadowstack, *shadowstack_base;
@@ -68,9 +73,19 @@ typedef struct stm_thread_local_s {
     /* after an abort, some details about the abort are stored there.
        (this field is not modified on a successful commit) */
     long last_abort__bytes_in_nursery;
+    /* ...and the work lost, as estimated for 'work' in stm_contention_t.
+       'total_aborted_work' is the sum for all the aborts of this thread
+       (these two fields are cleared by stm_register_thread_local()). */
+    long last_abort__work;
+    long total_aborted_work;
+    /* the contention management policy of this thread, or NULL to use
+       the global one (see stm_set_contention_policy()) */
+    void (*contention_policy)(struct stm_contention_s *);
     /* the next fields are handled internally by the library */
     int associated_segment_num;
     int thread_local_counter;
+    long transaction_length;
+    long aborts_in_a_row;
     struct stm_thread_local_s *prev, *next;
     void *creating_pthread[2];
 } stm_thread_local_t;
@@ -95,6 +110,7 @@ char *_stm_real_address(object_t *o);
 bool _stm_was_read(object_t *obj);
 bool _stm_was_written(object_t *obj);
 bool _stm_was_written_card(object_t *obj);
+bool _stm_was_read_card(object_t *obj, uintptr_t index);
 uintptr_t _stm_get_private_page(uintptr_t pagenum);
 bool _stm_in_transaction(stm_thread_local_t *tl);
 char *_stm_get_segment_base(long index);
@@ -104,9 +120,14 @@ int _stm_largemalloc_resize_arena(size_t new_size);
 char *_stm_largemalloc_data_start(void);
 char *_stm_large_malloc(size_t request_size);
 void _stm_large_free(char *data);
+char *_stm_large_malloc_from_reserve(char **reserve, size_t request_size);
+void _stm_large_release_reserve(char **reserve);
 void _stm_large_dump(void);
 bool (*_stm_largemalloc_keep)(char *data);
 void _stm_largemalloc_sweep(void);
+void _stm_largemalloc_sweep_start(void);
+void _stm_largemalloc_sweep_finish(void);
+bool _stm_largemalloc_sweep_pending(void);
 void _stm_start_safe_point(void);
 void _stm_stop_safe_point(void);
 void _stm_set_nursery_free_count(uint64_t free_count);
@@ -117,6 +138,8 @@ object_t *_stm_enum_modified_old_objects(long index);
 object_t *_stm_enum_objects_pointing_to_nursery(long index);
 object_t *_stm_enum_old_objects_with_cards(long index);
 uint64_t _stm_total_allocated(void);
+void _stm_request_major_collection(void);
+bool _stm_major_marking_in_progress(void);
 #endif
 
 #define _STM_GCFLAG_WRITE_BARRIER      0x01
@@ -125,6 +148,20 @@ uint64_t _stm_total_allocated(void);
 #define _STM_MIN_CARD_COUNT            17
 #define _STM_MIN_CARD_OBJ_SIZE         (_STM_CARD_SIZE * _STM_MIN_CARD_COUNT)
 #define _STM_NSE_SIGNAL_MAX            7
+#define _STM_READSUMMARY_START         8192
+#define _STM_READSUMMARY_SHIFT         12
+
+/* Compile with -DSTM_READMARKER_SHIFT=6 to have only one read marker
+   per 64 bytes, which makes the read markers 4 times smaller, at the
+   cost of false conflicts between objects in the same 64 bytes.
+   Everything that emits read barriers (e.g. a JIT) must use the same
+   value. */
+#ifndef STM_READMARKER_SHIFT
+# define STM_READMARKER_SHIFT          4
+#endif
+#if STM_READMARKER_SHIFT < 4 || STM_READMARKER_SHIFT > 8
+# error "STM_READMARKER_SHIFT must be between 4 and 8"
+#endif
 #define _STM_FAST_ALLOC           (66*1024)
 
 
@@ -145,8 +182,27 @@ uint64_t _stm_total_allocated(void);
    parallel, in maximum).  If you try to start transactions in more
    threads than the number of segments, it will block, waiting for the
    next segment to become free.
+
+   The number is chosen at run-time by stm_setup(): it is taken from the
+   environment variable STM_NB_SEGMENTS if it is set, and otherwise it
+   is the default STM_NB_SEGMENTS below.  It can be at most
+   STM_NB_SEGMENTS_MAX, which can be changed at compile-time (up to 64).
 */
 #define STM_NB_SEGMENTS    4
+#ifndef STM_NB_SEGMENTS_MAX
+# define STM_NB_SEGMENTS_MAX    32
+#endif
+
+/* Maximum size of the heap, in MB.  This much address space is reserved
+   in every segment, but the memory is only used as the heap grows, and
+   the GC's own tables are proportional to the part actually in use.
+   Like the number of segments, it is chosen at run-time by stm_setup():
+   it is taken from the environment variable STM_HEAP_SIZE_MB if it is
+   set, and otherwise it is the default STM_HEAP_SIZE_MB below.
+*/
+#ifndef STM_HEAP_SIZE_MB
+# define STM_HEAP_SIZE_MB    2500
+#endif
 
 
 /* Structure of objects
@@ -174,12 +230,42 @@ struct object_s {
    stm_read() needs to be called again.  It can be omitted if
    stm_write() is called, or immediately after getting the object from
    stm_allocate(), as long as the rules above are respected.
+
+   If compiled with STM_READ_SUMMARY, it also marks the whole 4096-byte
+   page of 'obj' as read in a compact summary, which lets the commit of
+   other threads skip most of the read markers.  Everything that emits
+   read barriers (e.g. a JIT) must then do the same second store.
+
+   If compiled with STM_CONDITIONAL_READ_BARRIER, the stores are only
+   done if the read marker is not already up-to-date.  This is a load
+   and a compare instead of a store in loops that read the same
+   objects again, which leaves the cache lines of the read markers
+   clean.  See demo/bench_read_barrier.c.
 */
+__attribute__((always_inline))
+static inline void _stm_set_read_marker(stm_read_marker_t *marker,
+                                        uint8_t read_version)
+{
+#ifdef STM_CONDITIONAL_READ_BARRIER
+    if (marker->rm == read_version)
+        return;
+#endif
+    marker->rm = read_version;
+}
+
 __attribute__((always_inline))
 static inline void stm_read(object_t *obj)
 {
-    ((stm_read_marker_t *)(((uintptr_t)obj) >> 4))->rm =
-        STM_SEGMENT->transaction_read_version;
+    uint8_t read_version = STM_SEGMENT->transaction_read_version;
+    _stm_set_read_marker(
+        (stm_read_marker_t *)(((uintptr_t)obj) >> STM_READMARKER_SHIFT),
+        read_version);
+#ifdef STM_READ_SUMMARY
+    _stm_set_read_marker(
+        (stm_read_marker_t *)(_STM_READSUMMARY_START +
+                              (((uintptr_t)obj) >> _STM_READSUMMARY_SHIFT)),
+        read_version);
+#endif
 }
 
 /* The write barrier must be called *before* doing any change to the
@@ -208,6 +294,15 @@ static inline void stm_write_card(object_t *obj, uintptr_t index)
         _stm_write_slowpath_card(obj, index);
 }
 
+/* A read barrier for only the items in range(start, stop) of an array
+   object, in the same units as stm_write_card().  It marks the cards
+   of these items as read, and a transaction that only changes other
+   cards of the object with stm_write_card() does not conflict with us.
+   On objects that don't use cards, it is the same as stm_read(obj).
+   Not inline: it is meant for bulk reads of big arrays.
+*/
+void stm_read_range(object_t *obj, uintptr_t start, uintptr_t stop);
+
 /* Must be provided by the user of this library.
    The "size rounded up" must be a multiple of 8 and at least 16.
    "Tracing" an object means enumerating all GC references in it,
@@ -271,10 +366,14 @@ object_t *stm_allocate_weakref(ssize_t size_rounded_up);
 
 /* stm_setup() needs to be called once at the beginning of the program.
    stm_teardown() can be called at the end, but that's not necessary
-   and rather meant for tests.
+   and rather meant for tests.  stm_setup_nb_segments() is the same as
+   stm_setup() with an explicit number of segments (0 for the default).
+   stm_get_nb_segments() returns the number of segments in use.
  */
 void stm_setup(void);
+void stm_setup_nb_segments(long nb_segments);
 void stm_teardown(void);
+long stm_get_nb_segments(void);
 
 /* The size of each shadow stack, in number of entries.
    Must be big enough to accomodate all STM_PUSH_ROOTs! */
@@ -320,6 +419,21 @@ void stm_unregister_thread_local(stm_thread_local_t *tl);
 #define stm_rewind_jmp_enum_shadowstack(tl, callback)    \
     rewind_jmp_enum_shadowstack(&(tl)->rjthread, callback)
 
+/* Leaving the outermost 'rewind_jmp_buf' forgets how to abort the
+   current transaction, so it must be inevitable by then.  To avoid
+   that, e.g. in a thread whose transactions run across callbacks
+   called by C code, call stm_rewind_jmp_enter_outermost() once with
+   the top of the part of the stack that the callbacks return to, like
+   __builtin_frame_address(0) in the thread's main function.  The rest
+   of the stack up to there is then saved too, call/cc-style, and the
+   transaction can still abort after the callback returned.  These
+   frames must not contain data that other threads change.  Call
+   stm_rewind_jmp_leave_outermost() outside any transaction. */
+#define stm_rewind_jmp_enter_outermost(tl, stack_top)    \
+    rewind_jmp_enter_outermost(&(tl)->rjthread, stack_top, (tl)->shadowstack)
+#define stm_rewind_jmp_leave_outermost(tl)               \
+    rewind_jmp_leave_outermost(&(tl)->rjthread)
+
 /* Starting and ending transactions.  stm_read(), stm_write() and
    stm_allocate() should only be called from within a transaction.
    The stm_start_transaction() call returns the number of times it
@@ -327,12 +441,70 @@ void stm_unregister_thread_local(stm_thread_local_t *tl);
    aborted and restarted this number of times. */
 long stm_start_transaction(stm_thread_local_t *tl);
 void stm_start_inevitable_transaction(stm_thread_local_t *tl);
+
+/* Like stm_start_transaction(), but for a transaction that only reads.
+   Calling stm_write() or allocating objects in it is a fatal error.
+   Any transaction that didn't write to old objects commits without
+   pausing the other threads, but this one never triggers a major
+   collection either, unless stm_hashtable_read() had to add entries
+   to a hashtable. */
+long stm_start_readonly_transaction(stm_thread_local_t *tl);
+
+/* If a thread aborts 'max_aborts' times in a row, its next transaction
+   is started directly as inevitable, so that it cannot abort again.
+   The default is 0, meaning never.  Independently, if
+   'max_backoff_usec' is not 0, then after the n-th abort in a row the
+   thread waits 2**n microseconds before restarting, but not longer
+   than 'max_backoff_usec'. */
+void stm_set_max_aborts(long max_aborts);
+void stm_set_abort_backoff(long max_backoff_usec);
 void stm_commit_transaction(void);
 
 /* Abort the currently running transaction.  This function never
    returns: it jumps back to the stm_start_transaction(). */
 void stm_abort_transaction(void) __attribute__((noreturn));
 
+/* Closed-nested transactions.  Inside a transaction, a part of the
+   code can run as an inner transaction:
+
+       stm_nested_t nested;
+       if (stm_begin_nested(&tl, &nested) == 0) {
+           ...
+           stm_commit_nested(&nested);
+       }
+       else {
+           ...    the inner transaction was rolled back
+       }
+
+   If the inner transaction loses a write-write conflict, or calls
+   stm_abort_nested(), then only its own changes are undone and
+   stm_begin_nested() returns a second time, with 1; it is up to the
+   caller to retry or not.  All other conflicts still abort the whole
+   transaction.  Like with setjmp(), the local variables changed by
+   the inner transaction have an unspecified value after a rollback,
+   and the shadowstack goes back to its depth at stm_begin_nested().
+   Inner transactions can themselves be nested.  stm_begin_nested()
+   does a minor collection, so it should not be called too often.
+   Changes to stm_bag_t are not undone by a rollback.
+*/
+typedef struct stm_nested_s {
+    void *jmpbuf[5];
+    /* the next fields are handled internally by the library */
+    struct stm_nested_s *prev;
+    struct stm_shadowentry_s *shadowstack;
+    rewind_jmp_buf *rjhead;
+    object_t *thread_local_obj;
+    uintptr_t modified_old_objects_count;
+    uintptr_t nested_undo_count;
+    long elided_locks;
+} stm_nested_t;
+
+void _stm_begin_nested(stm_thread_local_t *tl, stm_nested_t *nested);
+#define stm_begin_nested(tl, nested)                                  \
+    (_stm_begin_nested(tl, nested), __builtin_setjmp((nested)->jmpbuf))
+void stm_commit_nested(stm_nested_t *nested);
+void stm_abort_nested(stm_nested_t *nested) __attribute__((noreturn));
+
 /* Turn the current transaction inevitable.
    The stm_become_inevitable() itself may still abort. */
 #ifdef STM_NO_AUTOMATIC_SETJMP
@@ -349,6 +521,20 @@ static inline void stm_become_inevitable(stm_thread_local_t *tl,
         _stm_become_inevitable(msg);
 }
 
+/* Returns true when the current transaction has done enough work and
+   should be committed, at the next convenient point.  The work is
+   measured like 'work' in stm_contention_t.  Each thread has its own
+   target, which adapts: after an abort, it drops a bit below the work
+   that was lost, so that the retry commits just before reaching the
+   conflict; after a commit, it doubles, up to the maximum given to
+   stm_set_transaction_length().  It is also true as soon as the
+   transaction is inevitable. */
+static inline int stm_should_break_transaction(void) {
+    return ((intptr_t)STM_SEGMENT->nursery_current >=
+            (intptr_t)STM_SEGMENT->nursery_mark);
+}
+void stm_set_transaction_length(long length_max);
+
 /* Forces a safe-point if needed.  Normally not needed: this is
    automatic if you call stm_allocate(). */
 static inline void stm_safe_point(void) {
@@ -359,6 +545,20 @@ static inline void stm_safe_point(void) {
 /* Forces a collection. */
 void stm_collect(long level);
 
+/* Bound the pauses of the major collections.  If 'microseconds' is
+   not 0, the marking phase is done in slices of roughly this duration,
+   interleaved with the execution of the transactions.  The last slice
+   and the sweeping are not bounded.  The default is 0: every major
+   collection is done in a single pause.  stm_collect(1) always does a
+   complete major collection. */
+void stm_set_major_gc_pause_budget(long microseconds);
+
+/* The marking of a major collection is done in parallel by the thread
+   doing the collection and by the threads stopped at a safe point in
+   the other segments, up to 'num_threads' threads in total.  The
+   default is 0, meaning the number of CPUs. */
+void stm_set_major_gc_marking_threads(long num_threads);
+
 /* Prepare an immortal "prebuilt" object managed by the GC.  Takes a
    pointer to an 'object_t', which should not actually be a GC-managed
    structure but a real static structure.  Returns the equivalent
@@ -406,6 +606,22 @@ long stm_call_on_commit(stm_thread_local_t *, void *key, void callback(void *));
 void stm_become_globally_unique_transaction(stm_thread_local_t *tl,
                                             const char *msg);
 
+/* Lock elision: a critical section protected by a user lock can run
+   speculatively in the current transaction, instead of making it
+   inevitable.  Any object can be used as the lock.  stm_elide_lock()
+   only reads it, so that the transaction conflicts with any thread
+   that acquires the lock for real.  After 'retries' aborts in a row
+   (default 3), or if the transaction is already inevitable, the lock
+   is acquired for real instead: the transaction becomes inevitable
+   and writes to the lock object.  Between stm_elide_lock() and
+   stm_elide_unlock(), which can be nested,
+   stm_should_break_transaction() is false, and committing is an
+   error.  A rollback of a nested transaction releases the locks taken
+   inside it. */
+void stm_elide_lock(stm_thread_local_t *tl, object_t *lock);
+void stm_elide_unlock(stm_thread_local_t *tl, object_t *lock);
+void stm_set_lock_elision_retries(long retries);
+
 
 /* Profiling events.  In the comments: content of the markers, if any */
 enum stm_event_e {
@@ -479,6 +695,62 @@ int stm_set_timing_log(const char *profiling_file_name,
                        int expand_marker(stm_loc_marker_t *, char *, int));
 
 
+/* Contention management.  When the transaction of this thread conflicts
+   with the transaction of another thread (see the start of
+   stm/contention.c), a policy function decides what to do.  It reads
+   the first fields below and chooses one of three outcomes: abort the
+   other transaction ('abort_other'); abort this one; or pause until
+   the other commits ('try_sleep').  Pausing is not possible for
+   write-write contentions, and an inevitable transaction is never
+   aborted, whatever the policy says.  The policy is called with an
+   internal lock acquired: it must not call any other stm_*() function.
+*/
+typedef struct stm_contention_s {
+    enum stm_event_e kind;          /* one of the STM_CONTENTION_xxx */
+    stm_thread_local_t *other_tl;   /* the thread of the other transaction */
+    uint64_t start_time;            /* start times, increasing: the older */
+    uint64_t other_start_time;      /*   transaction has the smaller one */
+    uint64_t work, other_work;      /* the work done so far, in bytes:
+                                       nursery used, plus some amount for
+                                       each object modified and page
+                                       privatized */
+    long num_aborts;                /* aborts so far of this transaction */
+    long wait_left_usec;            /* what is left of the wait budget
+                                       (stm_set_contention_wait_budget())
+                                       for this transaction, or -1 if
+                                       there is no limit */
+    /* the result, initialized to "abort this transaction": */
+    bool abort_other;
+    bool try_sleep;
+    long backoff_usec;   /* if aborting this transaction, wait that many
+                            microseconds before restarting (default 1) */
+} stm_contention_t;
+typedef void stm_contention_policy_fn(stm_contention_t *);
+
+/* The predefined policies.  The default is stm_cm_pause_if_younger
+   (or stm_cm_abort_the_younger in tests). */
+void stm_cm_abort_the_younger(stm_contention_t *);
+void stm_cm_pause_if_younger(stm_contention_t *);
+void stm_cm_always_abort_myself(stm_contention_t *);
+void stm_cm_always_abort_other(stm_contention_t *);
+void stm_cm_always_wait_for_other_thread(stm_contention_t *);
+void stm_cm_timestamp_backoff(stm_contention_t *);
+void stm_cm_karma(stm_contention_t *);
+void stm_cm_polite(stm_contention_t *);
+
+/* Set the policy for all threads whose 'contention_policy' is NULL.
+   Passing NULL restores the default. */
+void stm_set_contention_policy(stm_contention_policy_fn *policy);
+
+/* Bound the total time that a transaction can pause in contention
+   management.  Once it has paused that many microseconds, the policy's
+   choice to pause is ignored and its 'abort_other' decides instead.
+   A negative value means no limit, which is the default; 0 means that
+   the transactions never pause.  The policy sees what is left of the
+   budget in 'wait_left_usec', with the same convention. */
+void stm_set_contention_wait_budget(long microseconds);
+
+
 /* Convenience macros to push the markers into the shadowstack */
 #define STM_PUSH_MARKER(tl, odd_num, p)   do {  \
     uintptr_t _odd_num = (odd_num);             \
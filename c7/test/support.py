@@ -2,6 +2,13 @@ import os
 import cffi, weakref
 from common import parent_dir, source_files
 
+os.environ.pop('STM_NB_SEGMENTS', None)    # tests expect the default
+os.environ.pop('STM_HEAP_SIZE_MB', None)
+
+# the library is built with STM_READ_SUMMARY, unless the environment
+# says STM_TEST_READ_SUMMARY=0: see test_no_read_summary.py
+READ_SUMMARY = os.environ.get('STM_TEST_READ_SUMMARY', '1') != '0'
+
 # ----------
 
 ffi = cffi.FFI()
@@ -11,18 +18,24 @@ typedef ... object_t;
 #define STM_NB_SEGMENTS ...
 #define _STM_FAST_ALLOC ...
 #define _STM_GCFLAG_WRITE_BARRIER ...
+#define _STM_GCFLAG_CARDS_SET ...
 #define _STM_CARD_SIZE ...
 
 struct stm_shadowentry_s {
     object_t *ss;
 };
 
+typedef struct stm_contention_s stm_contention_t;
+
 typedef struct {
     struct stm_shadowentry_s *shadowstack, *shadowstack_base;
     object_t *thread_local_obj;
     char *mem_clear_on_abort;
     size_t mem_bytes_to_clear_on_abort;
     long last_abort__bytes_in_nursery;
+    long last_abort__work;
+    long total_aborted_work;
+    void (*contention_policy)(stm_contention_t *);
     int associated_segment_num;
     ...;
 } stm_thread_local_t;
@@ -38,6 +51,8 @@ object_t *_stm_allocate_old(ssize_t size_rounded_up);
 
 
 void stm_setup(void);
+void stm_setup_nb_segments(long nb_segments);
+long stm_get_nb_segments(void);
 void stm_teardown(void);
 void stm_register_thread_local(stm_thread_local_t *tl);
 void stm_unregister_thread_local(stm_thread_local_t *tl);
@@ -49,6 +64,9 @@ bool _checked_stm_write_card(object_t *obj, uintptr_t index);
 bool _stm_was_read(object_t *obj);
 bool _stm_was_written(object_t *obj);
 bool _stm_was_written_card(object_t *obj);
+bool _stm_was_read_card(object_t *obj, uintptr_t index);
+char _stm_write_slowpath_card_extra(object_t *);
+void stm_read_range(object_t *obj, uintptr_t start, uintptr_t stop);
 char *_stm_real_address(object_t *obj);
 char *_stm_get_segment_base(long index);
 bool _stm_in_transaction(stm_thread_local_t *tl);
@@ -58,6 +76,7 @@ int _stm_get_flags(object_t *obj);
 
 void clear_jmpbuf(stm_thread_local_t *tl);
 long stm_start_transaction(stm_thread_local_t *tl);
+long stm_start_readonly_transaction(stm_thread_local_t *tl);
 bool _check_commit_transaction(void);
 bool _check_abort_transaction(void);
 bool _check_become_inevitable(stm_thread_local_t *tl);
@@ -83,10 +102,15 @@ int _stm_largemalloc_resize_arena(size_t new_size);
 char *_stm_largemalloc_data_start(void);
 char *_stm_large_malloc(size_t request_size);
 void _stm_large_free(char *data);
+char *_stm_large_malloc_from_reserve(char **reserve, size_t request_size);
+void _stm_large_release_reserve(char **reserve);
 void _stm_large_dump(void);
 void *memset(void *s, int c, size_t n);
 bool (*_stm_largemalloc_keep)(char *data);
 void _stm_largemalloc_sweep(void);
+void _stm_largemalloc_sweep_start(void);
+void _stm_largemalloc_sweep_finish(void);
+bool _stm_largemalloc_sweep_pending(void);
 
 ssize_t stmcb_size_rounded_up(struct object_s *obj);
 
@@ -100,6 +124,9 @@ object_t *_stm_enum_old_objects_with_cards(long index);
 
 void stm_collect(long level);
 uint64_t _stm_total_allocated(void);
+void _stm_request_major_collection(void);
+bool _stm_major_marking_in_progress(void);
+void stm_set_major_gc_pause_budget(long microseconds);
 
 long stm_identityhash(object_t *obj);
 long stm_id(object_t *obj);
@@ -157,6 +184,45 @@ stmcb_timing_event_fn stmcb_timing_event;
 int stm_set_timing_log(const char *profiling_file_name,
                        int expand_marker(stm_loc_marker_t *, char *, int));
 
+struct stm_contention_s {
+    enum stm_event_e kind;
+    stm_thread_local_t *other_tl;
+    uint64_t start_time;
+    uint64_t other_start_time;
+    uint64_t work, other_work;
+    long num_aborts;
+    long wait_left_usec;
+    bool abort_other;
+    bool try_sleep;
+    long backoff_usec;
+};
+typedef void stm_contention_policy_fn(stm_contention_t *);
+void stm_cm_abort_the_younger(stm_contention_t *);
+void stm_cm_pause_if_younger(stm_contention_t *);
+void stm_cm_always_abort_myself(stm_contention_t *);
+void stm_cm_always_abort_other(stm_contention_t *);
+void stm_cm_always_wait_for_other_thread(stm_contention_t *);
+void stm_cm_timestamp_backoff(stm_contention_t *);
+void stm_cm_karma(stm_contention_t *);
+void stm_cm_polite(stm_contention_t *);
+void stm_set_contention_wait_budget(long microseconds);
+bool stm_should_break_transaction(void);
+void stm_set_transaction_length(long length_max);
+void stm_set_max_aborts(long max_aborts);
+void stm_set_abort_backoff(long max_backoff_usec);
+
+typedef struct {
+    ...;
+} stm_nested_t;
+void _stm_begin_nested(stm_thread_local_t *tl, stm_nested_t *nested);
+void stm_commit_nested(stm_nested_t *nested);
+int _check_nested_write(stm_nested_t *nested, object_t *obj);
+int _check_abort_nested(stm_nested_t *nested);
+bool _check_elide_lock(stm_thread_local_t *tl, object_t *lock);
+void stm_elide_unlock(stm_thread_local_t *tl, object_t *lock);
+void stm_set_lock_elision_retries(long retries);
+void stm_set_contention_policy(stm_contention_policy_fn *policy);
+
 void stm_push_marker(stm_thread_local_t *, uintptr_t, object_t *);
 void stm_update_marker_num(stm_thread_local_t *, uintptr_t);
 void stm_pop_marker(stm_thread_local_t *);
@@ -263,6 +329,10 @@ bool _check_become_globally_unique_transaction(stm_thread_local_t *tl) {
     CHECKED(stm_become_globally_unique_transaction(tl, "TESTGUT"));
 }
 
+bool _check_elide_lock(stm_thread_local_t *tl, object_t *lock) {
+    CHECKED(stm_elide_lock(tl, lock));
+}
+
 object_t *hashtable_read_result;
 
 bool _check_hashtable_read(object_t *hobj, stm_hashtable_t *h, uintptr_t key)
@@ -276,8 +346,31 @@ bool _check_hashtable_write(object_t *hobj, stm_hashtable_t *h, uintptr_t key,
     CHECKED(stm_hashtable_write(hobj, h, key, nvalue, tl));
 }
 
+bool _check_abort_nested_1(stm_nested_t *nested) {
+    CHECKED(stm_abort_nested(nested));
+}
+
 #undef CHECKED
 
+/* these return 2 if the nested transaction was rolled back */
+int _check_nested_write(stm_nested_t *nested, object_t *object) {
+    int res;
+    if (__builtin_setjmp(nested->jmpbuf) == 0)
+        res = _checked_stm_write(object);
+    else
+        res = 2;
+    return res;
+}
+
+int _check_abort_nested(stm_nested_t *nested) {
+    int res;
+    if (__builtin_setjmp(nested->jmpbuf) == 0)
+        res = _check_abort_nested_1(nested);
+    else
+        res = 2;
+    return res;
+}
+
 
 void _set_type_id(object_t *obj, uint32_t h)
 {
@@ -483,7 +576,7 @@ long current_segment_num(void)
                     ('STM_NO_COND_WAIT', '1'),
                     ('STM_DEBUGPRINT', '1'),
                     ('GC_N_SMALL_REQUESTS', str(GC_N_SMALL_REQUESTS)), #check
-                    ],
+                    ] + [('STM_READ_SUMMARY', '1')] * READ_SUMMARY,
      undef_macros=['NDEBUG'],
      include_dirs=[parent_dir],
      extra_compile_args=['-g', '-O0', '-Werror', '-ferror-limit=1'],
@@ -495,6 +588,7 @@ WORD = 8
 HDR = lib.SIZEOF_MYOBJ
 assert HDR == 8
 GCFLAG_WRITE_BARRIER = lib._STM_GCFLAG_WRITE_BARRIER
+GCFLAG_CARDS_SET = lib._STM_GCFLAG_CARDS_SET
 CARD_SIZE = lib._STM_CARD_SIZE # 16b at least
 NB_SEGMENTS = lib.STM_NB_SEGMENTS
 FAST_ALLOC = lib._STM_FAST_ALLOC
@@ -503,6 +597,9 @@ lib.stm_hashtable_entry_userdata = 421418
 class Conflict(Exception):
     pass
 
+class NestedRollback(Exception):
+    pass
+
 class EmptyStack(Exception):
     pass
 
@@ -616,6 +713,13 @@ def stm_write(o):
     if lib._checked_stm_write(o):
         raise Conflict()
 
+def stm_write_nested(nested, o):
+    res = lib._check_nested_write(nested, o)
+    if res == 1:
+        raise Conflict()
+    if res == 2:
+        raise NestedRollback()
+
 def stm_write_card(o, index):
     if lib._checked_stm_write_card(o, index):
         raise Conflict()
@@ -629,6 +733,12 @@ def stm_was_written(o):
 def stm_was_written_card(o):
     return lib._stm_was_written_card(o)
 
+def stm_read_range(o, start, stop):
+    lib.stm_read_range(o, start, stop)
+
+def stm_was_read_card(o, index):
+    return lib._stm_was_read_card(o, index)
+
 
 def stm_start_safe_point():
     lib._stm_start_safe_point()
@@ -720,10 +830,13 @@ class BaseTest(object):
     def get_stm_thread_local(self):
         return self.tls[self.current_thread]
 
-    def start_transaction(self):
+    def start_transaction(self, readonly=False):
         tl = self.tls[self.current_thread]
         assert not lib._stm_in_transaction(tl)
-        res = lib.stm_start_transaction(tl)
+        if readonly:
+            res = lib.stm_start_readonly_transaction(tl)
+        else:
+            res = lib.stm_start_transaction(tl)
         assert res == 0
         lib.clear_jmpbuf(tl)
         assert lib._stm_in_transaction(tl)
@@ -749,6 +862,19 @@ class BaseTest(object):
         assert res   # abort_transaction() didn't abort!
         assert not lib._stm_in_transaction(tl)
 
+    def begin_nested(self):
+        tl = self.tls[self.current_thread]
+        nested = ffi.new("stm_nested_t *")
+        lib._stm_begin_nested(tl, nested)
+        return nested
+
+    def commit_nested(self, nested):
+        lib.stm_commit_nested(nested)
+
+    def abort_nested(self, nested):
+        res = lib._check_abort_nested(nested)
+        assert res == 2   # abort_nested() didn't roll back!
+
     def switch(self, thread_num):
         assert thread_num != self.current_thread
         tl = self.tls[self.current_thread]
@@ -807,3 +933,11 @@ class BaseTest(object):
         tl = self.tls[self.current_thread]
         if lib._check_become_globally_unique_transaction(tl):
             raise Conflict()
+
+    def elide_lock(self, lock):
+        tl = self.tls[self.current_thread]
+        if lib._check_elide_lock(tl, lock):
+            raise Conflict()
+
+    def elide_unlock(self, lock):
+        lib.stm_elide_unlock(self.tls[self.current_thread], lock)
@@ -1,5 +1,6 @@
 from support import *
-import py
+import support
+import py, os
 
 class TestBasic(BaseTest):
 
@@ -102,6 +103,27 @@ class TestBasic(BaseTest):
         #
         py.test.raises(Conflict, self.switch, 0) # detects rw conflict
 
+    def test_read_write_same_page_no_conflict(self):
+        lp1 = stm_allocate_old(16)
+        lp2 = stm_allocate_old(16)
+        assert (int(ffi.cast("uintptr_t", lp1)) >> 12 ==
+                int(ffi.cast("uintptr_t", lp2)) >> 12)
+        #
+        self.start_transaction()
+        stm_read(lp1)
+        assert stm_was_read(lp1)
+        assert not stm_was_read(lp2)
+        #
+        self.switch(1)
+        self.start_transaction()
+        stm_write(lp2)
+        stm_set_char(lp2, 'b')
+        self.commit_transaction()   # lp1 was read, but not lp2
+        #
+        self.switch(0)
+        assert stm_get_char(lp2) == 'b'
+        self.commit_transaction()
+
     def test_commit_fresh_objects(self):
         self.start_transaction()
         lp = stm_allocate(16)
@@ -462,3 +484,90 @@ class TestBasic(BaseTest):
         assert self.get_stm_thread_local().last_abort__bytes_in_nursery == 56
         self.abort_transaction()
         assert self.get_stm_thread_local().last_abort__bytes_in_nursery == 0
+
+    def test_readonly_transaction(self):
+        lp1 = stm_allocate_old(16)
+        self.start_transaction()
+        stm_set_char(lp1, 'a')
+        self.commit_transaction()
+        #
+        self.start_transaction(readonly=True)
+        assert stm_get_char(lp1) == 'a'
+        self.commit_transaction()
+        #
+        self.start_transaction()     # not read-only any more
+        stm_set_char(lp1, 'b')
+        self.commit_transaction()
+        self.check_char_everywhere(lp1, 'b')
+
+    def test_readonly_transaction_write_read_conflict(self):
+        lp1 = stm_allocate_old(16)
+        self.switch(1)
+        self.start_transaction()
+        #
+        self.switch(0)
+        self.start_transaction(readonly=True)
+        stm_read(lp1)
+        #
+        self.switch(1)
+        stm_set_char(lp1, 'b')
+        self.commit_transaction()
+        #
+        py.test.raises(Conflict, self.switch, 0)
+        self.start_transaction(readonly=True)
+        assert stm_get_char(lp1) == 'b'
+        self.commit_transaction()
+
+    def test_read_markers_reset_after_255_transactions(self):
+        lp1 = stm_allocate_old(16)            # large objects' range
+        self.start_transaction()
+        lp2 = stm_allocate(16)
+        self.push_root(lp2)
+        stm_minor_collect()
+        lp2 = self.pop_root()                 # small objects' range
+        self.commit_transaction()
+        #
+        self.start_transaction()
+        stm_read(lp1)
+        stm_read(lp2)
+        self.commit_transaction()
+        # the read version goes around, and is the same again
+        for i in range(254):
+            self.start_transaction()
+            self.commit_transaction()
+        self.start_transaction()
+        assert not stm_was_read(lp1)
+        assert not stm_was_read(lp2)
+        stm_read(lp2)
+        assert stm_was_read(lp2)
+        self.commit_transaction()
+
+
+def test_nb_segments():
+    lib.stm_setup_nb_segments(2)
+    try:
+        assert lib.stm_get_nb_segments() == 2
+        tls = [support._allocate_thread_local() for i in range(3)]
+        assert [tl.associated_segment_num for tl in tls] == [1, 2, 1]
+        for tl in tls:
+            lib.stm_unregister_thread_local(tl)
+    finally:
+        lib.stm_teardown()
+
+def test_heap_size():
+    os.environ['STM_HEAP_SIZE_MB'] = '8192'
+    try:
+        lib.stm_setup()
+    finally:
+        del os.environ['STM_HEAP_SIZE_MB']
+    try:
+        assert (lib._stm_get_segment_base(2) -
+                lib._stm_get_segment_base(1)) == 8192 * 1024 * 1024
+        tl = support._allocate_thread_local()
+        lp1 = stm_allocate_old(16)
+        lib.stm_start_transaction(tl)
+        stm_set_char(lp1, 'a')
+        assert not lib._check_commit_transaction()
+        lib.stm_unregister_thread_local(tl)
+    finally:
+        lib.stm_teardown()
@@ -221,3 +221,233 @@ class TestBasic(BaseTest):
         assert stm_get_char(o, 1000+CARD_SIZE*12) == 'e'
 
         self.commit_transaction()
+
+    def test_read_range(self):
+        o = stm_allocate_old_refs(1024)
+        self.start_transaction()
+        stm_read_range(o, 0, 10)
+        assert not stm_was_read(o)
+        assert stm_was_read_card(o, 5)
+        assert not stm_was_read_card(o, 500)
+        #
+        p = stm_allocate_old(16)     # no cards: like stm_read()
+        stm_read_range(p, 0, 1)
+        assert stm_was_read(p)
+        self.commit_transaction()
+
+    def test_read_range_no_conflict_on_other_cards(self):
+        o = stm_allocate_old_refs(1024)
+        self.switch(1)
+        self.start_transaction()     # the older transaction
+        #
+        self.switch(0)
+        self.start_transaction()
+        stm_read_range(o, 0, 10)
+        #
+        self.switch(1)
+        stm_set_ref(o, 500, ffi.NULL, True)
+        self.commit_transaction()
+        #
+        self.switch(0)
+        stm_read_range(o, 20, 30)
+        self.commit_transaction()
+
+    def test_read_range_conflict_on_same_card(self):
+        o = stm_allocate_old_refs(1024)
+        self.switch(1)
+        self.start_transaction()     # the older transaction
+        #
+        self.switch(0)
+        self.start_transaction()
+        stm_read_range(o, 0, 10)
+        #
+        self.switch(1)
+        stm_set_ref(o, 5, ffi.NULL, True)
+        self.commit_transaction()
+        #
+        py.test.raises(Conflict, self.switch, 0)
+
+    @py.test.mark.parametrize("k", range(2))
+    def test_read_range_conflict_on_whole_write(self, k):
+        o = stm_allocate_old_refs(1024)
+        self.switch(1)
+        self.start_transaction()     # the older transaction
+        #
+        self.switch(0)
+        self.start_transaction()
+        stm_read_range(o, 0, 10)
+        #
+        self.switch(1)
+        stm_write(o)
+        if k == 1:
+            # the next write only marks card 500, but the object was
+            # already written as a whole
+            stm_minor_collect()
+            stm_set_ref(o, 500, ffi.NULL, True)
+        self.commit_transaction()
+        #
+        py.test.raises(Conflict, self.switch, 0)
+
+    def test_read_range_markers_reset_after_255_transactions(self):
+        # the read marker of card 5000 is 80000 bytes after the object's,
+        # in another page of read markers
+        o = stm_allocate_old(16 + 5000 * CARD_SIZE)
+        self.start_transaction()
+        stm_read_range(o, 4999 * CARD_SIZE, 4999 * CARD_SIZE + 1)
+        assert stm_was_read_card(o, 4999 * CARD_SIZE)
+        self.commit_transaction()
+        # the read version goes around, and is the same again
+        for i in range(254):
+            self.start_transaction()
+            self.commit_transaction()
+        self.start_transaction()
+        assert not stm_was_read_card(o, 4999 * CARD_SIZE)
+        self.commit_transaction()
+
+    def test_read_range_markers_reset_when_freed_young(self):
+        self.start_transaction()
+        o = stm_allocate_refs(9000)   # young outside nursery
+        stm_read_range(o, 500, 501)
+        assert stm_was_read_card(o, 500)
+        stm_minor_collect()            # frees it
+        assert not stm_was_read_card(o, 500)
+        self.commit_transaction()
+
+    def test_read_range_markers_reset_when_freed_old(self):
+        self.start_transaction()
+        o = stm_allocate_refs(9000)
+        self.push_root(o)
+        stm_minor_collect()
+        o = self.pop_root()
+        self.push_root(o)
+        self.commit_transaction()
+        #
+        self.start_transaction()
+        stm_read_range(o, 500, 501)
+        assert stm_was_read_card(o, 500)
+        self.pop_root()
+        stm_major_collect()            # frees it
+        assert not stm_was_read_card(o, 500)
+        self.commit_transaction()
+
+    def test_card_locks_concurrent_writers(self):
+        o = stm_allocate_old(1000+20*CARD_SIZE)
+        self.start_transaction()
+        stm_set_char(o, 'a', 1000, True)
+        assert modified_old_objects() == [o]
+        #
+        self.switch(1)
+        self.start_transaction()
+        stm_set_char(o, 'b', 1000+CARD_SIZE*10, True)    # another card
+        assert modified_old_objects() == [o]
+        self.commit_transaction()
+        #
+        self.switch(0)
+        stm_set_char(o, 'c', 1000+CARD_SIZE*12, True)
+        self.commit_transaction()
+        self.check_char_everywhere(o, 'a', 1000)
+        self.check_char_everywhere(o, 'b', 1000+CARD_SIZE*10)
+        self.check_char_everywhere(o, 'c', 1000+CARD_SIZE*12)
+
+    def test_card_locks_same_card_conflict(self):
+        o = stm_allocate_old(1000+20*CARD_SIZE)
+        self.start_transaction()
+        stm_set_char(o, 'a', 1000, True)
+        #
+        self.switch(1)
+        self.start_transaction()
+        py.test.raises(Conflict, stm_set_char, o, 'b', 1001, True)
+        #
+        self.switch(0)
+        self.commit_transaction()
+        self.check_char_everywhere(o, 'a', 1000)
+
+    @py.test.mark.parametrize("k", range(2))
+    def test_card_locks_whole_write_conflict(self, k):
+        o = stm_allocate_old(1000+20*CARD_SIZE)
+        self.start_transaction()
+        if k == 0:
+            stm_set_char(o, 'a', 1000, True)
+        else:
+            stm_write(o)
+        #
+        self.switch(1)
+        self.start_transaction()
+        if k == 0:
+            py.test.raises(Conflict, stm_write, o)
+        else:
+            py.test.raises(Conflict, stm_set_char, o, 'b', 1000+CARD_SIZE*10,
+                           True)
+
+    def test_card_locks_then_whole_write(self):
+        o = stm_allocate_old(1000+20*CARD_SIZE)
+        self.start_transaction()
+        stm_set_char(o, 'a', 1000, True)
+        stm_set_char(o, 'b', 1000+CARD_SIZE*10, False)   # whole object now
+        assert stm_was_written(o)
+        assert modified_old_objects() == [o]
+        #
+        self.switch(1)
+        self.start_transaction()
+        py.test.raises(Conflict, stm_set_char, o, 'c', 1000+CARD_SIZE*12,
+                       True)
+        #
+        self.switch(0)
+        self.commit_transaction()
+        self.check_char_everywhere(o, 'a', 1000)
+        self.check_char_everywhere(o, 'b', 1000+CARD_SIZE*10)
+
+    def test_card_locks_released_by_abort(self):
+        o = stm_allocate_old(1000+20*CARD_SIZE)
+        self.start_transaction()
+        stm_set_char(o, 'a', 1000, True)
+        self.abort_transaction()
+        #
+        self.switch(1)
+        self.start_transaction()
+        stm_set_char(o, 'b', 1000, False)     # no conflict
+        self.commit_transaction()
+        self.check_char_everywhere(o, 'b', 1000)
+
+    def test_card_locks_conflict_with_whole_read(self):
+        o = stm_allocate_old(1000+20*CARD_SIZE)
+        self.switch(1)
+        self.start_transaction()     # the older transaction
+        #
+        self.switch(0)
+        self.start_transaction()
+        stm_read(o)
+        #
+        self.switch(1)
+        stm_set_char(o, 'a', 1000, True)
+        self.commit_transaction()
+        #
+        py.test.raises(Conflict, self.switch, 0)
+
+    def test_card_locks_no_cards_set(self):
+        o = stm_allocate_old_refs(200)
+        self.start_transaction()
+        p = stm_allocate(64)
+        stm_set_ref(o, 199, p, True)
+        assert not (stm_get_flags(o) & GCFLAG_CARDS_SET)
+        assert stm_was_written_card(o)
+        #
+        self.push_root(o)
+        stm_minor_collect()
+        o = self.pop_root()
+        assert not stm_was_written_card(o)
+        assert not is_in_nursery(stm_get_ref(o, 199))
+        self.commit_transaction()
+
+    def test_card_locks_jit_path_locks_whole_object(self):
+        o = stm_allocate_old(1000+20*CARD_SIZE)
+        self.start_transaction()
+        stm_set_char(o, 'a', 1000, True)
+        # the JIT then writes CARD_MARKED inline, without card locks
+        assert lib._stm_write_slowpath_card_extra(o)
+        assert stm_get_flags(o) & GCFLAG_CARDS_SET
+        #
+        self.switch(1)
+        self.start_transaction()
+        py.test.raises(Conflict, stm_set_char, o, 'b', 1000+CARD_SIZE*10,
+                       True)
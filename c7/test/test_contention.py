@@ -0,0 +1,251 @@
+from support import *
+import py
+
+
+class TestContention(BaseTest):
+
+    def _prepare_write_write(self):
+        self.start_transaction()
+        lp1 = stm_allocate_old(16)
+        self.commit_transaction()
+        #
+        self.start_transaction()
+        stm_write(lp1)     # acquire lock
+        #
+        self.switch(1)
+        self.start_transaction()
+        return lp1
+
+    def test_default_aborts_the_younger(self):
+        lp1 = self._prepare_write_write()
+        py.test.raises(Conflict, stm_write, lp1)
+        #
+        self.switch(0)
+        self.commit_transaction()
+
+    def test_global_policy(self):
+        lib.stm_set_contention_policy(lib.stm_cm_always_abort_other)
+        lp1 = self._prepare_write_write()
+        stm_write(lp1)     # aborts thread 0 instead
+        #
+        py.test.raises(Conflict, self.switch, 0)
+        #
+        lib.stm_set_contention_policy(ffi.NULL)
+        self.start_transaction()
+        py.test.raises(Conflict, stm_write, lp1)
+
+    def test_thread_policy(self):
+        self.tls[1].contention_policy = lib.stm_cm_always_abort_other
+        lp1 = self._prepare_write_write()
+        stm_write(lp1)     # aborts thread 0 instead
+        #
+        py.test.raises(Conflict, self.switch, 0)
+        self.tls[1].contention_policy = ffi.NULL
+
+    def test_thread_policy_overrides_global_policy(self):
+        lib.stm_set_contention_policy(lib.stm_cm_always_abort_other)
+        self.tls[1].contention_policy = lib.stm_cm_always_abort_myself
+        lp1 = self._prepare_write_write()
+        py.test.raises(Conflict, stm_write, lp1)
+        self.tls[1].contention_policy = ffi.NULL
+
+    def test_custom_policy(self):
+        seen = []
+        @ffi.callback("void(stm_contention_t *)")
+        def policy(cm):
+            seen.append((cm.kind, cm.other_tl, cm.start_time,
+                         cm.other_start_time, cm.num_aborts,
+                         cm.abort_other, cm.try_sleep, cm.backoff_usec))
+            cm.abort_other = True
+        lib.stm_set_contention_policy(policy)
+        lp1 = self._prepare_write_write()
+        stm_write(lp1)
+        #
+        [(kind, other_tl, start_time, other_start_time, num_aborts,
+          abort_other, try_sleep, backoff_usec)] = seen
+        assert kind == lib.STM_CONTENTION_WRITE_WRITE
+        assert other_tl == self.tls[0]
+        assert start_time > other_start_time
+        assert num_aborts == 0
+        assert abort_other is False
+        assert try_sleep is False
+        assert backoff_usec == 1
+        #
+        py.test.raises(Conflict, self.switch, 0)
+
+    def test_custom_policy_num_aborts(self):
+        seen = []
+        @ffi.callback("void(stm_contention_t *)")
+        def policy(cm):
+            seen.append(cm.num_aborts)
+        lib.stm_set_contention_policy(policy)
+        lp1 = self._prepare_write_write()
+        py.test.raises(Conflict, stm_write, lp1)
+        self.start_transaction()
+        py.test.raises(Conflict, stm_write, lp1)
+        assert seen == [0, 1]
+        #
+        self.switch(0)
+        self.commit_transaction()
+        self.switch(1)
+        self.start_transaction()
+        stm_write(lp1)
+        self.commit_transaction()
+        #
+        self.switch(0)
+        self.start_transaction()
+        stm_write(lp1)
+        self.switch(1)
+        self.start_transaction()
+        py.test.raises(Conflict, stm_write, lp1)
+        assert seen == [0, 1, 0]     # reset by the commit
+        lib.stm_set_contention_policy(ffi.NULL)
+
+    def test_inevitable_never_aborted(self):
+        lib.stm_set_contention_policy(lib.stm_cm_always_abort_other)
+        lp1 = self._prepare_write_write()
+        self.switch(0)
+        self.become_inevitable()
+        self.switch(1)
+        py.test.raises(Conflict, stm_write, lp1)
+
+    def test_timestamp_backoff(self):
+        cm = ffi.new("stm_contention_t *")
+        cm.start_time = 5
+        cm.other_start_time = 3
+        for n, expected in [(0, 1), (1, 2), (4, 16), (10, 1024), (50, 1024)]:
+            cm.num_aborts = n
+            cm.abort_other = False
+            cm.backoff_usec = 1
+            lib.stm_cm_timestamp_backoff(cm)
+            assert cm.abort_other is False
+            assert cm.backoff_usec == expected
+        #
+        cm.start_time = 2
+        cm.num_aborts = 4
+        cm.backoff_usec = 1
+        lib.stm_cm_timestamp_backoff(cm)
+        assert cm.abort_other is True
+        assert cm.backoff_usec == 1
+
+    def test_aborted_work(self):
+        tl = self.get_stm_thread_local()
+        self.start_transaction()
+        stm_allocate(16)
+        stm_minor_collect()
+        stm_allocate(32)
+        self.abort_transaction()
+        assert tl.last_abort__bytes_in_nursery == 32
+        assert tl.last_abort__work == 48
+        assert tl.total_aborted_work == 48
+        #
+        self.start_transaction()
+        lp1 = stm_allocate_old(16)
+        self.commit_transaction()
+        self.start_transaction()
+        stm_write(lp1)
+        self.abort_transaction()
+        assert tl.last_abort__bytes_in_nursery == 0
+        assert tl.last_abort__work > 0
+        assert tl.total_aborted_work == 48 + tl.last_abort__work
+
+    def test_work_given_to_policy(self):
+        seen = []
+        @ffi.callback("void(stm_contention_t *)")
+        def policy(cm):
+            seen.append((cm.work, cm.other_work))
+        lib.stm_set_contention_policy(policy)
+        lp1 = self._prepare_write_write()
+        stm_allocate(16384)
+        py.test.raises(Conflict, stm_write, lp1)
+        [(work, other_work)] = seen
+        assert work >= 16384
+        # thread 0 modified one object, and privatized its page
+        assert other_work == 128 + 4096
+
+    def test_karma_aborts_the_least_work(self):
+        lib.stm_set_contention_policy(lib.stm_cm_karma)
+        lp1 = self._prepare_write_write()
+        for i in range(10):
+            stm_allocate(1024)
+        stm_write(lp1)     # the younger but bigger transaction wins
+        #
+        py.test.raises(Conflict, self.switch, 0)
+
+    def test_karma_same_work_aborts_the_younger(self):
+        lib.stm_set_contention_policy(lib.stm_cm_karma)
+        lp1 = self._prepare_write_write()
+        py.test.raises(Conflict, stm_write, lp1)
+
+    def test_karma_small_transaction_loses(self):
+        lib.stm_set_contention_policy(lib.stm_cm_karma)
+        self.start_transaction()
+        lp1 = stm_allocate_old(16)
+        self.commit_transaction()
+        #
+        self.start_transaction()
+        for i in range(10):
+            stm_allocate(1024)
+        stm_write(lp1)
+        #
+        self.switch(1)
+        self.start_transaction()
+        py.test.raises(Conflict, stm_write, lp1)
+
+    def test_wait_budget_given_to_policy(self):
+        seen = []
+        @ffi.callback("void(stm_contention_t *)")
+        def policy(cm):
+            seen.append(cm.wait_left_usec)
+        lib.stm_set_contention_policy(policy)
+        lp1 = self._prepare_write_write()
+        py.test.raises(Conflict, stm_write, lp1)
+        assert seen == [-1]      # no limit by default
+        #
+        lib.stm_set_contention_wait_budget(5000)
+        self.start_transaction()
+        py.test.raises(Conflict, stm_write, lp1)
+        assert seen == [-1, 5000]
+
+    def test_wait_budget_boundaries(self):
+        seen = []
+        @ffi.callback("void(stm_contention_t *)")
+        def policy(cm):
+            seen.append(cm.wait_left_usec)
+        lib.stm_set_contention_policy(policy)
+        lib.stm_set_contention_wait_budget(0)      # never pause
+        lp1 = self._prepare_write_write()
+        py.test.raises(Conflict, stm_write, lp1)
+        assert seen == [0]
+        #
+        for budget, expected in [(1, 1), (-1, -1), (-5, -1)]:
+            lib.stm_set_contention_wait_budget(budget)
+            self.start_transaction()
+            py.test.raises(Conflict, stm_write, lp1)
+            assert seen[-1] == expected       # negative: no limit
+
+    def test_polite(self):
+        cm = ffi.new("stm_contention_t *")
+        cm.kind = lib.STM_CONTENTION_WRITE_READ
+        cm.start_time = 5
+        cm.other_start_time = 3
+        cm.wait_left_usec = 100
+        lib.stm_cm_polite(cm)
+        assert cm.try_sleep is True
+        #
+        cm.try_sleep = False
+        cm.wait_left_usec = -1
+        lib.stm_cm_polite(cm)
+        assert cm.try_sleep is True
+        #
+        cm.try_sleep = False
+        cm.wait_left_usec = 0      # budget used up: abort the other
+        lib.stm_cm_polite(cm)
+        assert cm.try_sleep is False
+        assert cm.abort_other is True
+        #
+        cm.kind = lib.STM_CONTENTION_WRITE_WRITE
+        cm.wait_left_usec = 100
+        lib.stm_cm_polite(cm)
+        assert cm.try_sleep is False
+        assert cm.abort_other is False
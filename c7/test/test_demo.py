@@ -17,6 +17,9 @@ class TestDemo:
 
     def test_demo_simple_build(self):   self.make_and_run("build-demo_simple")
     def test_demo_largemalloc_build(self):   self.make_and_run("build-demo_largemalloc")
+    def test_demo_histogram_build(self):   self.make_and_run("build-demo_histogram")
+    def test_demo_card_locks_build(self):   self.make_and_run("build-demo_card_locks")
+    def test_demo_marking_build(self):   self.make_and_run("build-demo_marking")
 
 
 
@@ -0,0 +1,85 @@
+from support import *
+import py
+
+
+class TestElision(BaseTest):
+
+    def test_elide_lock(self):
+        lock = stm_allocate_old(16)
+        self.start_transaction()
+        self.elide_lock(lock)
+        assert stm_was_read(lock)
+        assert not stm_was_written(lock)
+        assert not lib.stm_is_inevitable()
+        self.elide_unlock(lock)
+        self.commit_transaction()
+
+    def test_no_break_inside_elided_lock(self):
+        lock = stm_allocate_old(16)
+        lib.stm_set_transaction_length(1000)
+        self.start_transaction()
+        stm_allocate(496)
+        self.elide_lock(lock)
+        self.elide_lock(lock)        # nested
+        stm_allocate(1024)
+        assert not lib.stm_should_break_transaction()
+        self.elide_unlock(lock)
+        assert not lib.stm_should_break_transaction()
+        self.elide_unlock(lock)
+        assert lib.stm_should_break_transaction()
+
+    def test_acquire_for_real_after_aborts(self):
+        lock = stm_allocate_old(16)
+        lib.stm_set_lock_elision_retries(2)
+        for i in range(2):
+            self.start_transaction()
+            self.elide_lock(lock)
+            assert not lib.stm_is_inevitable()
+            self.abort_transaction()
+        #
+        self.start_transaction()
+        self.elide_lock(lock)
+        assert lib.stm_is_inevitable()
+        assert modified_old_objects() == [lock]
+        assert not lib.stm_should_break_transaction()
+        self.elide_unlock(lock)
+        assert lib.stm_should_break_transaction()   # inevitable
+        self.commit_transaction()
+
+    def test_real_lock_aborts_elided_lock(self):
+        lock = stm_allocate_old(16)
+        self.start_transaction()
+        self.elide_lock(lock)
+        #
+        self.switch(1)
+        lib.stm_set_lock_elision_retries(0)
+        self.start_transaction()
+        self.elide_lock(lock)
+        assert lib.stm_is_inevitable()
+        self.elide_unlock(lock)
+        self.commit_transaction()
+        #
+        py.test.raises(Conflict, self.switch, 0)
+
+    def test_abort_forgets_elided_locks(self):
+        lock = stm_allocate_old(16)
+        lib.stm_set_transaction_length(1000)
+        self.start_transaction()
+        self.elide_lock(lock)
+        self.abort_transaction()
+        #
+        self.start_transaction()
+        stm_allocate(1024)
+        assert lib.stm_should_break_transaction()
+        self.commit_transaction()
+
+    def test_nested_rollback_releases_elided_locks(self):
+        lock = stm_allocate_old(16)
+        lib.stm_set_transaction_length(1000)
+        self.start_transaction()
+        nested = self.begin_nested()
+        self.elide_lock(lock)
+        self.abort_nested(nested)
+        stm_allocate(1024)
+        assert lib.stm_should_break_transaction()
+        self.commit_transaction()
@@ -192,3 +192,105 @@ class TestExtra(BaseTest):
         assert lib.stm_is_inevitable()
         #
         py.test.raises(Conflict, self.switch, 0)
+
+    def test_should_break_transaction(self):
+        lib.stm_set_transaction_length(1000)
+        self.start_transaction()
+        assert not lib.stm_should_break_transaction()
+        stm_allocate(496)
+        assert not lib.stm_should_break_transaction()
+        stm_allocate(496)
+        assert not lib.stm_should_break_transaction()
+        stm_allocate(16)
+        assert lib.stm_should_break_transaction()
+
+    def test_should_break_transaction_after_minor_collection(self):
+        lib.stm_set_transaction_length(10000)
+        self.start_transaction()
+        stm_allocate(4000)
+        stm_minor_collect()
+        stm_allocate(5992)
+        assert not lib.stm_should_break_transaction()
+        stm_allocate(16)
+        assert lib.stm_should_break_transaction()
+
+    def test_should_break_transaction_counts_writes(self):
+        lib.stm_set_transaction_length(5000)
+        self.start_transaction()
+        lp1 = stm_allocate_old(16)
+        self.commit_transaction()
+        #
+        self.start_transaction()
+        stm_write(lp1)      # 128, plus 4096 for privatizing the page
+        stm_allocate(768)
+        assert not lib.stm_should_break_transaction()
+        stm_allocate(16)
+        assert lib.stm_should_break_transaction()
+
+    def test_should_break_transaction_if_inevitable(self):
+        self.start_transaction()
+        assert not lib.stm_should_break_transaction()
+        self.become_inevitable()
+        assert lib.stm_should_break_transaction()
+
+    def test_transaction_length_adapts(self):
+        lib.stm_set_transaction_length(10000)
+        self.start_transaction()
+        stm_allocate(2048)
+        self.abort_transaction()
+        #
+        # shortened to 2048 - 2048/16 = 1920 bytes
+        self.start_transaction()
+        stm_allocate(1904)
+        assert not lib.stm_should_break_transaction()
+        stm_allocate(16)
+        assert lib.stm_should_break_transaction()
+        self.commit_transaction()
+        #
+        # doubled after the commit, to 3841
+        self.start_transaction()
+        stm_allocate(3832)
+        assert not lib.stm_should_break_transaction()
+        stm_allocate(16)
+        assert lib.stm_should_break_transaction()
+        self.commit_transaction()
+        #
+        # but never more than the maximum
+        for i in range(4):
+            self.start_transaction()
+            self.commit_transaction()
+        self.start_transaction()
+        stm_allocate(9984)
+        assert not lib.stm_should_break_transaction()
+        stm_allocate(16)
+        assert lib.stm_should_break_transaction()
+
+    def test_max_aborts(self):
+        lib.stm_set_max_aborts(2)
+        self.start_transaction()
+        assert not lib.stm_is_inevitable()
+        self.abort_transaction()
+        self.start_transaction()
+        assert not lib.stm_is_inevitable()
+        self.abort_transaction()
+        self.start_transaction()
+        assert lib.stm_is_inevitable()    # after 2 aborts in a row
+        self.commit_transaction()
+        #
+        self.start_transaction()
+        assert not lib.stm_is_inevitable()
+        self.abort_transaction()
+        self.start_transaction()
+        assert not lib.stm_is_inevitable()
+        self.commit_transaction()
+
+    def test_abort_backoff(self):
+        import time
+        lib.stm_set_abort_backoff(100000)
+        for i in range(6):
+            self.start_transaction()
+            self.abort_transaction()
+        t0 = time.time()
+        self.start_transaction()
+        self.abort_transaction()     # waits 2**7 microseconds
+        assert time.time() - t0 >= 0.000128
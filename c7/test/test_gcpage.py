@@ -106,6 +106,46 @@ class TestGCPage(BaseTest):
         stm_major_collect()
         assert lib._stm_total_allocated() == 0
 
+    def test_small_objs_in_uniform_pages(self):
+        self.start_transaction()
+        for i in range(10):
+            self.push_root(stm_allocate(48))
+        stm_minor_collect()
+        objs = [self.pop_root() for i in range(10)]
+        addrs = sorted([int(ffi.cast("uintptr_t", o)) for o in objs])
+        assert addrs == [addrs[0] + 48 * i for i in range(10)]
+        assert lib._stm_total_allocated() == (4096 // 48) * 48
+        #
+        keep = [o for o in objs
+                if (int(ffi.cast("uintptr_t", o)) - addrs[0]) % 96 == 0]
+        for o in keep:
+            self.push_root(o)
+        stm_major_collect()
+        assert lib._stm_total_allocated() == 5 * 48
+        for o in keep:
+            self.pop_root()
+        #
+        # the dead objects are reused
+        for i in range(5):
+            self.push_root(stm_allocate(48))
+        stm_minor_collect()
+        new = [int(ffi.cast("uintptr_t", self.pop_root())) for i in range(5)]
+        assert sorted(new) == sorted(addrs[1::2])
+
+    def test_small_objs_page_freed(self):
+        self.start_transaction()
+        self.push_root(stm_allocate(16))
+        stm_minor_collect()
+        o1 = self.pop_root()
+        page1 = stm_get_obj_pages(o1)
+        stm_major_collect()
+        assert lib._stm_total_allocated() == 0
+        # the page can be reused for another size of objects
+        self.push_root(stm_allocate(24))
+        stm_minor_collect()
+        o2 = self.pop_root()
+        assert stm_get_obj_pages(o2) == page1
+
     def test_mark_recursive(self):
         def make_chain(sz):
             prev = ffi.cast("object_t *", ffi.NULL)
@@ -247,3 +287,135 @@ class TestGCPage(BaseTest):
         p1 = self.pop_root()
         assert stm_get_char(p1) == 'o'
         assert stm_get_char(p2) == 't'
+
+    def _make_chain(self, length):
+        head = ffi.cast("object_t *", 0)
+        for i in range(length):
+            self.push_root(head)
+            o = stm_allocate_refs(2)
+            head = self.pop_root()
+            stm_set_ref(o, 0, head)
+            head = o
+        return head
+
+    def _chain_length(self, o):
+        n = 0
+        while o:
+            n += 1
+            o = stm_get_ref(o, 0)
+        return n
+
+    def _finish_incremental_marking(self):
+        for i in range(100):
+            if not lib._stm_major_marking_in_progress():
+                break
+            lib._stm_request_major_collection()
+            lib.stm_collect(0)
+        assert not lib._stm_major_marking_in_progress()
+
+    def test_incremental_marking(self):
+        lib.stm_set_major_gc_pause_budget(1)    # slices of ~255 objects
+        self.start_transaction()
+        self.push_root(self._make_chain(2000))
+        self.commit_transaction()
+        #
+        self.start_transaction()
+        stm_major_collect()
+        assert not lib._stm_major_marking_in_progress()
+        total = lib._stm_total_allocated()
+        lib._stm_request_major_collection()
+        lib.stm_collect(0)
+        assert lib._stm_major_marking_in_progress()
+        #
+        # cut the chain after 1000 objects, and attach the objects from
+        # 1499 onwards to the head, which has already been traced
+        x = self.pop_root()
+        self.push_root(x)
+        y = x
+        for i in range(999):
+            y = stm_get_ref(y, 0)
+        z = y
+        for i in range(500):
+            z = stm_get_ref(z, 0)
+        stm_set_ref(y, 0, ffi.cast("object_t *", 0))
+        stm_set_ref(x, 1, z)
+        self.commit_transaction()
+        #
+        self.start_transaction()
+        self._finish_incremental_marking()
+        self.commit_transaction()
+        x = self.pop_root()
+        #
+        self.start_transaction()
+        assert self._chain_length(x) == 1000
+        assert self._chain_length(stm_get_ref(x, 1)) == 501
+        total2 = lib._stm_total_allocated()
+        assert total2 < total
+        self.push_root(x)
+        stm_major_collect()
+        self.pop_root()
+        assert lib._stm_total_allocated() == total2
+
+    def test_readonly_commit_leaves_major_collection(self):
+        lib.stm_set_major_gc_pause_budget(1)    # slices of ~255 objects
+        self.start_transaction()
+        self.push_root(self._make_chain(1000))
+        self.commit_transaction()
+        #
+        self.start_transaction(readonly=True)
+        lib._stm_request_major_collection()
+        self.commit_transaction()
+        assert not lib._stm_major_marking_in_progress()
+        #
+        self.start_transaction()     # does it, even if it didn't write
+        self.commit_transaction()
+        assert lib._stm_major_marking_in_progress()
+        self.start_transaction()
+        self._finish_incremental_marking()
+        self.commit_transaction()
+
+    def test_incremental_marking_abort(self):
+        lib.stm_set_major_gc_pause_budget(1)    # slices of ~255 objects
+        self.start_transaction()
+        self.push_root(self._make_chain(1000))
+        self.push_root(self._make_chain(2000))   # traced first
+        self.commit_transaction()
+        #
+        self.start_transaction()
+        lib._stm_request_major_collection()
+        lib.stm_collect(0)
+        assert lib._stm_major_marking_in_progress()
+        #
+        # cut the second chain in this transaction; the incremental
+        # marking sees the cut, but then the transaction aborts
+        x = self.pop_root()
+        self.push_root(x)
+        for i in range(1499):
+            x = stm_get_ref(x, 0)
+        stm_set_ref(x, 0, ffi.cast("object_t *", 0))
+        for i in range(6):
+            lib._stm_request_major_collection()
+            lib.stm_collect(0)
+        assert lib._stm_major_marking_in_progress()
+        self.abort_transaction()
+        #
+        self.start_transaction()
+        self._finish_incremental_marking()
+        self.commit_transaction()
+        x = self.pop_root()
+        y = self.pop_root()
+        self.start_transaction()
+        assert self._chain_length(x) == 2000
+        assert self._chain_length(y) == 1000
+
+    def test_incremental_marking_forced(self):
+        lib.stm_set_major_gc_pause_budget(1)
+        self.start_transaction()
+        self.push_root(self._make_chain(2000))
+        stm_minor_collect()
+        lib._stm_request_major_collection()
+        lib.stm_collect(0)
+        assert lib._stm_major_marking_in_progress()
+        stm_major_collect()
+        assert not lib._stm_major_marking_in_progress()
+        assert self._chain_length(self.pop_root()) == 2000
@@ -246,6 +246,35 @@ class TestHashtable(BaseTestHashtable):
         assert htget(h, 11) != ffi.NULL
         assert htget(h, 12) != ffi.NULL
 
+    def test_readonly_transaction_adds_entry(self):
+        lib.stm_set_major_gc_pause_budget(1)    # slices of ~255 objects
+        self.start_transaction()
+        h = self.allocate_hashtable()
+        tl0 = self.tls[self.current_thread]
+        for i in range(1000):
+            htset(h, i, stm_allocate(16), tl0)
+        self.push_root(h)
+        self.commit_transaction()
+        #
+        self.start_transaction(readonly=True)
+        h = self.pop_root()
+        self.push_root(h)
+        lib._stm_request_major_collection()
+        assert htget(h, 5000) == ffi.NULL     # allocates an entry
+        self.commit_transaction()
+        assert lib._stm_major_marking_in_progress()
+        #
+        self.start_transaction()
+        for i in range(100):
+            if not lib._stm_major_marking_in_progress():
+                break
+            lib._stm_request_major_collection()
+            lib.stm_collect(0)
+        assert not lib._stm_major_marking_in_progress()
+        self.pop_root()
+        stm_major_collect()       # to get rid of the hashtable object
+        self.commit_transaction()
+
 
 class TestRandomHashtable(BaseTestHashtable):
 
@@ -49,6 +49,40 @@ class TestLargeMalloc(BaseTest):
         #
         lib._stm_large_dump()
 
+    def test_reserve(self):
+        reserve = ffi.new("char **")
+        d1 = lib._stm_large_malloc_from_reserve(reserve, 600)
+        d2 = lib._stm_large_malloc_from_reserve(reserve, 600)
+        assert ra(d2) - ra(d1) == 616
+        assert ra(reserve[0]) - ra(d2) == 616
+        # the reserve is not in the free lists
+        d3 = lib._stm_large_malloc(600)
+        assert ra(d3) > ra(reserve[0])
+        # big requests don't come from the reserve
+        d4 = lib._stm_large_malloc_from_reserve(reserve, 50000)
+        assert ra(d4) > ra(d3)
+        assert ra(reserve[0]) - ra(d2) == 616
+        #
+        lib._stm_large_free(d1)
+        lib._stm_large_free(d2)
+        lib._stm_large_free(d3)
+        lib._stm_large_free(d4)
+        lib._stm_large_release_reserve(reserve)
+        assert reserve[0] == ffi.NULL
+        # everything was merged back
+        d5 = lib._stm_large_malloc(self.size - 32)
+        assert d5 == self.rawmem + 16
+
+    def test_reserve_refill(self):
+        reserve = ffi.new("char **")
+        for i in range(20):
+            d = lib._stm_large_malloc_from_reserve(reserve, 9000)
+            assert ra(d) == ra(self.rawmem) + 16 + i * 9016
+        # the reserve was refilled once, after 14 objects; the
+        # rest of the old reserve was merged into the new one
+        d1 = lib._stm_large_malloc(600)
+        assert ra(d1) == ra(self.rawmem) + 16 + 14 * 9016 + 128 * 1024 + 16
+
     def test_overflow_1(self):
         d = lib._stm_large_malloc(self.size - 32)
         assert ra(d) == self.rawmem + 16
@@ -177,5 +211,31 @@ class TestLargeMalloc(BaseTest):
                 else:
                     assert all_orig[i][50] == '\xDE'
 
+    def test_lazy_sweep(self):
+        @ffi.callback("bool(char *)")
+        def keep(data):
+            seen.append(data)
+            return data in keep_me
+        lib._stm_largemalloc_keep = keep
+        all = [lib._stm_large_malloc(600) for i in range(20)]
+        keep_me = set(all[::2])
+        seen = []
+        lib._stm_largemalloc_sweep_start()
+        assert lib._stm_largemalloc_sweep_pending()
+        assert seen == []
+        # an allocation sweeps a few chunks, and returns one of the
+        # chunks freed by that
+        d1 = lib._stm_large_malloc(600)
+        assert 0 < len(seen) < 20
+        assert d1 in seen and d1 not in keep_me
+        # this allocation can only be done from the end of the arena,
+        # which is not swept yet: the sweep must be finished first
+        d2 = lib._stm_large_malloc(5000)
+        assert not lib._stm_largemalloc_sweep_pending()
+        assert sorted(seen) == sorted(all)
+        assert ra(d2) > ra(all[-2])
+        lib._stm_largemalloc_sweep_finish()
+        assert len(seen) == 20
+
     def test_random_largemalloc_sweep_constrained_size_range(self):
         self.test_random_largemalloc_sweep(constrained_size_range=True)
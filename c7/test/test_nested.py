@@ -0,0 +1,160 @@
+from support import *
+import py
+
+
+class TestNested(BaseTest):
+
+    def test_commit_nested(self):
+        lp1 = stm_allocate_old(16)
+        stm_get_real_address(lp1)[HDR] = 'a'
+        #
+        self.start_transaction()
+        nested = self.begin_nested()
+        stm_set_char(lp1, 'b')
+        self.commit_nested(nested)
+        assert stm_get_char(lp1) == 'b'
+        self.commit_transaction()
+        self.check_char_everywhere(lp1, 'b')
+
+    def test_abort_nested(self):
+        lp1 = stm_allocate_old(16)
+        lp2 = stm_allocate_old(16)
+        stm_get_real_address(lp1)[HDR] = 'a'
+        stm_get_real_address(lp2)[HDR] = 'x'
+        #
+        self.start_transaction()
+        stm_set_char(lp1, 'b')
+        nested = self.begin_nested()
+        stm_set_char(lp1, 'c')      # already modified: saved
+        stm_set_char(lp2, 'y')      # first modified in the nested one
+        assert modified_old_objects() == [lp1, lp2]
+        self.abort_nested(nested)
+        #
+        assert lib._stm_in_transaction(self.get_stm_thread_local())
+        assert stm_get_char(lp1) == 'b'
+        assert stm_get_char(lp2) == 'x'
+        assert modified_old_objects() == [lp1]    # lock on lp2 released
+        assert not stm_was_written(lp1)
+        stm_set_char(lp1, 'd')
+        self.commit_transaction()
+        self.check_char_everywhere(lp1, 'd')
+        self.check_char_everywhere(lp2, 'x')
+
+    def test_abort_nested_throws_away_young_objects(self):
+        self.start_transaction()
+        lp1 = stm_allocate(16)
+        stm_set_char(lp1, 'a')
+        self.push_root(lp1)
+        nested = self.begin_nested()
+        lp1 = self.pop_root()
+        self.push_root(lp1)
+        assert not is_in_nursery(lp1)     # minor collection
+        #
+        lp2 = stm_allocate(16)
+        stm_set_char(lp1, 'b')            # overflow object: saved
+        self.push_root(lp2)
+        self.abort_nested(nested)
+        #
+        lp1b = self.pop_root()            # the shadowstack is restored
+        assert lp1b == lp1
+        assert stm_get_char(lp1) == 'a'
+        self.commit_transaction()
+
+    def test_nested_inside_nested(self):
+        lp1 = stm_allocate_old(16)
+        stm_get_real_address(lp1)[HDR] = 'a'
+        #
+        self.start_transaction()
+        nested1 = self.begin_nested()
+        stm_set_char(lp1, 'b')
+        nested2 = self.begin_nested()
+        stm_set_char(lp1, 'c')
+        self.abort_nested(nested2)
+        assert stm_get_char(lp1) == 'b'
+        #
+        nested2 = self.begin_nested()
+        stm_set_char(lp1, 'd')
+        self.commit_nested(nested2)
+        assert stm_get_char(lp1) == 'd'
+        self.abort_nested(nested1)
+        assert stm_get_char(lp1) == 'a'
+        assert modified_old_objects() == []
+        self.commit_transaction()
+        self.check_char_everywhere(lp1, 'a')
+
+    def test_abort_transaction_inside_nested(self):
+        lp1 = stm_allocate_old(16)
+        stm_get_real_address(lp1)[HDR] = 'a'
+        #
+        self.start_transaction()
+        stm_set_char(lp1, 'b')
+        self.begin_nested()
+        stm_set_char(lp1, 'c')
+        self.abort_transaction()
+        #
+        self.start_transaction()
+        assert stm_get_char(lp1) == 'a'
+        stm_set_char(lp1, 'e')      # not in a nested transaction any more
+        self.commit_transaction()
+        self.check_char_everywhere(lp1, 'e')
+
+    def test_write_write_conflict_rolls_back_nested_only(self):
+        lp1 = stm_allocate_old(16)
+        lp2 = stm_allocate_old(16)
+        #
+        self.start_transaction()
+        stm_set_char(lp1, 'a')          # acquire lock
+        #
+        self.switch(1)
+        self.start_transaction()
+        stm_set_char(lp2, 'b')
+        nested = self.begin_nested()
+        stm_set_char(lp2, 'c')
+        py.test.raises(NestedRollback, stm_write_nested, nested, lp1)
+        assert stm_get_char(lp2) == 'b'
+        assert modified_old_objects() == [lp2]
+        #
+        self.switch(0)
+        self.abort_transaction()        # releases the lock
+        #
+        self.switch(1)
+        nested = self.begin_nested()
+        stm_write_nested(nested, lp1)   # works now
+        self.commit_nested(nested)
+        self.commit_transaction()
+        self.check_char_everywhere(lp2, 'b')
+
+    def test_major_collection_keeps_saved_objects_alive(self):
+        lp1 = stm_allocate_old_refs(1)
+        #
+        self.start_transaction()
+        lp2 = stm_allocate(16)
+        stm_set_char(lp2, 'x')
+        stm_set_ref(lp1, 0, lp2)
+        nested = self.begin_nested()
+        lp2 = stm_get_ref(lp1, 0)       # moved out of the nursery
+        stm_set_ref(lp1, 0, ffi.NULL)   # only in the saved copy now
+        stm_major_collect()
+        self.abort_nested(nested)
+        #
+        assert stm_get_ref(lp1, 0) == lp2
+        assert stm_get_char(lp2) == 'x'
+        stm_major_collect()
+        assert stm_get_char(lp2) == 'x'
+        self.commit_transaction()
+
+    def test_abort_nested_calls_light_finalizers(self):
+        @ffi.callback("void(object_t *)")
+        def light_finalizer(obj):
+            seen.append(obj)
+        lib.stmcb_light_finalizer = light_finalizer
+        seen = []
+        #
+        self.start_transaction()
+        nested = self.begin_nested()
+        lp1 = stm_allocate(16)
+        lib.stm_enable_light_finalizer(lp1)
+        self.abort_nested(nested)
+        assert seen == [lp1]
+        self.commit_transaction()
+        lib.stmcb_light_finalizer = ffi.NULL
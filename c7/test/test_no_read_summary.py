@@ -0,0 +1,24 @@
+import py
+import os, sys, subprocess
+
+
+class TestNoReadSummary:
+    # The other test files use a library built with STM_READ_SUMMARY
+    # (see support.py).  Run again the ones that depend most on the read
+    # markers, with a library built without it.
+
+    def _run(self, filename):
+        env = os.environ.copy()
+        env['STM_TEST_READ_SUMMARY'] = '0'
+        cmd = [sys.executable, '-m', 'pytest', filename]
+        print ' '.join(cmd)
+        err = subprocess.call(cmd, env=env,
+                              cwd=os.path.dirname(os.path.abspath(__file__)))
+        if err: py.test.fail("'%s' failed (result %r)" % (' '.join(cmd), err))
+
+    def test_basic(self):          self._run("test_basic.py")
+    def test_card_marking(self):   self._run("test_card_marking.py")
+    def test_gcpage(self):         self._run("test_gcpage.py")
+    def test_hashtable(self):      self._run("test_hashtable.py")
+    def test_nursery(self):        self._run("test_nursery.py")
+    def test_random(self):         self._run("test_random.py")
@@ -327,6 +327,39 @@ void test7(void)
 
 /************************************************************/
 
+__attribute__((noinline))
+int _8callback(void)
+{
+    rewind_jmp_buf buf;
+    rewind_jmp_enterframe(&gthread, &buf, NULL);
+    int result = rewind_jmp_setjmp(&gthread, NULL);
+    rewind_jmp_leaveframe(&gthread, &buf, NULL);
+    return result;
+}
+
+__attribute__((noinline))
+void _8foreign_code(void)
+{
+    /* no rewind_jmp_buf in this frame */
+    int x = _8callback();
+    gevent(x);
+    if (x < 3)
+        rewind_jmp_longjmp(&gthread);
+}
+
+void test8(void)
+{
+    rewind_jmp_enter_outermost(&gthread, __builtin_frame_address(0), NULL);
+    _8foreign_code();
+    assert(rewind_jmp_armed(&gthread));
+    rewind_jmp_forget(&gthread);
+    rewind_jmp_leave_outermost(&gthread);
+    int expected[] = {0, 1, 2, 3};
+    CHECK(expected);
+}
+
+/************************************************************/
+
 int rj_malloc_count = 0;
 
 void *rj_malloc(size_t size)
@@ -356,6 +389,7 @@ int main(int argc, char *argv[])
     else if (!strcmp(argv[1], "5"))  test5();
     else if (!strcmp(argv[1], "6"))  test6();
     else if (!strcmp(argv[1], "7"))  test7();
+    else if (!strcmp(argv[1], "8"))  test8();
     else if (!strcmp(argv[1], "TL1")) testTL1();
     else if (!strcmp(argv[1], "TL2")) testTL2();
     else
@@ -266,7 +266,7 @@ class TestMajorCollection(BaseTest):
 
     def test_multiple_threads(self):
         self.start_transaction()
-        lp0 = stm_allocate(48)
+        lp0 = stm_allocate(16)    # same size class as the weakref
         lp1 = stm_allocate_weakref(lp0)    # no collection here
         self.push_root(lp1)
         self.push_root(lp0)